@@ -7,6 +7,8 @@
 #include <esp_adc/adc_cali.h>
 #include <nvs_flash.h>
 #include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include "adc.h"
 #include "application.h"
@@ -40,6 +42,10 @@ bool adc_read_from_nvs()
             adc.multiplier = 1;
         else
             adc.multiplier = multiplier / 1000.0;
+        if(nvs_get_u8(handle, "rate", &(adc.rate)) != ESP_OK)
+            adc.rate = 0;
+        if(nvs_get_u8(handle, "burst", &(adc.burst)) != ESP_OK)
+            adc.burst = 0;
         nvs_close(handle);
         ESP_LOGI(__func__, "done");
         return true;
@@ -61,6 +67,8 @@ bool adc_write_to_nvs()
         ok = ok && !nvs_set_i32(handle, "channels", adc.channels);
         ok = ok && !nvs_set_u8(handle, "power_pin", adc.power_pin);
         ok = ok && !nvs_set_i32(handle, "multiplier", (int32_t) (adc.multiplier * 1000));
+        ok = ok && !nvs_set_u8(handle, "rate", adc.rate);
+        ok = ok && !nvs_set_u8(handle, "burst", adc.burst);
         ok = ok && !nvs_commit(handle);
         nvs_close(handle);
         ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
@@ -106,6 +114,20 @@ static bool write_resource_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, SCHEMA_FLOAT);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "rate");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, ADC_RATE_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "burst");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
         ok = ok && bp_finish_container(writer);
     ok = ok && bp_finish_container(writer);
     return ok;
@@ -148,6 +170,10 @@ uint32_t adc_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wri
             ok = ok && (adc.power_pin == 0xFF ? bp_put_none(writer) : bp_put_integer(writer, adc.power_pin));
             ok = ok && bp_put_string(writer, "multiplier");
             ok = ok && bp_put_float(writer, adc.multiplier);
+            ok = ok && bp_put_string(writer, "rate");
+            ok = ok && bp_put_integer(writer, adc.rate);
+            ok = ok && bp_put_string(writer, "burst");
+            ok = ok && bp_put_integer(writer, adc.burst);
         ok = ok && bp_finish_container(writer);
         return ok ? PM_205_Content : PM_500_Internal_Server_Error;
     }
@@ -178,6 +204,12 @@ uint32_t adc_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wri
                     adc.power_pin = bp_is_none(reader) ? 0xFF : bp_get_integer(reader);
                 else if(bp_match(reader, "multiplier"))
                     adc.multiplier = bp_get_float(reader);
+                else if(bp_match(reader, "rate")) {
+                    adc.rate = bp_get_integer(reader);
+                    ok = ok && (!adc.rate || (adc.rate >= ADC_RATE_MIN && adc.rate <= ADC_RATE_MAX));
+                }
+                else if(bp_match(reader, "burst"))
+                    adc.burst = bp_get_integer(reader);
                 else
                     bp_next(reader);
             }
@@ -193,86 +225,216 @@ uint32_t adc_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wri
         return PM_405_Method_Not_Allowed;
 }
 
-bool adc_measure()
+// The ADC is powered and set up for each measurement, and released when it ends.
+
+static bool adc_open(adc_oneshot_unit_handle_t *handle, adc_cali_handle_t *cali_handle)
 {
     bool ok = true;
-    if(adc.channels) {
-        int gpio;
-        int adc_raw;
-        int voltage;
 
-        if(adc.power_pin != 0xFF) {
-            gpio_config_t io_conf = {};
-            io_conf.intr_type = GPIO_INTR_DISABLE;
-            io_conf.mode = GPIO_MODE_OUTPUT;
-            io_conf.pin_bit_mask = 1ULL << adc.power_pin;
-            io_conf.pull_down_en = 0;
-            io_conf.pull_up_en = 0;
-            gpio_config(&io_conf);
-            gpio_set_level(adc.power_pin, true);
-        }
+    if(adc.power_pin != 0xFF) {
+        gpio_config_t io_conf = {};
+        io_conf.intr_type = GPIO_INTR_DISABLE;
+        io_conf.mode = GPIO_MODE_OUTPUT;
+        io_conf.pin_bit_mask = 1ULL << adc.power_pin;
+        io_conf.pull_down_en = 0;
+        io_conf.pull_up_en = 0;
+        gpio_config(&io_conf);
+        gpio_set_level(adc.power_pin, true);
+    }
 
-        adc_cali_handle_t cali_handle = NULL;
-        adc_oneshot_unit_handle_t handle = NULL;
-        adc_oneshot_unit_init_cfg_t init_config = {
-            .unit_id = ADC_UNIT_1,
-            .ulp_mode = ADC_ULP_MODE_DISABLE,
-        };
+    *cali_handle = NULL;
+    *handle = NULL;
+    adc_oneshot_unit_init_cfg_t init_config = {
+        .unit_id = ADC_UNIT_1,
+        .ulp_mode = ADC_ULP_MODE_DISABLE,
+    };
 
-        ok = ok && adc_oneshot_new_unit(&init_config, &handle) == ESP_OK;
+    ok = ok && adc_oneshot_new_unit(&init_config, handle) == ESP_OK;
 
-        // configure channels
-        adc_oneshot_chan_cfg_t config = {
+    // configure channels
+    adc_oneshot_chan_cfg_t config = {
+        .atten = ADC_ATTEN_DB_12,
+        .bitwidth = ADC_BITWIDTH_12,
+    };
+    for(int channel = 0; channel != ADC_CHANNELS_NUM_MAX && ok; channel++)
+        if(adc.channels & (1 << channel))
+            ok = ok && adc_oneshot_config_channel(*handle, channel, &config) == ESP_OK;
+
+    // calibrate
+    #if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+        adc_cali_curve_fitting_config_t cali_config = {
+            .unit_id = ADC_UNIT_1,
             .atten = ADC_ATTEN_DB_12,
             .bitwidth = ADC_BITWIDTH_12,
         };
-        for(int channel = 0; channel != ADC_CHANNELS_NUM_MAX && ok; channel++)
-            if(adc.channels & (1 << channel))
-                ok = ok && adc_oneshot_config_channel(handle, channel, &config) == ESP_OK;
+        ok = ok && adc_cali_create_scheme_curve_fitting(&cali_config, cali_handle) == ESP_OK;
+    #elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+        adc_cali_line_fitting_config_t cali_config = {
+            .unit_id = ADC_UNIT_1,
+            .atten = ADC_ATTEN_DB_12,
+            .bitwidth = ADC_BITWIDTH_12,
+        };
+        ok = ok && adc_cali_create_scheme_line_fitting(&cali_config, cali_handle) == ESP_OK;
+    #endif
+    return ok;
+}
 
-        // calibrate
+static void adc_close(adc_oneshot_unit_handle_t handle, adc_cali_handle_t cali_handle)
+{
+    if(cali_handle != NULL) {
         #if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
-            adc_cali_curve_fitting_config_t cali_config = {
-                .unit_id = ADC_UNIT_1,
-                .atten = ADC_ATTEN_DB_12,
-                .bitwidth = ADC_BITWIDTH_12,
-            };
-            ok = ok && adc_cali_create_scheme_curve_fitting(&cali_config, &cali_handle) == ESP_OK;
+            adc_cali_delete_scheme_curve_fitting(cali_handle);
         #elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
-            adc_cali_line_fitting_config_t cali_config = {
-                .unit_id = ADC_UNIT_1,
-                .atten = ADC_ATTEN_DB_12,
-                .bitwidth = ADC_BITWIDTH_12,
-            };
-            ok = ok && adc_cali_create_scheme_line_fitting(&cali_config, &cali_handle) == ESP_OK;
+            adc_cali_delete_scheme_line_fitting(cali_handle);
         #endif
+    }
+    if(handle != NULL)
+        adc_oneshot_del_unit(handle);
+
+    if(adc.power_pin != 0xFF)
+        gpio_set_level(adc.power_pin, false);
+}
+
+// High rate mode, a burst of samples per channel taken at a fixed rate into a measurements block per channel.
+// Their timestamps are offsets from the first sample, whose wall time comes from a clock synced before
+// the ADC was set up. The samples are taken by a task of their own, woken by a periodic esp_timer with
+// the period in microseconds, so the main loop carries on meanwhile and waits for adc_bursting() to
+// turn false before using the blocks.
+
+typedef struct {
+    adc_oneshot_unit_handle_t handle;
+    adc_cali_handle_t cali_handle;
+    int blocks[ADC_CHANNELS_NUM_MAX];
+    uint16_t samples;
+    uint32_t period;                // microseconds
+} adc_burst_t;
+
+static adc_burst_t adc_burst;
+static TaskHandle_t volatile adc_burst_task = NULL;    // NULL when no burst is running
+static esp_timer_handle_t adc_burst_timer = NULL;
+
+static void adc_burst_tick(void *arg)
+{
+    xTaskNotifyGive(adc_burst_task);
+}
 
-        // measure channels
+static void adc_burst_run(void *arg)
+{
+    bool ok = true;
+    int adc_raw;
+    int voltage;
+
+    if(esp_timer_start_periodic(adc_burst_timer, adc_burst.period) != ESP_OK) {
+        ESP_LOGE(__func__, "esp_timer_start_periodic failed, taking a single sample");
+        adc_burst.samples = 1;
+    }
+    for(uint16_t sample = 0; sample < adc_burst.samples && ok; sample++) {
+        if(sample)
+            ulTaskNotifyTake(pdFALSE, portMAX_DELAY);      // one tick per sample, even if some come late
         for(int channel = 0; channel != ADC_CHANNELS_NUM_MAX && ok; channel++) {
-            if(adc.channels & (1 << channel)) {
-                ok = ok && adc_oneshot_channel_to_io(ADC_UNIT_1, channel, &gpio) == ESP_OK;
-                ok = ok && adc_oneshot_read(handle, channel, &adc_raw) == ESP_OK;
-                if(cali_handle != NULL) {
-                    ok = ok && adc_cali_raw_to_voltage(cali_handle, adc_raw, &voltage);
-                    measurements_append(board.id, RESOURCE_ADC, 0, 0, 0, 0, 0, gpio, METRIC_DCvoltage, NOW, UNIT_V, voltage * adc.multiplier / 1000.0);
-                }
-                else
-                    measurements_append(board.id, RESOURCE_ADC, 0, 0, 0, 0, 0, gpio, METRIC_ADCvalue, NOW, UNIT_NONE, adc_raw);
+            if(adc_burst.blocks[channel] < 0)
+                continue;
+            ok = ok && adc_oneshot_read(adc_burst.handle, channel, &adc_raw) == ESP_OK;
+            if(adc_burst.cali_handle != NULL) {
+                ok = ok && adc_cali_raw_to_voltage(adc_burst.cali_handle, adc_raw, &voltage) == ESP_OK;
+                measurements_block_append(adc_burst.blocks[channel], voltage * adc.multiplier / 1000.0);
             }
+            else
+                measurements_block_append(adc_burst.blocks[channel], adc_raw);
         }
+    }
+    esp_timer_stop(adc_burst_timer);
+    adc_close(adc_burst.handle, adc_burst.cali_handle);
+    if(!ok)
+        ESP_LOGE(__func__, "burst failed");
+    adc_burst_task = NULL;
+    vTaskDelete(NULL);
+}
+
+// Begins the blocks and starts the task, which closes the ADC when it ends. The blocks are begun
+// here so that the main loop sees them all as soon as this returns, in place of those of the last
+// burst if they were not sent. The task handle is set before the task runs, and the task runs first,
+// with the higher priority.
 
-        if(cali_handle != NULL) {
-            #if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
-                adc_cali_delete_scheme_curve_fitting(cali_handle);
-            #elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
-                adc_cali_delete_scheme_line_fitting(cali_handle);
-            #endif
+static bool adc_burst_start(adc_oneshot_unit_handle_t handle, adc_cali_handle_t cali_handle, now_clock_t *clock)
+{
+    bool ok = true;
+    int gpio;
+    uint32_t period = 1000000 / adc.rate;
+    int64_t base_time = now_clock_milliseconds(clock);
+    esp_timer_create_args_t timer_args = { .callback = adc_burst_tick, .name = "adc_burst" };
+
+    adc_burst = (adc_burst_t) { .handle = handle, .cali_handle = cali_handle, .samples = 0, .period = period };
+    measurements_blocks_clear();
+    for(int channel = 0; channel != ADC_CHANNELS_NUM_MAX && ok; channel++) {
+        adc_burst.blocks[channel] = -1;
+        if(adc.channels & (1 << channel)) {
+            ok = ok && adc_oneshot_channel_to_io(ADC_UNIT_1, channel, &gpio) == ESP_OK;
+            adc_burst.blocks[channel] = measurements_block_begin(board.id, RESOURCE_ADC, 0, 0, 0, 0, 0, gpio,
+                cali_handle != NULL ? METRIC_DCvoltage : METRIC_ADCvalue, cali_handle != NULL ? UNIT_V : UNIT_NONE,
+                base_time, period, adc.burst);
+            if(adc_burst.blocks[channel] < 0)
+                ESP_LOGE(__func__, "no room for the block of channel %i", channel);
+            else if(measurements_blocks[adc_burst.blocks[channel]].size < adc.burst)
+                ESP_LOGE(__func__, "block of channel %i truncated to %u samples", channel, measurements_blocks[adc_burst.blocks[channel]].size);
+            if(adc_burst.blocks[channel] >= 0 && measurements_blocks[adc_burst.blocks[channel]].size > adc_burst.samples)
+                adc_burst.samples = measurements_blocks[adc_burst.blocks[channel]].size;
         }
-        if(handle != NULL)
-            adc_oneshot_del_unit(handle);
+    }
+    ok = ok && adc_burst.samples;
+    ok = ok && (adc_burst_timer || esp_timer_create(&timer_args, &adc_burst_timer) == ESP_OK);
+    ok = ok && xTaskCreate(adc_burst_run, "adc_burst", ADC_BURST_STACK_SIZE, NULL, uxTaskPriorityGet(NULL) + 1,
+                           (TaskHandle_t *) &adc_burst_task) == pdPASS;
+    if(!ok)
+        adc_burst_task = NULL;
+    return ok;
+}
 
-        if(adc.power_pin != 0xFF)
-            gpio_set_level(adc.power_pin, false);
+bool adc_bursting()
+{
+    return adc_burst_task != NULL;
+}
+
+bool adc_measure()
+{
+    bool ok = true;
+    if(adc.channels) {
+        int gpio;
+        int adc_raw;
+        int voltage;
+        now_clock_t clock;
+        adc_oneshot_unit_handle_t handle;
+        adc_cali_handle_t cali_handle;
+
+        if(adc_bursting()) {
+            ESP_LOGE(__func__, "the previous burst is still running");
+            return false;
+        }
+        now_clock_sync(&clock);
+        ok = adc_open(&handle, &cali_handle);
+
+        // measure channels, with the store enabled the blocks of the high rate mode are sent with the
+        // first stored batch of the upload they force
+        if(ok && adc.rate && adc.burst > 1) {
+            if(adc_burst_start(handle, cali_handle, &clock))
+                return true;
+            ok = false;
+        }
+        else {
+            for(int channel = 0; channel != ADC_CHANNELS_NUM_MAX && ok; channel++) {
+                if(adc.channels & (1 << channel)) {
+                    ok = ok && adc_oneshot_channel_to_io(ADC_UNIT_1, channel, &gpio) == ESP_OK;
+                    ok = ok && adc_oneshot_read(handle, channel, &adc_raw) == ESP_OK;
+                    if(cali_handle != NULL) {
+                        ok = ok && adc_cali_raw_to_voltage(cali_handle, adc_raw, &voltage) == ESP_OK;
+                        measurements_append(board.id, RESOURCE_ADC, 0, 0, 0, 0, 0, gpio, METRIC_DCvoltage, NOW_MS, UNIT_V, voltage * adc.multiplier / 1000.0);
+                    }
+                    else
+                        measurements_append(board.id, RESOURCE_ADC, 0, 0, 0, 0, 0, gpio, METRIC_ADCvalue, NOW_MS, UNIT_NONE, adc_raw);
+                }
+            }
+        }
+        adc_close(handle, cali_handle);
     }
     return ok;
 }
@@ -8,11 +8,16 @@
 #include "postman.h"
 
 #define ADC_CHANNELS_NUM_MAX 10
+#define ADC_RATE_MIN 10			// Hz of the high rate mode
+#define ADC_RATE_MAX 100
+#define ADC_BURST_STACK_SIZE 3072
 
 typedef struct {
 	int32_t channels;
 	float multiplier;
 	uint8_t power_pin;
+	uint8_t rate;				// Hz, 0 for a single sample per channel and measurement
+	uint8_t burst;				// samples per channel and measurement in the high rate mode
 } adc_t;
 
 extern adc_t adc;
@@ -21,6 +26,7 @@ void adc_init();
 bool adc_read_from_nvs();
 bool adc_write_to_nvs();
 bool adc_measure();
+bool adc_bursting();
 bool adc_schema_handler(char *resource_name, bp_pack_t *writer);
 uint32_t adc_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
 
@@ -44,6 +44,7 @@
 #include "onewire.h"
 #include "postman.h"
 #include "schema.h"
+#include "store.h"
 #include "wifi.h"
 #include "yuarel.h"
 
@@ -51,6 +52,9 @@
 #define UART_BUFFER_SIZE                POSTMAN_PACKET_LENGTH_MAX
 #define UART_NUMBER                     UART_NUM_0
 #define USB_SERIAL_JTAG_BUFFER_SIZE     1024
+#define HTTP_CHUNK_LENGTH_MAX           1024                            // Encoded measurements written to HTTP at a time
+#define HTTP_REDIRECTIONS_NUM_MAX       10                              // Same limits as esp_http_client_perform
+#define HTTP_AUTHORIZATIONS_NUM_MAX     1
 
 framer_t framer;
 postman_t postman;
@@ -59,12 +63,15 @@ uint32_t postman_buffer[POSTMAN_PACKET_LENGTH_MAX / 4];
 
 size_t backend_buffer_length = 0;
 alignas(4) char backend_buffer[POSTMAN_PACKET_LENGTH_MAX];
+char http_chunk_buffer[HTTP_CHUNK_LENGTH_MAX];
 
 time_t http_timestamp = 0;
 
 bool sntp_started = false;
+bool clock_set = false;
 extern bool backends_started;
 RTC_DATA_ATTR bool slept_once = false;
+RTC_DATA_ATTR uint8_t wakes_since_upload = 0;
 
 void nvs_init()
 {
@@ -223,16 +230,16 @@ size_t encode_measurements(uint8_t backend_index)
         case BACKEND_FORMAT_SENML:
             ok = ok && measurements_to_senml(backend_buffer, &length);
             break;
+        case BACKEND_FORMAT_SENML_CBOR:
+            ok = ok && measurements_to_senml_cbor(backend_buffer, &length);
+            break;
         case BACKEND_FORMAT_POSTMAN:
             ok = ok && measurements_to_postman(backend_buffer, &length,
                 backends[backend_index].auth == BACKEND_AUTH_POSTMAN ? backends[backend_index].user : NULL,
                 backends[backend_index].auth == BACKEND_AUTH_POSTMAN ? backends[backend_index].key : NULL);
             break;
         case BACKEND_FORMAT_TEMPLATE:
-            ok = ok && measurements_to_template(backend_buffer, &length,
-                backends[backend_index].template_header, backends[backend_index].template_row,
-                backends[backend_index].template_row_separator, backends[backend_index].template_path_separator,
-                backends[backend_index].template_footer);
+            ok = ok && measurements_to_template(backend_buffer, &length, &backends[backend_index].template);
             break;
         default:
             ok = false;
@@ -252,12 +259,431 @@ size_t encode_measurements(uint8_t backend_index)
     return length;
 }
 
+// Writes the measurements to an HTTP request with chunked transfer encoding, encoding a chunk at a time so that
+// the size of the request is not limited by the backend buffer, and reads the response headers.
+
+static esp_err_t write_measurements_chunks(esp_http_client_handle_t client, uint8_t backend_index)
+{
+    esp_err_t err;
+    size_t length;
+    char chunk_header[12];
+    measurements_encoder_t encoder;
+
+    measurements_encoder_init(&encoder, backends[backend_index].format, &backends[backend_index].template);
+
+    err = esp_http_client_open(client, -1);
+    while(!err && encoder.stage != MEASUREMENTS_ENCODER_DONE) {
+        length = sizeof(http_chunk_buffer);
+        if(!measurements_encode(&encoder, http_chunk_buffer, &length)) {
+            ESP_LOGE(__func__, "measurement larger than the chunk buffer!");
+            err = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        if(!length)         // an empty footer after a full buffer, a zero length chunk would end the body
+            continue;
+        snprintf(chunk_header, sizeof(chunk_header), "%x\r\n", (unsigned int) length);
+        if(esp_http_client_write(client, chunk_header, strlen(chunk_header)) < 0 ||
+           esp_http_client_write(client, http_chunk_buffer, length) < 0 ||
+           esp_http_client_write(client, "\r\n", 2) < 0)
+            err = ESP_FAIL;
+    }
+    if(!err && esp_http_client_write(client, "0\r\n\r\n", 5) < 0)
+        err = ESP_FAIL;
+    if(!err && esp_http_client_fetch_headers(client) < 0)
+        err = ESP_FAIL;
+    return err;
+}
+
+// Sends the request again with the credentials asked in a 401 response or to the location of a redirection,
+// as esp_http_client_perform does, and reads the last response into the backend buffer. 303 responses are
+// not followed, as they ask for a GET of the result instead of the measurements.
+
+esp_err_t stream_measurements(esp_http_client_handle_t client, uint8_t backend_index)
+{
+    esp_err_t err;
+    bool again;
+    uint8_t redirections = 0, authorizations = 0;
+
+    do {
+        again = false;
+        err = write_measurements_chunks(client, backend_index);
+        if(!err) {
+            switch(esp_http_client_get_status_code(client)) {
+                case HttpStatus_Unauthorized:
+                    again = authorizations++ < HTTP_AUTHORIZATIONS_NUM_MAX && esp_http_client_add_auth(client) == ESP_OK;
+                    break;
+                case HttpStatus_MovedPermanently:
+                case HttpStatus_Found:
+                case HttpStatus_TemporaryRedirect:
+                case HttpStatus_PermanentRedirect:
+                    again = redirections++ < HTTP_REDIRECTIONS_NUM_MAX && esp_http_client_set_redirection(client) == ESP_OK;
+                    break;
+                default:
+                    break;
+            }
+        }
+        backend_buffer_length = 0;
+        if(!err)
+            err = esp_http_client_flush_response(client, NULL);      // the body goes to the backend buffer through the event handler
+        esp_http_client_close(client);
+    } while(!err && again);
+    return err;
+}
+
+// Measurements taken while the clock was not set have monotonic timestamps, placed in wall time once it is.
+
+void set_clock()
+{
+    now_sync_monotonic();
+    measurements_place_timestamps();
+    clock_set = NOW != 0;
+}
+
+// Sends the measurements in RAM to a backend, returning whether the backend accepted them.
+
+bool send_measurements(uint8_t i)
+{
+    esp_err_t err;
+    bool delivered = false;
+
+    switch(backends[i].uri[0]) {
+    case 'h': {     // http / https
+        esp_http_client_config_t config_post = {
+            .url = backends[i].uri,
+            .cert_pem = backends[i].server_cert[0] ? backends[i].server_cert : NULL,
+            .crt_bundle_attach = backends[i].server_cert[0] ? NULL : esp_crt_bundle_attach,
+            .is_async = false,
+            .timeout_ms = 7000,
+            .event_handler = http_event_handler,
+            .max_redirection_count = HTTP_REDIRECTIONS_NUM_MAX,
+            .max_authorization_retries = HTTP_AUTHORIZATIONS_NUM_MAX,
+        };
+
+        esp_http_client_handle_t client = esp_http_client_init(&config_post);
+        if(!client) {
+            backends[i].status = BACKEND_STATUS_ERROR;
+            backends[i].error = ESP_ERR_INVALID_ARG;
+            backends[i].message[0] = 0;
+            return false;
+        }
+
+        switch(backends[i].auth) {
+            case BACKEND_AUTH_BASIC:
+                esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_BASIC);
+                esp_http_client_set_username(client, backends[i].user);
+                esp_http_client_set_password(client, backends[i].key);
+                break;
+            case BACKEND_AUTH_DIGEST:
+                esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_DIGEST);
+                esp_http_client_set_username(client, backends[i].user);
+                esp_http_client_set_password(client, backends[i].key);
+                break;
+            case BACKEND_AUTH_BEARER:
+                snprintf(backend_buffer, sizeof(backend_buffer), "Bearer %s", backends[i].key);
+                esp_http_client_set_header(client, "Authorization", backend_buffer);
+                break;
+            case BACKEND_AUTH_TOKEN:
+                snprintf(backend_buffer, sizeof(backend_buffer), "Token %s", backends[i].key);
+                esp_http_client_set_header(client, "Authorization", backend_buffer);
+                break;
+            case BACKEND_AUTH_HEADER:
+                esp_http_client_set_header(client, backends[i].user, backends[i].key);
+                break;
+        }
+
+        // the Date of the backend sets the clock if it is not set, to place the measurements taken before
+        if(!NOW) {
+            http_timestamp = 0;
+            backend_buffer_length = 0;
+            esp_http_client_set_method(client, HTTP_METHOD_HEAD);
+            err = esp_http_client_perform(client);
+            if(err == ESP_OK) {
+                struct timeval now = { .tv_sec = http_timestamp };
+                settimeofday(&now, NULL);
+                set_clock();
+                ESP_LOGI(__func__, "System time set to HTTP Date: %lli", http_timestamp);
+            }
+            else {
+                backends[i].status = BACKEND_STATUS_ERROR;
+                backends[i].error = err;
+                backends[i].message[0] = 0;
+                return false;
+            }
+        }
+
+        if(backends[i].content_type[0])
+            esp_http_client_set_header(client, "Content-Type", backends[i].content_type);
+        else {
+            switch(backends[i].format) {
+                case BACKEND_FORMAT_SENML:
+                    esp_http_client_set_header(client, "Content-Type", "application/json"); break;
+                case BACKEND_FORMAT_SENML_CBOR:
+                    esp_http_client_set_header(client, "Content-Type", "application/senml+cbor"); break;
+                case BACKEND_FORMAT_POSTMAN:
+                    esp_http_client_set_header(client, "Content-Type", "application/vnd.postman"); break;
+                case BACKEND_FORMAT_TEMPLATE:
+                    esp_http_client_set_header(client, "Content-Type", "text/plain; charset=utf-8"); break;
+            }
+        }
+
+        esp_http_client_set_method(client, HTTP_METHOD_POST);
+        if(backends[i].format == BACKEND_FORMAT_POSTMAN) {     // signed as a whole, so it is not streamed
+            backend_buffer_length = encode_measurements(i);
+            if(!backend_buffer_length)
+                return false;
+
+            esp_http_client_set_post_field(client, backend_buffer, backend_buffer_length);
+
+            backend_buffer_length = 0;
+            err = esp_http_client_perform(client);
+        }
+        else
+            err = stream_measurements(client, i);
+        if(err == ESP_OK) {
+            int status = esp_http_client_get_status_code(client);
+            backends[i].status = status < 300 ? BACKEND_STATUS_ONLINE : BACKEND_STATUS_ERROR;
+            delivered = status < 300;
+            backends[i].error = status + BACKEND_ERROR_HTTP_STATUS_BASE;
+            backend_buffer[backend_buffer_length] = 0;
+            strlcpy(backends[i].message, (char *)backend_buffer, sizeof(backends[i].message));
+
+            if(status >= 300)
+                ESP_LOGI(__func__, "HTTP Error %i: %s", status, backend_buffer);
+            else if(backend_buffer_length && backends[i].format == BACKEND_FORMAT_POSTMAN && backends[i].auth == BACKEND_AUTH_POSTMAN) {
+                hmac_sha256_key_t binary_key;
+                if(hmac_hex_decode(binary_key, sizeof(binary_key), backends[i].key, strlen(backends[i].key)) == sizeof(binary_key)) {
+                    ESP_LOGI(__func__, "Handling HTTP Postman request");
+                    backend_buffer_length = sizeof(bp_type_t) * postman_handle_pack(&postman,
+                        (bp_type_t *) backend_buffer,
+                        backend_buffer_length / sizeof(bp_type_t),
+                        sizeof(backend_buffer) / sizeof(bp_type_t),
+                        NOW, backends[i].user, binary_key);
+                    ESP_LOGI(__func__, "HTTP Postman response: buffer length %u", backend_buffer_length);
+                    if(backend_buffer_length) {
+                        esp_http_client_set_post_field(client, backend_buffer, backend_buffer_length);
+                        backend_buffer_length = 0;
+                        err = esp_http_client_perform(client);
+                        status = esp_http_client_get_status_code(client);
+                        ESP_LOGI(__func__, "HTTP Postman response: err %i status %i",err,status);
+                    }
+                }
+                else
+                    ESP_LOGI(__func__, "HMAC key is not 64 bytes long");
+            }
+        }
+        else {
+            backends[i].status = BACKEND_STATUS_ERROR;
+            backends[i].error = err;
+            backends[i].message[0] = 0;
+        }
+        esp_http_client_cleanup(client);
+        break;
+    }
+    case 'm':   // mqtt / mqtts
+        if(backends_started && (backend_buffer_length = encode_measurements(i)) != 0) {
+            // stored measurements are published with QoS 1 and only count as delivered after the PUBACK
+            backends[i].acknowledged_message = -1;
+            err = esp_mqtt_client_publish(backends[i].handle, backends[i].output_topic, backend_buffer, backend_buffer_length, application.store, 0);
+            backends[i].status = err < 0 ? BACKEND_STATUS_ERROR : BACKEND_STATUS_ONLINE;
+            delivered = err >= 0 && (!application.store || backends_wait_acknowledgement(i, err, BACKEND_ACKNOWLEDGEMENT_TIMEOUT));
+            backends[i].error = err;
+            backends[i].message[0] = 0;
+            ESP_LOGI(__func__, "esp_mqtt_client_publish: %s", err < 0 ? "failed" : delivered ? "done" : "not acknowledged");
+        }
+        break;
+    case 'u':   // udp
+        measurements_index_t index = 0;
+        measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+
+        struct yuarel url;
+        char url_string[BACKEND_URI_LENGTH];
+        strlcpy(url_string, backends[i].uri, BACKEND_URI_LENGTH);
+        if (yuarel_parse(&url, url_string)) {
+            backends[i].status = BACKEND_STATUS_ERROR;
+            backends[i].error = ESP_ERR_INVALID_ARG;
+            strlcpy(backends[i].message, "Parsing the URI failed", sizeof(backends[i].message));
+            ESP_LOGE(__func__, "Parsing the URI failed: %s", url_string);
+            break;
+        }
+
+        int    sock;
+        void   *addr;
+        size_t addr_size;
+        struct sockaddr_in  addr4 = {0};
+        struct sockaddr_in6 addr6 = {0};
+
+        if(url.host[0] != '[') {
+            addr4.sin_addr.s_addr = inet_addr(url.host);
+            addr4.sin_family = AF_INET;
+            addr4.sin_port = htons(url.port);
+            addr = &addr4;
+            addr_size = sizeof(addr4);
+            sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+        }
+        else {
+            url.host += 1;
+            url.host[strlen(url.host) - 1] = 0;
+            inet6_aton(url.host, &addr6.sin6_addr);
+            addr6.sin6_family = AF_INET6;
+            addr6.sin6_port = htons(url.port);
+            addr6.sin6_scope_id = esp_netif_get_netif_impl_index(wifi.netif);
+            addr = &addr6;
+            addr_size = sizeof(addr6);
+            sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_IPV6);
+        }
+        if (sock < 0) {
+            backends[i].status = BACKEND_STATUS_ERROR;
+            backends[i].error = errno;
+            strlcpy(backends[i].message, "Unable to create socket", sizeof(backends[i].message));
+            ESP_LOGE(__func__, "Unable to create socket: errno %d", errno);
+            break;
+        }
+
+        delivered = true;
+        for(int n = 0; n < count; n++) {
+            pbuf_t buf = { backend_buffer, sizeof(backend_buffer), 0 };
+            index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+
+            switch(backends[i].format) {
+            case BACKEND_FORMAT_SENML:
+                measurements_entry_to_senml_row(index, &buf);
+                break;
+            case BACKEND_FORMAT_SENML_CBOR:
+                measurements_entry_to_senml_cbor_row(index, &buf);
+                break;
+            case BACKEND_FORMAT_POSTMAN:
+                buf.length = buf.size;
+                measurements_entry_to_postman(index, buf.data, &buf.length,
+                    backends[i].auth == BACKEND_AUTH_POSTMAN ? backends[i].user : NULL,
+                    backends[i].auth == BACKEND_AUTH_POSTMAN ? backends[i].key : NULL);
+                break;
+            case BACKEND_FORMAT_TEMPLATE:
+                measurements_entry_to_template_row(index, &buf, &backends[i].template);
+                break;
+            case BACKEND_FORMAT_FRAME:
+                buf.length = sizeof(measurement_frame_t);
+                measurements_entry_to_frame(index, (measurement_frame_t *) buf.data);
+                break;
+            default:
+                backends[i].status = BACKEND_STATUS_ERROR;
+                backends[i].error = ESP_ERR_INVALID_ARG;
+                strlcpy(backends[i].message, "Unsupported format", sizeof(backends[i].message));
+                ESP_LOGE(__func__, "Unsupported format at backend %i", i);
+                delivered = false;
+                break;
+            }
+            if(buf.length) {
+                err = sendto(sock, buf.data, buf.length, 0, (struct sockaddr *) addr, addr_size);
+                delivered = delivered && err >= 0;
+                ESP_LOGI(__func__, "sent measurement %i via UDP: %s %i", index, err < 0 ? "failed" : "done", err);
+            }
+        }
+        close(sock);
+        if(application.sleep)
+            vTaskDelay (100 / portTICK_PERIOD_MS); // wait for WiFi TX pending packets to be sent, not sure about the 100ms
+        break;
+    default:
+        backends[i].status = BACKEND_STATUS_ERROR;
+        backends[i].error = ESP_ERR_INVALID_ARG;
+        strlcpy(backends[i].message, "Unknown protocol", sizeof(backends[i].message));
+        break;
+    }
+    return delivered;
+}
+
+uint8_t backends_in_use()
+{
+    uint8_t mask = 0;
+
+    for(uint8_t i = 0; i < BACKENDS_NUM_MAX; i++)
+        mask |= backends[i].uri[0] ? 1 << i : 0;
+    return mask;
+}
+
+bool open_store()
+{
+    if(!store_init(store_partition_flash()))
+        return false;
+    store.backends = backends_in_use();
+    return true;
+}
+
+// Appends the measurements in RAM to the store, from the oldest one.
+
+bool store_measurements()
+{
+    bool ok = true;
+    measurement_frame_t frame;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+
+    for(measurements_index_t n = 0; n < count && ok; n++) {
+        ok = ok && measurements_entry_to_frame(measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n, &frame);
+        ok = ok && store_append(&frame);
+    }
+    return ok;
+}
+
+// Loads the next records to deliver to a backend into the measurements batch, returning how many were
+// loaded. The caller sends them and then ends the batch. A record that cannot be appended ends the batch
+// early, to go in the next one, unless it is the first one, which is not valid then and gets skipped.
+
+uint32_t load_stored_measurements(uint8_t i, uint32_t count, bool blocks)
+{
+    uint32_t loaded = 0;
+    measurement_frame_t frame;
+
+    count = count < store_pending(i) ? count : store_pending(i);
+    measurements_batch_begin(blocks);
+    if(count && store_seek(store.cursors[i])) {
+        while(loaded < count && !measurements_full && store_read_next(&frame)) {
+            if(!measurements_append_from_frame(&frame)) {
+                if(loaded)
+                    break;
+                ESP_LOGW(__func__, "record %lu skipped", store.cursors[i]);
+            }
+            loaded++;
+        }
+    }
+    return loaded;
+}
+
+// Drains the records stored in flash for a backend in batches, stopping at the first one
+// that is not accepted so that it is sent again on the next upload. The measurement blocks of
+// this wake are not stored, they go with the first batch, alone if there are no records pending.
+// Postman packs and UDP rows do not carry blocks. Postman packs and MQTT messages are encoded whole
+// into the backend buffer, which limits their batches, the rest are streamed or sent a row at a time.
+
+void send_stored_measurements(uint8_t i, bool blocks)
+{
+    uint32_t count;
+    bool delivered;
+    bool packed = backends[i].format == BACKEND_FORMAT_POSTMAN || backends[i].uri[0] == 'm';
+
+    blocks = blocks && measurements_blocks_count && backends[i].format != BACKEND_FORMAT_POSTMAN && backends[i].uri[0] != 'u';
+    for(uint8_t batch = 0; batch < STORE_BATCHES_NUM_MAX && (store_pending(i) || blocks); batch++) {
+        count = load_stored_measurements(i, packed ? STORE_PACKED_BATCH_NUM_MAX : STORE_BATCH_NUM_MAX, blocks);
+        delivered = (count || blocks) && send_measurements(i);
+        measurements_batch_end();
+        if(!delivered) {
+            if(blocks)
+                ESP_LOGE(__func__, "measurement blocks not delivered");
+            break;
+        }
+        blocks = false;
+        if(count)
+            store_advance(i, count);
+        ESP_LOGI(__func__, "sent %lu stored measurements, %lu pending", count, store_pending(i));
+    }
+}
+
 void app_main(void)
 {
     esp_err_t err;
     int64_t now;
     bool ready_to_sleep = false;
     bool measurements_updated = false;
+    bool measurements_stored = true;    // the queue is in the store, with it enabled
+    bool upload_due = true;
 
     esp_event_loop_create_default();
 
@@ -276,6 +702,16 @@ void app_main(void)
     adc_init();
     ble_init();
 
+    // when sleeping with the store enabled, only every upload_period wakes brings up WiFi
+    if(application.store)
+        open_store();
+    if(application.sleep && slept_once && store.ready) {
+        wakes_since_upload = wakes_since_upload < 255 ? wakes_since_upload + 1 : 255;
+        upload_due = wakes_since_upload >= application.upload_period || store_usage() >= application.upload_threshold;
+    }
+    if(upload_due && wifi.ssid[0])
+        wifi_start();
+
     if(!slept_once)
         devices_init();
     else
@@ -304,7 +740,7 @@ void app_main(void)
     ESP_LOGI(__func__, "application.next_measurement_time: %lli", application.next_measurement_time);
 
     ESP_LOGI(__func__, "sizeof devices: %u", sizeof(device_t) * DEVICES_NUM_MAX);
-    ESP_LOGI(__func__, "sizeof measurements: %u", sizeof(measurement_t) * MEASUREMENTS_NUM_MAX);
+    ESP_LOGI(__func__, "sizeof measurements: %u + %u", sizeof(measurement_t) * MEASUREMENTS_NUM_MAX, sizeof(measurement_series_t) * MEASUREMENTS_SERIES_NUM_MAX);
     ESP_LOGI(__func__, "sizeof backends: %u", sizeof(backend_t) * BACKENDS_NUM_MAX);
 
     while(true) {
@@ -317,6 +753,9 @@ void app_main(void)
             sntp_started = true;
         }
 
+        if(!clock_set && NOW)        // by SNTP
+            set_clock();
+
         if(wifi.disconnected) {
             backends_stop();
             backends_clear_status();
@@ -336,13 +775,14 @@ void app_main(void)
             ESP_LOGI(__func__, "starting ble scan @ %lli", esp_timer_get_time());
         }
 
+        // the blocks of an ADC burst are filled by a task of their own, the queue is left alone until it ends
         now = esp_timer_get_time();
-        if(now >= application.next_measurement_time) {
+        if(now >= application.next_measurement_time && !adc_bursting()) {
             ESP_LOGI(__func__, "starting measurements @ %lli", now);
             application.last_measurement_time = now;
             application.next_measurement_time += application.sampling_period * 1000000L;
             ESP_LOGI(__func__, "last_measurement_time %lli next_measurement_time %lli", (long long int)application.last_measurement_time, (long long int)application.next_measurement_time);
-            if(!application.queue)
+            if(!application.queue || application.store)
                 measurements_init();
             measurements_measure();
             // stop the scan if not in continuous mode or there are BLE measurements
@@ -353,7 +793,18 @@ void app_main(void)
             }
             if(!application.queue && measurements_full)
                 ESP_LOGE(__func__, "measurements buffer overflow!");
+            measurements_stored = application.store && (store.ready || open_store()) && store_measurements();
+            if(application.store && !measurements_stored)
+                ESP_LOGE(__func__, "measurements not stored, sending them now");
+            // the measurement blocks are never stored, they cannot wait for the next upload either
+            if(application.store && (!measurements_stored || measurements_blocks_count)) {
+                if(!upload_due && wifi.ssid[0])
+                    wifi_start();
+                upload_due = true;
+            }
             measurements_updated = true;
+            if(!upload_due)
+                ready_to_sleep = true;  // the store keeps the measurements until the next upload
             ESP_LOGI(__func__, "finished measurements @ %lli", esp_timer_get_time());
         }
 
@@ -367,250 +818,37 @@ void app_main(void)
             ESP_LOGI(__func__, "finished sending measurements via BLE @ %lli", esp_timer_get_time());
         }
 
-        if(wifi.status == WIFI_STATUS_ONLINE && ((measurements_updated && (measurements_count || measurements_full)) || backends_modified)) {
+        if(wifi.status == WIFI_STATUS_ONLINE && !adc_bursting() &&
+           ((measurements_updated && (measurements_count || measurements_full || measurements_blocks_count)) || backends_modified)) {
             wifi_measure();
+            wakes_since_upload = 0;
+            store.backends = backends_in_use();
             for(uint8_t i = 0; i != BACKENDS_NUM_MAX; i++) {
                 if(backends[i].uri[0] == 0 || (backends_modified && !(backends_modified & 1 << i)))
                     continue;
 
                 ESP_LOGI(__func__, "started sending measurements via WiFi @ %lli", esp_timer_get_time());
-                switch(backends[i].uri[0]) {
-                case 'h': {     // http / https
-                    esp_http_client_config_t config_post = {
-                        .url = backends[i].uri,
-                        .cert_pem = backends[i].server_cert[0] ? backends[i].server_cert : NULL,
-                        .crt_bundle_attach = backends[i].server_cert[0] ? NULL : esp_crt_bundle_attach,
-                        .is_async = false,
-                        .timeout_ms = 7000,
-                        .event_handler = http_event_handler,
-                    };
-
-                    esp_http_client_handle_t client = esp_http_client_init(&config_post);
-                    if(!client) {
-                        backends[i].status = BACKEND_STATUS_ERROR;
-                        backends[i].error = ESP_ERR_INVALID_ARG;
-                        backends[i].message[0] = 0;
-                        continue;
-                    }
-
-                    switch(backends[i].auth) {
-                        case BACKEND_AUTH_BASIC:
-                            esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_BASIC);
-                            esp_http_client_set_username(client, backends[i].user);
-                            esp_http_client_set_password(client, backends[i].key);
-                            break;
-                        case BACKEND_AUTH_DIGEST:
-                            esp_http_client_set_authtype(client, HTTP_AUTH_TYPE_DIGEST);
-                            esp_http_client_set_username(client, backends[i].user);
-                            esp_http_client_set_password(client, backends[i].key);
-                            break;
-                        case BACKEND_AUTH_BEARER:
-                            snprintf(backend_buffer, sizeof(backend_buffer), "Bearer %s", backends[i].key);
-                            esp_http_client_set_header(client, "Authorization", backend_buffer);
-                            break;
-                        case BACKEND_AUTH_TOKEN:
-                            snprintf(backend_buffer, sizeof(backend_buffer), "Token %s", backends[i].key);
-                            esp_http_client_set_header(client, "Authorization", backend_buffer);
-                            break;
-                        case BACKEND_AUTH_HEADER:
-                            esp_http_client_set_header(client, backends[i].user, backends[i].key);
-                            break;
-                    }
-
-                    if(!NOW && (backends[i].auth == BACKEND_AUTH_POSTMAN || strstr(backends[i].template_row, "@t"))) {
-                        http_timestamp = 0;
-                        backend_buffer_length = 0;
-                        esp_http_client_set_method(client, HTTP_METHOD_HEAD);
-                        err = esp_http_client_perform(client);
-                        if(err == ESP_OK) {
-                            struct timeval now = { .tv_sec = http_timestamp };
-                            settimeofday(&now, NULL);
-                            ESP_LOGI(__func__, "System time set to HTTP Date: %lli", http_timestamp);
-                        }
-                        else {
-                            backends[i].status = BACKEND_STATUS_ERROR;
-                            backends[i].error = err;
-                            backends[i].message[0] = 0;
-                            continue;
-                        }
-                    }
-
-                    if(backends[i].content_type[0])
-                        esp_http_client_set_header(client, "Content-Type", backends[i].content_type);
-                    else {
-                        switch(backends[i].format) {
-                            case BACKEND_FORMAT_SENML:
-                                esp_http_client_set_header(client, "Content-Type", "application/json"); break;
-                            case BACKEND_FORMAT_POSTMAN:
-                                esp_http_client_set_header(client, "Content-Type", "application/vnd.postman"); break;
-                            case BACKEND_FORMAT_TEMPLATE:
-                                esp_http_client_set_header(client, "Content-Type", "text/plain; charset=utf-8"); break;
-                        }
-                    }
-
-                    backend_buffer_length = encode_measurements(i);
-                    if(!backend_buffer_length)
-                        continue;
-
-                    esp_http_client_set_method(client, HTTP_METHOD_POST);
-                    esp_http_client_set_post_field(client, backend_buffer, backend_buffer_length);
-
-                    backend_buffer_length = 0;
-                    err = esp_http_client_perform(client);
-                    if(err == ESP_OK) {
-                        int status = esp_http_client_get_status_code(client);
-                        backends[i].status = status < 300 ? BACKEND_STATUS_ONLINE : BACKEND_STATUS_ERROR;
-                        backends[i].error = status + BACKEND_ERROR_HTTP_STATUS_BASE;
-                        backend_buffer[backend_buffer_length] = 0;
-                        strlcpy(backends[i].message, (char *)backend_buffer, sizeof(backends[i].message));
-
-                        if(status >= 300)
-                            ESP_LOGI(__func__, "HTTP Error %i: %s", status, backend_buffer);
-                        else if(backend_buffer_length && backends[i].format == BACKEND_FORMAT_POSTMAN && backends[i].auth == BACKEND_AUTH_POSTMAN) {
-                            hmac_sha256_key_t binary_key;
-                            if(hmac_hex_decode(binary_key, sizeof(binary_key), backends[i].key, strlen(backends[i].key)) == sizeof(binary_key)) {
-                                ESP_LOGI(__func__, "Handling HTTP Postman request");
-                                backend_buffer_length = sizeof(bp_type_t) * postman_handle_pack(&postman,
-                                    (bp_type_t *) backend_buffer,
-                                    backend_buffer_length / sizeof(bp_type_t),
-                                    sizeof(backend_buffer) / sizeof(bp_type_t),
-                                    NOW, backends[i].user, binary_key);
-                                ESP_LOGI(__func__, "HTTP Postman response: buffer length %u", backend_buffer_length);
-                                if(backend_buffer_length) {
-                                    esp_http_client_set_post_field(client, backend_buffer, backend_buffer_length);
-                                    backend_buffer_length = 0;
-                                    err = esp_http_client_perform(client);
-                                    status = esp_http_client_get_status_code(client);
-                                    ESP_LOGI(__func__, "HTTP Postman response: err %i status %i",err,status);
-                                }
-                            }
-                            else
-                                ESP_LOGI(__func__, "HMAC key is not 64 bytes long");
-                        }
-                    }
-                    else {
-                        backends[i].status = BACKEND_STATUS_ERROR;
-                        backends[i].error = err;
-                        backends[i].message[0] = 0;
-                    }
-                    esp_http_client_cleanup(client);
-                    break;
-                }
-                case 'm':   // mqtt / mqtts
-                    if(backends_started && (backend_buffer_length = encode_measurements(i)) != 0) {
-                        err = esp_mqtt_client_publish(backends[i].handle, backends[i].output_topic, backend_buffer, backend_buffer_length, 0, 0);
-                        backends[i].status = err < 0 ? BACKEND_STATUS_ERROR : BACKEND_STATUS_ONLINE;
-                        backends[i].error = err;
-                        backends[i].message[0] = 0;
-                        ESP_LOGI(__func__, "esp_mqtt_client_publish: %s", err < 0 ? "failed" : "done");
-                    }
-                    break;
-                case 'u':   // udp
-                    measurements_index_t index = 0;
-                    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
-
-                    struct yuarel url;
-                    char url_string[BACKEND_URI_LENGTH];
-                    strlcpy(url_string, backends[i].uri, BACKEND_URI_LENGTH);
-                    if (yuarel_parse(&url, url_string)) {
-                        backends[i].status = BACKEND_STATUS_ERROR;
-                        backends[i].error = ESP_ERR_INVALID_ARG;
-                        strlcpy(backends[i].message, "Parsing the URI failed", sizeof(backends[i].message));
-                        ESP_LOGE(__func__, "Parsing the URI failed: %s", url_string);
-                        break;
-                    }
-
-                    int    sock;
-                    void   *addr;
-                    size_t addr_size;
-                    struct sockaddr_in  addr4 = {0};
-                    struct sockaddr_in6 addr6 = {0};
-
-                    if(url.host[0] != '[') {
-                        addr4.sin_addr.s_addr = inet_addr(url.host);
-                        addr4.sin_family = AF_INET;
-                        addr4.sin_port = htons(url.port);
-                        addr = &addr4;
-                        addr_size = sizeof(addr4);
-                        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-                    }
-                    else {
-                        url.host += 1;
-                        url.host[strlen(url.host) - 1] = 0;
-                        inet6_aton(url.host, &addr6.sin6_addr);
-                        addr6.sin6_family = AF_INET6;
-                        addr6.sin6_port = htons(url.port);
-                        addr6.sin6_scope_id = esp_netif_get_netif_impl_index(wifi.netif);
-                        addr = &addr6;
-                        addr_size = sizeof(addr6);
-                        sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_IPV6);
-                    }
-                    if (sock < 0) {
-                        backends[i].status = BACKEND_STATUS_ERROR;
-                        backends[i].error = errno;
-                        strlcpy(backends[i].message, "Unable to create socket", sizeof(backends[i].message));
-                        ESP_LOGE(__func__, "Unable to create socket: errno %d", errno);
-                        break;
-                    }
-
-                    for(int n = 0; n < count; n++) {
-                        pbuf_t buf = { backend_buffer, sizeof(backend_buffer), 0 };
-                        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
-
-                        switch(backends[i].format) {
-                        case BACKEND_FORMAT_SENML:
-                            measurements_entry_to_senml_row(index, &buf);
-                            break;
-                        case BACKEND_FORMAT_POSTMAN:
-                            buf.length = buf.size;
-                            measurements_entry_to_postman(index, buf.data, &buf.length,
-                                backends[i].auth == BACKEND_AUTH_POSTMAN ? backends[i].user : NULL,
-                                backends[i].auth == BACKEND_AUTH_POSTMAN ? backends[i].key : NULL);
-                            break;
-                        case BACKEND_FORMAT_TEMPLATE:
-                            measurements_entry_to_template_row(index, &buf, backends[i].template_row, backends[i].template_path_separator);
-                            break;
-                        case BACKEND_FORMAT_FRAME:
-                            buf.length = sizeof(measurement_frame_t);
-                            measurements_entry_to_frame(index, (measurement_frame_t *) buf.data);
-                            break;
-                        default:
-                            backends[i].status = BACKEND_STATUS_ERROR;
-                            backends[i].error = ESP_ERR_INVALID_ARG;
-                            strlcpy(backends[i].message, "Unsupported format", sizeof(backends[i].message));
-                            ESP_LOGE(__func__, "Unsupported format at backend %i", i);
-                            break;
-                        }
-                        if(buf.length) {
-                            err = sendto(sock, buf.data, buf.length, 0, (struct sockaddr *) addr, addr_size);
-                            ESP_LOGI(__func__, "sent measurement %i via UDP: %s %i", index, err < 0 ? "failed" : "done", err);
-                        }
-                    }
-                    close(sock);
-                    if(application.sleep)
-                        vTaskDelay (100 / portTICK_PERIOD_MS); // wait for WiFi TX pending packets to be sent, not sure about the 100ms
-                    break;
-                default:
-                    backends[i].status = BACKEND_STATUS_ERROR;
-                    backends[i].error = ESP_ERR_INVALID_ARG;
-                    strlcpy(backends[i].message, "Unknown protocol", sizeof(backends[i].message));
-                    break;
-                }
+                if(application.store && store.ready)
+                    send_stored_measurements(i, measurements_stored);
+                if(!application.store || !store.ready || !measurements_stored)
+                    send_measurements(i);
                 ESP_LOGI(__func__, "finished sending measurements via WiFi @ %lli", esp_timer_get_time());
             }
+            measurements_blocks_clear();    // each backend has had its chance at them
             backends_modified = 0;
             measurements_updated = false;
             ready_to_sleep = true;
         }
 
         now = esp_timer_get_time();
-        if(application.sleep && framer.state != FRAMER_SENDING &&
+        if(application.sleep && framer.state != FRAMER_SENDING && !adc_bursting() &&
           (ready_to_sleep || (measurements_updated && now - application.last_measurement_time > 10 * 1000000)) &&
           (slept_once || now > 60 * 1000000)) {
             ready_to_sleep = false;
             int64_t sleep_duration = application.next_measurement_time - now - (ble.receive ? ble.scan_duration * 1000000 : 0);
             if(sleep_duration > 0) {
                 slept_once = true;
+                now_sleep(sleep_duration);
                 wifi_stop();
                 ble_stop();
                 i2c_stop();
@@ -12,6 +12,7 @@
 #include "enums.h"
 #include "measurements.h"
 #include "now.h"
+#include "pbuf.h"
 #include "postman.h"
 #include "schema.h"
 #include "wifi.h"
@@ -25,6 +26,9 @@ void application_init()
 
     application.diagnostics = false;
     application.sampling_period = 600;
+    application.upload_period = 1;
+    application.upload_threshold = 80;
+    memcpy(application.precisions, metric_precisions, sizeof(application.precisions));
     application_read_from_nvs();
 }
 
@@ -32,13 +36,20 @@ bool application_read_from_nvs()
 {
     esp_err_t err;
     nvs_handle_t handle;
+    size_t length = sizeof(application.precisions);
 
     err = nvs_open("application", NVS_READWRITE, &handle);
     if(err == ESP_OK) {
         nvs_get_u8(handle, "queue", (uint8_t *) &(application.queue));
+        nvs_get_u8(handle, "store", (uint8_t *) &(application.store));
         nvs_get_u8(handle, "sleep", (uint8_t *) &(application.sleep));
         nvs_get_u8(handle, "diagnostics", (uint8_t *) &(application.diagnostics));
         nvs_get_u32(handle, "sampling_period", &(application.sampling_period));
+        nvs_get_u8(handle, "upload_period", &(application.upload_period));
+        nvs_get_u8(handle, "upload_thres", &(application.upload_threshold));
+        nvs_get_u8(handle, "window", &(application.window));
+        nvs_get_u8(handle, "aggregates", &(application.aggregates));
+        nvs_get_blob(handle, "precisions", application.precisions, &length);     // shorter if metrics were added since
         nvs_close(handle);
         ESP_LOGI(__func__, "done");
         return true;
@@ -58,9 +69,15 @@ bool application_write_to_nvs()
     err = nvs_open("application", NVS_READWRITE, &handle);
     if(err == ESP_OK) {
         ok = ok && !nvs_set_u8(handle, "queue", application.queue);
+        ok = ok && !nvs_set_u8(handle, "store", application.store);
         ok = ok && !nvs_set_u8(handle, "sleep", application.sleep);
         ok = ok && !nvs_set_u8(handle, "diagnostics", application.diagnostics);
         ok = ok && !nvs_set_u32(handle, "sampling_period", application.sampling_period);
+        ok = ok && !nvs_set_u8(handle, "upload_period", application.upload_period);
+        ok = ok && !nvs_set_u8(handle, "upload_thres", application.upload_threshold);
+        ok = ok && !nvs_set_u8(handle, "window", application.window);
+        ok = ok && !nvs_set_u8(handle, "aggregates", application.aggregates);
+        ok = ok && !nvs_set_blob(handle, "precisions", application.precisions, sizeof(application.precisions));
         ok = ok && !nvs_commit(handle);
         nvs_close(handle);
         ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
@@ -120,11 +137,57 @@ static bool write_resource_schema(bp_pack_t *writer)
                 ok = ok && bp_put_integer(writer, 0);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "upload_period");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 1);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "upload_threshold");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 100);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "window");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "aggregates");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "precisions");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_MAP);
+                ok = ok && bp_create_container(writer, BP_MAP);
+                for(int i = METRIC_NONE + 1; i < METRIC_NUM_MAX; i++) {
+                    ok = ok && bp_put_string(writer, metric_labels[i]);
+                    ok = ok && bp_create_container(writer, BP_LIST);
+                        ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                        ok = ok && bp_put_integer(writer, PBUF_FLOAT_SHORTEST);
+                        ok = ok && bp_put_integer(writer, PBUF_FLOAT_DECIMALS_MAX);
+                    ok = ok && bp_finish_container(writer);
+                }
+                ok = ok && bp_finish_container(writer);
+            ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_put_string(writer, "queue");
             ok = ok && bp_create_container(writer, BP_LIST);
                 ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "store");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_put_string(writer, "diagnostics");
             ok = ok && bp_create_container(writer, BP_LIST);
                 ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
@@ -181,8 +244,25 @@ uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pac
 
         ok = ok && bp_put_string(writer, "sampling_period");
         ok = ok && bp_put_integer(writer, application.sampling_period);
+        ok = ok && bp_put_string(writer, "upload_period");
+        ok = ok && bp_put_integer(writer, application.upload_period);
+        ok = ok && bp_put_string(writer, "upload_threshold");
+        ok = ok && bp_put_integer(writer, application.upload_threshold);
+        ok = ok && bp_put_string(writer, "window");
+        ok = ok && bp_put_integer(writer, application.window);
+        ok = ok && bp_put_string(writer, "aggregates");
+        ok = ok && bp_put_integer(writer, application.aggregates);
+        ok = ok && bp_put_string(writer, "precisions");
+        ok = ok && bp_create_container(writer, BP_MAP);
+        for(int i = METRIC_NONE + 1; i < METRIC_NUM_MAX; i++) {
+            ok = ok && bp_put_string(writer, metric_labels[i]);
+            ok = ok && bp_put_integer(writer, application.precisions[i]);
+        }
+        ok = ok && bp_finish_container(writer);
         ok = ok && bp_put_string(writer, "queue");
         ok = ok && bp_put_boolean(writer, application.queue);
+        ok = ok && bp_put_string(writer, "store");
+        ok = ok && bp_put_boolean(writer, application.store);
         ok = ok && bp_put_string(writer, "diagnostics");
         ok = ok && bp_put_boolean(writer, application.diagnostics);
         ok = ok && bp_put_string(writer, "sleep");
@@ -201,8 +281,34 @@ uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pac
                     application.sampling_period = bp_get_integer(reader);
                     application.next_measurement_time = application.last_measurement_time + application.sampling_period * 1000000L;
                 }
+                else if(bp_match(reader, "upload_period"))
+                    application.upload_period = bp_get_integer(reader);
+                else if(bp_match(reader, "upload_threshold"))
+                    application.upload_threshold = bp_get_integer(reader);
+                else if(bp_match(reader, "window"))
+                    application.window = bp_get_integer(reader);
+                else if(bp_match(reader, "aggregates"))
+                    application.aggregates = bp_get_integer(reader);
+                else if(bp_match(reader, "precisions")) {
+                    if(bp_is_map(reader) && bp_open(reader)) {
+                        while(bp_next(reader)) {
+                            int metric = METRIC_NONE + 1;
+                            while(metric < METRIC_NUM_MAX && !bp_match(reader, metric_labels[metric]))
+                                metric++;
+                            if(metric < METRIC_NUM_MAX) {
+                                int32_t decimals = bp_get_integer(reader);
+                                application.precisions[metric] = decimals < PBUF_FLOAT_SHORTEST ? PBUF_FLOAT_SHORTEST :
+                                                                 decimals > PBUF_FLOAT_DECIMALS_MAX ? PBUF_FLOAT_DECIMALS_MAX : decimals;
+                            }
+                            else bp_next(reader);
+                        }
+                        bp_close(reader);
+                    }
+                }
                 else if(bp_match(reader, "queue"))
                     application.queue = bp_get_boolean(reader);
+                else if(bp_match(reader, "store"))
+                    application.store = bp_get_boolean(reader);
                 else if(bp_match(reader, "diagnostics"))
                     application.diagnostics = bp_get_boolean(reader);
                 else if(bp_match(reader, "sleep"))
@@ -224,8 +330,10 @@ uint32_t application_resource_handler(uint32_t method, bp_pack_t *reader, bp_pac
 void application_measure()
 {
     if(application.diagnostics) {
-        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_UpTime, NOW, UNIT_s, esp_timer_get_time() / 1000000L);
-        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_MinimumFreeHeap, NOW, UNIT_B, esp_get_minimum_free_heap_size());
+        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_UpTime, NOW_MS, UNIT_s, esp_timer_get_time() / 1000000L);
+        measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_MinimumFreeHeap, NOW_MS, UNIT_B, esp_get_minimum_free_heap_size());
+        if(measurements_append(board.id, RESOURCE_APPLICATION, 0, 0, 0, 0, 0, 0, METRIC_SuppressedMeasurements, NOW_MS, UNIT_NONE, measurements_suppressed))
+            measurements_suppressed = 0;
     }
 }
 
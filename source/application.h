@@ -9,6 +9,7 @@
 #define APP_VERSION    0x000B
 
 #include "bigpacks.h"
+#include "enums.h"
 
 typedef struct {
 	int64_t last_measurement_time;
@@ -17,6 +18,12 @@ typedef struct {
 	bool sleep;
 	bool diagnostics;
 	bool queue;
+	bool store;			// keep measurements in flash until each backend confirms them
+	uint8_t upload_period;		// wakes between uploads when sleeping with the store enabled
+	uint8_t upload_threshold;	// store usage in percent that forces an upload
+	uint8_t window;				// samples aggregated per measurement, 0 or 1 for none
+	uint8_t aggregates;			// mask of aggregate_t functions appended when a window closes
+	int8_t precisions[METRIC_NUM_MAX];	// decimals of the values of each metric in text formats, -1 for the shortest
 } application_t;
 
 extern application_t application;
@@ -5,6 +5,8 @@
 
 #include <esp_log.h>
 #include <nvs_flash.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <esp_crt_bundle.h>
 #include <mqtt_client.h>
 
@@ -103,6 +105,8 @@ bool backends_read_from_nvs()
 
         if(!ok)
             memset(backends, 0, sizeof(backends));
+        for(uint8_t i = 0; i < BACKENDS_NUM_MAX; i++)
+            backend_compile_template(i);
 
         nvs_close(handle);
         ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
@@ -415,6 +419,15 @@ bool backend_pack(bp_pack_t *writer, uint32_t index)
     return ok;
 }
 
+bool backend_compile_template(uint32_t index)
+{
+    bool ok = measurements_compile_template(&backends[index].template, backends[index].template_header, backends[index].template_row,
+        backends[index].template_row_separator, backends[index].template_path_separator, backends[index].template_footer);
+    if(!ok)
+        ESP_LOGE(__func__, "MEASUREMENTS_TEMPLATE_OPS_NUM_MAX reached");
+    return ok;
+}
+
 bool backend_unpack(bp_pack_t *reader, uint32_t index)
 {
     bool ok = true;
@@ -472,6 +485,7 @@ bool backend_unpack(bp_pack_t *reader, uint32_t index)
         else bp_next(reader);
     }
     bp_close(reader);
+    ok = ok && backend_compile_template(index);
 
     return ok;
 }
@@ -484,6 +498,9 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         break;
+    case MQTT_EVENT_PUBLISHED:      // PUBACK received for a QoS 1 message
+        backend->acknowledged_message = event->msg_id;
+        break;
     case MQTT_EVENT_DISCONNECTED:
         if(backend->status == BACKEND_STATUS_ONLINE) {
             backend->status = BACKEND_STATUS_OFFLINE;
@@ -584,3 +601,15 @@ void backends_clear_status()
         backends[i].message[0] = 0;
     }
 }
+
+bool backends_wait_acknowledgement(uint8_t index, int32_t message, uint32_t timeout)
+{
+    for(uint32_t waited = 0; backends[index].acknowledged_message != message; waited += 20) {
+        if(waited >= timeout) {
+            ESP_LOGI(__func__, "message %li not acknowledged", message);
+            return false;
+        }
+        vTaskDelay(20 / portTICK_PERIOD_MS);
+    }
+    return true;
+}
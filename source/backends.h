@@ -26,7 +26,10 @@
 #define BACKEND_ERROR_MQTT_RETURN_CODE_BASE	0x30000000
 #define BACKEND_ERROR_HTTP_STATUS_BASE		0x40000000
 
+#define BACKEND_ACKNOWLEDGEMENT_TIMEOUT		5000	// milliseconds to wait for an MQTT PUBACK
+
 #include "bigpacks.h"
+#include "measurements.h"
 
 typedef struct {
 	uint8_t auth;
@@ -46,11 +49,13 @@ typedef struct {
 	char template_row_separator[BACKEND_TEMPLATE_SEPARATOR_LENGTH];
 	char template_path_separator[BACKEND_TEMPLATE_SEPARATOR_LENGTH];
 	char template_footer[BACKEND_TEMPLATE_FOOTER_LENGTH];
+	measurement_template_t template;		// compiled from the template strings when they change
 
 	void *handle;
 	int32_t status;
 	int32_t error;
 	char message[BACKEND_MESSAGE_LENGTH];
+	volatile int32_t acknowledged_message;	// id of the last MQTT message acknowledged by the broker
 } backend_t;
 
 
@@ -64,8 +69,10 @@ bool backends_write_to_nvs();
 void backends_start();
 void backends_stop();
 void backends_clear_status();
+bool backends_wait_acknowledgement(uint8_t index, int32_t message, uint32_t timeout);
 bool backend_pack(bp_pack_t *writer, uint32_t index);
 bool backend_unpack(bp_pack_t *reader, uint32_t index);
+bool backend_compile_template(uint32_t index);
 bool backends_schema_handler(char *resource_name, bp_pack_t *writer);
 uint32_t backends_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
 
@@ -508,7 +508,7 @@ bool ble_stop_scan()
     return ble_gap_disc_cancel() == 0;
 }
 
-bool ble_measurements_update(node_address_t node, measurement_descriptor_t descriptor, device_address_t address, measurement_timestamp_t timestamp, measurement_value_t value)
+bool ble_measurements_update(node_address_t node, measurement_descriptor_t descriptor, device_address_t address, uint32_t timestamp, measurement_value_t value)
 {
     int i;
     for(i = 0; i < ble_measurements_count; i++) {
@@ -321,7 +321,7 @@ void board_measure()
     #if defined (CONFIG_IDF_TARGET_ESP32S2) || defined (CONFIG_IDF_TARGET_ESP32S3) || defined (CONFIG_IDF_TARGET_ESP32C2) || defined (CONFIG_IDF_TARGET_ESP32C3) || defined (CONFIG_IDF_TARGET_ESP32C6) || defined (CONFIG_IDF_TARGET_ESP32H2)
         float cpu_temp;
         if(board.diagnostics && cpu_temp_sensor && temperature_sensor_get_celsius(cpu_temp_sensor, &cpu_temp) == ESP_OK)
-            measurements_append(board.id, RESOURCE_BOARD, 0, 0, 0, 0, 0, 0, METRIC_ProcessorTemperature, NOW, UNIT_Cel, cpu_temp);
+            measurements_append(board.id, RESOURCE_BOARD, 0, 0, 0, 0, 0, 0, METRIC_ProcessorTemperature, NOW_MS, UNIT_Cel, cpu_temp);
     #endif
 }
 
@@ -0,0 +1,114 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <math.h>
+#include <string.h>
+
+#include "cbor.h"
+
+// Writer of CBOR (RFC 8949) items into a pbuf_t, one item at a time so that arrays and maps can be streamed.
+// Containers have definite lengths, so their number of items has to be known when opening them.
+
+static bool cbor_put_bytes(pbuf_t *buffer, uint64_t value, uint8_t count)     // big endian
+{
+    uint8_t bytes[8];
+    for(uint8_t i = 0; i < count; i++)
+        bytes[i] = value >> (8 * (count - 1 - i));
+    return pbuf_write(buffer, (char *) bytes, count);
+}
+
+bool cbor_put_head(pbuf_t *buffer, uint8_t major, uint64_t argument)
+{
+    major <<= 5;
+    if(argument < 24)
+        return pbuf_putc(buffer, major | argument);
+    if(argument <= UINT8_MAX)
+        return pbuf_putc(buffer, major | 24) && cbor_put_bytes(buffer, argument, 1);
+    if(argument <= UINT16_MAX)
+        return pbuf_putc(buffer, major | 25) && cbor_put_bytes(buffer, argument, 2);
+    if(argument <= UINT32_MAX)
+        return pbuf_putc(buffer, major | 26) && cbor_put_bytes(buffer, argument, 4);
+    return pbuf_putc(buffer, major | 27) && cbor_put_bytes(buffer, argument, 8);
+}
+
+bool cbor_put_integer(pbuf_t *buffer, int64_t value)
+{
+    return value < 0 ? cbor_put_head(buffer, CBOR_NEGATIVE, -(value + 1)) : cbor_put_head(buffer, CBOR_UNSIGNED, value);
+}
+
+bool cbor_put_text(pbuf_t *buffer, const char *text, size_t length)
+{
+    return cbor_put_head(buffer, CBOR_TEXT, length) && pbuf_write(buffer, text, length);
+}
+
+bool cbor_put_string(pbuf_t *buffer, const char *string)
+{
+    return cbor_put_text(buffer, string, strlen(string));
+}
+
+// Half precision bits of a float, if it converts to half precision without losing anything.
+
+static bool cbor_float_to_half(float value, uint16_t *half)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = bits >> 16 & 0x8000;
+    int16_t exponent = (bits >> 23 & 0xFF) - 127;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if(exponent == 128) {                                       // infinity, or NaN which does not need its payload
+        *half = sign | 0x7C00 | (mantissa ? 0x200 : 0);
+        return true;
+    }
+    if(exponent == -127 && !mantissa) {                         // zero
+        *half = sign;
+        return true;
+    }
+    if(exponent >= -14 && exponent <= 15 && !(mantissa & 0x1FFF)) {
+        *half = sign | (exponent + 15) << 10 | mantissa >> 13;
+        return true;
+    }
+    if(exponent >= -24 && exponent < -14) {                     // subnormal in half precision
+        uint8_t shift = 13 + (-14 - exponent);
+        mantissa |= 0x800000;
+        if(!(mantissa & ((1UL << shift) - 1))) {
+            *half = sign | mantissa >> shift;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cbor_put_float(pbuf_t *buffer, float value)        // in half precision when it is lossless
+{
+    uint16_t half;
+    uint32_t single;
+
+    if(cbor_float_to_half(value, &half))
+        return pbuf_putc(buffer, CBOR_SIMPLE << 5 | CBOR_HALF) && cbor_put_bytes(buffer, half, 2);
+    memcpy(&single, &value, sizeof(single));
+    return pbuf_putc(buffer, CBOR_SIMPLE << 5 | CBOR_SINGLE) && cbor_put_bytes(buffer, single, 4);
+}
+
+bool cbor_put_number(pbuf_t *buffer, double value)      // as an integer or the shortest lossless float
+{
+    uint64_t bits;
+
+    if(value == trunc(value) && fabs(value) < 9007199254740992.0)      // 2^53
+        return cbor_put_integer(buffer, (int64_t) value);
+    if(isnan(value) || (double) (float) value == value)
+        return cbor_put_float(buffer, value);
+    memcpy(&bits, &value, sizeof(bits));
+    return pbuf_putc(buffer, CBOR_SIMPLE << 5 | CBOR_DOUBLE) && cbor_put_bytes(buffer, bits, 8);
+}
+
+bool cbor_open_array(pbuf_t *buffer, uint32_t count)
+{
+    return cbor_put_head(buffer, CBOR_ARRAY, count);
+}
+
+bool cbor_open_map(pbuf_t *buffer, uint32_t count)
+{
+    return cbor_put_head(buffer, CBOR_MAP, count);
+}
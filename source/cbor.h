@@ -0,0 +1,35 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef cbor_h
+#define cbor_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pbuf.h"
+
+#define CBOR_UNSIGNED	0		// major types, in the top 3 bits of the initial byte
+#define CBOR_NEGATIVE	1
+#define CBOR_BYTES		2
+#define CBOR_TEXT		3
+#define CBOR_ARRAY		4
+#define CBOR_MAP		5
+#define CBOR_TAG		6
+#define CBOR_SIMPLE		7
+
+#define CBOR_HALF		25		// additional information of the floats in the simple type
+#define CBOR_SINGLE		26
+#define CBOR_DOUBLE		27
+
+bool cbor_put_head(pbuf_t *buffer, uint8_t major, uint64_t argument);
+bool cbor_put_integer(pbuf_t *buffer, int64_t value);
+bool cbor_put_text(pbuf_t *buffer, const char *text, size_t length);
+bool cbor_put_string(pbuf_t *buffer, const char *string);
+bool cbor_put_float(pbuf_t *buffer, float value);
+bool cbor_put_number(pbuf_t *buffer, double value);
+bool cbor_open_array(pbuf_t *buffer, uint32_t count);
+bool cbor_open_map(pbuf_t *buffer, uint32_t count);
+
+#endif
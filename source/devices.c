@@ -7,6 +7,7 @@
 #include <nvs_flash.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/event_groups.h>
 
 #include "application.h"
 #include "postman.h"
@@ -21,6 +22,16 @@
 
 RTC_DATA_ATTR device_t devices[DEVICES_NUM_MAX] = {{0}};
 RTC_DATA_ATTR devices_index_t devices_count = 0;
+RTC_DATA_ATTR device_state_t devices_states[DEVICES_NUM_MAX] = {{0}};
+
+typedef struct {
+    resource_t      resource;
+    device_bus_t    bus;
+    bool            ok;
+} devices_worker_t;
+
+static devices_worker_t devices_workers[DEVICES_WORKERS_NUM_MAX];
+static EventGroupHandle_t devices_workers_done = NULL;
 
 const part_t parts[PART_NUM_MAX] = {
     [PART_NONE]            { .label = "",          .resource = RESOURCE_NONE,    .id_start = 0,    .id_span = 0, .parameters=0, .mask = 0 },
@@ -52,6 +63,7 @@ void devices_init()
 {
     devices_count = 0;
     memset(devices, 0, sizeof(devices));
+    memset(devices_states, 0, sizeof(devices_states));
     devices_read_from_nvs();
 
     onewire_init();
@@ -101,6 +113,18 @@ bool devices_read_from_nvs()
             snprintf(nvs_key, sizeof(nvs_key), "%u_offsets", i % 255);
             length = sizeof(device.offsets);
             ok = ok && !nvs_get_blob(handle, nvs_key, device.offsets, &length);
+            snprintf(nvs_key, sizeof(nvs_key), "%u_resolution", i % 255);
+            nvs_get_u8(handle, nvs_key, &(device.resolution));     // optional, missing in older configurations
+            snprintf(nvs_key, sizeof(nvs_key), "%u_window", i % 255);
+            nvs_get_u8(handle, nvs_key, &(device.window));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_aggregates", i % 255);
+            nvs_get_u8(handle, nvs_key, &(device.aggregates));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_deadband", i % 255);
+            nvs_get_u16(handle, nvs_key, &(device.deadband));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_deadband_pc", i % 255);
+            nvs_get_u8(handle, nvs_key, &(device.deadband_percent));
+            snprintf(nvs_key, sizeof(nvs_key), "%u_heartbeat", i % 255);
+            nvs_get_u8(handle, nvs_key, &(device.heartbeat));
 
             ok = ok && devices_append(&device) >= 0;
             ESP_LOGI(__func__, "device %i: %s", i, ok ? "ok" : "fail");
@@ -162,6 +186,18 @@ bool devices_write_to_nvs()
                 ok = ok && !nvs_set_u16(handle, nvs_key, devices[i].mask);
                 snprintf(nvs_key, sizeof(nvs_key), "%u_offsets", i % 255);
                 ok = ok && !nvs_set_blob(handle, nvs_key, devices[i].offsets, sizeof(devices[i].offsets));
+                snprintf(nvs_key, sizeof(nvs_key), "%u_resolution", i % 255);
+                ok = ok && !nvs_set_u8(handle, nvs_key, devices[i].resolution);
+                snprintf(nvs_key, sizeof(nvs_key), "%u_window", i % 255);
+                ok = ok && !nvs_set_u8(handle, nvs_key, devices[i].window);
+                snprintf(nvs_key, sizeof(nvs_key), "%u_aggregates", i % 255);
+                ok = ok && !nvs_set_u8(handle, nvs_key, devices[i].aggregates);
+                snprintf(nvs_key, sizeof(nvs_key), "%u_deadband", i % 255);
+                ok = ok && !nvs_set_u16(handle, nvs_key, devices[i].deadband);
+                snprintf(nvs_key, sizeof(nvs_key), "%u_deadband_pc", i % 255);
+                ok = ok && !nvs_set_u8(handle, nvs_key, devices[i].deadband_percent);
+                snprintf(nvs_key, sizeof(nvs_key), "%u_heartbeat", i % 255);
+                ok = ok && !nvs_set_u8(handle, nvs_key, devices[i].heartbeat);
 
                 devices_persistent_count += 1;
             }
@@ -280,6 +316,31 @@ int devices_update_or_append(device_t *device)
         return devices_append(device);
 }
 
+static bool devices_valid_resolution(uint8_t resolution)
+{
+    return !resolution || (resolution >= DEVICES_RESOLUTION_MIN && resolution <= DEVICES_RESOLUTION_MAX);
+}
+
+// Reads an integer into a byte field, refusing it outside 0 to maximum instead of truncating it.
+
+static bool devices_get_byte(bp_pack_t *reader, uint8_t maximum, uint8_t *field)
+{
+    bp_integer_t value = bp_get_integer(reader);
+
+    if(value < 0 || value > maximum)
+        return false;
+    *field = value;
+    return true;
+}
+
+static bool devices_set_deadband(device_t *device, float deadband)
+{
+    if(deadband < 0 || deadband > DEVICES_DEADBAND_MAX)
+        return false;
+    device->deadband = deadband * 100 + 0.5;
+    return true;
+}
+
 static bool write_get_response_schema(bp_pack_t *writer)
 {
     bool ok = true;
@@ -337,6 +398,48 @@ static bool write_get_response_schema(bp_pack_t *writer)
                     ok = ok && bp_finish_container(writer);
                 ok = ok && bp_finish_container(writer);
 
+                ok = ok && bp_put_string(writer, "resolution");
+                ok = ok && bp_create_container(writer, BP_LIST);
+                    ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                    ok = ok && bp_put_integer(writer, 0);
+                    ok = ok && bp_put_integer(writer, DEVICES_RESOLUTION_MAX);
+                ok = ok && bp_finish_container(writer);
+
+                ok = ok && bp_put_string(writer, "window");
+                ok = ok && bp_create_container(writer, BP_LIST);
+                    ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                    ok = ok && bp_put_integer(writer, 0);
+                    ok = ok && bp_put_integer(writer, 255);
+                ok = ok && bp_finish_container(writer);
+
+                ok = ok && bp_put_string(writer, "aggregates");
+                ok = ok && bp_create_container(writer, BP_LIST);
+                    ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                    ok = ok && bp_put_integer(writer, 0);
+                    ok = ok && bp_put_integer(writer, DEVICES_AGGREGATES_MAX);
+                ok = ok && bp_finish_container(writer);
+
+                ok = ok && bp_put_string(writer, "deadband");
+                ok = ok && bp_create_container(writer, BP_LIST);
+                    ok = ok && bp_put_integer(writer, SCHEMA_FLOAT | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                    ok = ok && bp_put_float(writer, 0);
+                    ok = ok && bp_put_float(writer, DEVICES_DEADBAND_MAX);
+                ok = ok && bp_finish_container(writer);
+
+                ok = ok && bp_put_string(writer, "deadband_percent");
+                ok = ok && bp_create_container(writer, BP_LIST);
+                    ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                    ok = ok && bp_put_integer(writer, 0);
+                    ok = ok && bp_put_integer(writer, DEVICES_DEADBAND_PERCENT_MAX);
+                ok = ok && bp_finish_container(writer);
+
+                ok = ok && bp_put_string(writer, "heartbeat");
+                ok = ok && bp_create_container(writer, BP_LIST);
+                    ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                    ok = ok && bp_put_integer(writer, 0);
+                    ok = ok && bp_put_integer(writer, 255);
+                ok = ok && bp_finish_container(writer);
+
             ok = ok && bp_finish_container(writer);
         ok = ok && bp_finish_container(writer);
     ok = ok && bp_finish_container(writer);
@@ -374,6 +477,48 @@ static bool write_post_item_request_schema(bp_pack_t *writer)
                 ok = ok && bp_finish_container(writer);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "resolution");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_RESOLUTION_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "window");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "aggregates");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_AGGREGATES_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "deadband");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_FLOAT | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_float(writer, 0);
+                ok = ok && bp_put_float(writer, DEVICES_DEADBAND_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "deadband_percent");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_DEADBAND_PERCENT_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "heartbeat");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
         ok = ok && bp_finish_container(writer);
     ok = ok && bp_finish_container(writer);
     return ok;
@@ -404,6 +549,48 @@ static bool write_put_item_request_schema(bp_pack_t *writer)
                 ok = ok && bp_finish_container(writer);
             ok = ok && bp_finish_container(writer);
 
+            ok = ok && bp_put_string(writer, "resolution");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_RESOLUTION_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "window");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "aggregates");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_AGGREGATES_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "deadband");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_FLOAT | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_float(writer, 0);
+                ok = ok && bp_put_float(writer, DEVICES_DEADBAND_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "deadband_percent");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, DEVICES_DEADBAND_PERCENT_MAX);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "heartbeat");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 0);
+                ok = ok && bp_put_integer(writer, 255);
+            ok = ok && bp_finish_container(writer);
+
         ok = ok && bp_finish_container(writer);
     ok = ok && bp_finish_container(writer);
     return ok;
@@ -475,6 +662,18 @@ uint32_t devices_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t
                     for(int j = 0; j < parts[devices[i].part].parameters; j++)
                         ok = ok && bp_put_float(writer, (bp_integer_t) devices[i].offsets[j]);
                 ok = ok && bp_finish_container(writer);
+                ok = ok && bp_put_string(writer, "resolution");
+                ok = ok && bp_put_integer(writer, devices[i].resolution);
+                ok = ok && bp_put_string(writer, "window");
+                ok = ok && bp_put_integer(writer, devices[i].window);
+                ok = ok && bp_put_string(writer, "aggregates");
+                ok = ok && bp_put_integer(writer, devices[i].aggregates);
+                ok = ok && bp_put_string(writer, "deadband");
+                ok = ok && bp_put_float(writer, devices[i].deadband / 100.0);
+                ok = ok && bp_put_string(writer, "deadband_percent");
+                ok = ok && bp_put_integer(writer, devices[i].deadband_percent);
+                ok = ok && bp_put_string(writer, "heartbeat");
+                ok = ok && bp_put_integer(writer, devices[i].heartbeat);
             ok = ok && bp_finish_container(writer);
         }
         ok = ok && bp_finish_container(writer);
@@ -505,14 +704,29 @@ uint32_t devices_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t
                     bp_close(reader);
                 }
             }
+            else if(bp_match(reader, "resolution"))
+                device.resolution = bp_get_integer(reader);
+            else if(bp_match(reader, "window"))
+                ok = ok && devices_get_byte(reader, UINT8_MAX, &device.window);
+            else if(bp_match(reader, "aggregates"))
+                ok = ok && devices_get_byte(reader, DEVICES_AGGREGATES_MAX, &device.aggregates);
+            else if(bp_match(reader, "deadband"))
+                ok = ok && devices_set_deadband(&device, bp_get_float(reader));
+            else if(bp_match(reader, "deadband_percent"))
+                ok = ok && devices_get_byte(reader, DEVICES_DEADBAND_PERCENT_MAX, &device.deadband_percent);
+            else if(bp_match(reader, "heartbeat"))
+                ok = ok && devices_get_byte(reader, UINT8_MAX, &device.heartbeat);
             else bp_next(reader);
         }
         bp_close(reader);
 
-        if(!ok || !device.resource || !device.address || !device.part)  /// there are valid zero addresses?
+        if(!ok || !device.resource || !device.address || !device.part || !devices_valid_resolution(device.resolution))  /// there are valid zero addresses?
             return PM_400_Bad_Request;
 
-        return devices_update_or_append(&device) >= 0 && devices_write_to_nvs() ? PM_201_Created : PM_500_Internal_Server_Error;
+        int index = devices_update_or_append(&device);
+        if(index >= 0 && devices[index].resource == RESOURCE_ONEWIRE)
+            onewire_configure_device(index);
+        return index >= 0 && devices_write_to_nvs() ? PM_201_Created : PM_500_Internal_Server_Error;
     }
     else if(method == PM_PUT) {
         int index;
@@ -534,9 +748,29 @@ uint32_t devices_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t
                 else
                     memset(devices[index].offsets, 0, sizeof(devices[index].offsets));
             }
+            else if(bp_match(reader, "resolution")) {
+                uint8_t resolution = bp_get_integer(reader);
+                ok = ok && devices_valid_resolution(resolution);
+                if(ok)
+                    devices[index].resolution = resolution;
+            }
+            else if(bp_match(reader, "window"))
+                ok = ok && devices_get_byte(reader, UINT8_MAX, &devices[index].window);
+            else if(bp_match(reader, "aggregates"))
+                ok = ok && devices_get_byte(reader, DEVICES_AGGREGATES_MAX, &devices[index].aggregates);
+            else if(bp_match(reader, "deadband"))
+                ok = ok && devices_set_deadband(&devices[index], bp_get_float(reader));
+            else if(bp_match(reader, "deadband_percent"))
+                ok = ok && devices_get_byte(reader, DEVICES_DEADBAND_PERCENT_MAX, &devices[index].deadband_percent);
+            else if(bp_match(reader, "heartbeat"))
+                ok = ok && devices_get_byte(reader, UINT8_MAX, &devices[index].heartbeat);
             else bp_next(reader);
         }
         bp_close(reader);
+        if(!ok)
+            return PM_400_Bad_Request;
+        if(devices[index].resource == RESOURCE_ONEWIRE)
+            onewire_configure_device(index);
         return devices_write_to_nvs() ? PM_204_Changed : PM_500_Internal_Server_Error;
     }
     else
@@ -555,24 +789,127 @@ void devices_buses_stop()
     i2c_stop();
 }
 
-bool devices_measure_all()
+static bool devices_measure_bus(resource_t resource, device_bus_t bus)
 {
     bool ok = true;
-    uint8_t device;
+    devices_index_t device;
+    devices_index_t plan[DEVICES_NUM_MAX];
+    devices_index_t plan_count = 0;
+    bool triggered[DEVICES_NUM_MAX];
+    bool bus_triggered = false;
+    int64_t ready_time = esp_timer_get_time();
+
+    // Start every conversion first so they run in parallel, then wait once for the slowest one.
+    // I2C devices are triggered one by one grouped by multiplexer channel, 1-Wire devices all
+    // at once with a broadcast command.
+
+    if(resource == RESOURCE_I2C) {
+        plan_count = i2c_plan_bus(bus, plan);
+        for(devices_index_t step = 0; step < plan_count; step++) {
+            uint32_t conversion_time;
+            device = plan[step];
+            triggered[device] = i2c_trigger_device(device, &conversion_time);
+            if(triggered[device] && ready_time < esp_timer_get_time() + conversion_time * 1000L)
+                ready_time = esp_timer_get_time() + conversion_time * 1000L;
+        }
+    }
+    else if(resource == RESOURCE_ONEWIRE) {
+        uint32_t conversion_time;
+        bus_triggered = onewire_trigger_bus(bus, &conversion_time);
+        if(bus_triggered)
+            ready_time = esp_timer_get_time() + conversion_time * 1000L;
+    }
 
-    for(device = 0; device < devices_count; device++) {
-        switch(devices[device].resource) {
-        case RESOURCE_I2C:
-            devices[device].status = i2c_measure_device(device) ? DEVICE_STATUS_WORKING : DEVICE_STATUS_ERROR;
+    int64_t wait_time = ready_time - esp_timer_get_time();
+    if(wait_time > 0)
+        vTaskDelay((wait_time / 1000 + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+
+    if(resource == RESOURCE_I2C) {
+        for(devices_index_t step = 0; step < plan_count; step++) {
+            device = plan[step];
+            devices[device].status = triggered[device] && i2c_collect_device(device) ? DEVICE_STATUS_WORKING : DEVICE_STATUS_ERROR;
             ok = ok && devices[device].status == DEVICE_STATUS_WORKING;
-            break;
-        case RESOURCE_ONEWIRE:
-            devices[device].status = onewire_measure_device(device) ? DEVICE_STATUS_WORKING : DEVICE_STATUS_ERROR;
+        }
+        i2c_finish_bus(bus);
+    }
+    else if(resource == RESOURCE_ONEWIRE) {
+        for(device = 0; device < devices_count; device++) {
+            if(devices[device].resource != RESOURCE_ONEWIRE || devices[device].bus != bus)
+                continue;
+            devices[device].status = bus_triggered && onewire_collect_device(device) ? DEVICE_STATUS_WORKING : DEVICE_STATUS_ERROR;
             ok = ok && devices[device].status == DEVICE_STATUS_WORKING;
-            break;
-        default:
-            break;
         }
     }
     return ok;
 }
+
+// Measures the bus of a worker and records how long it took, in its task or inline if it has none.
+
+static void devices_measure_worker(devices_worker_t *worker)
+{
+    int64_t start_time = esp_timer_get_time();
+
+    worker->ok = devices_measure_bus(worker->resource, worker->bus);
+
+    uint32_t measure_time = (esp_timer_get_time() - start_time) / 1000;
+    if(worker->resource == RESOURCE_I2C)
+        i2c_buses[worker->bus].measure_time = measure_time;
+    else
+        onewire_buses[worker->bus].measure_time = measure_time;
+}
+
+static void devices_measure_bus_task(void *arg)
+{
+    devices_worker_t *worker = arg;
+
+    devices_measure_worker(worker);
+    xEventGroupSetBits(devices_workers_done, 1 << (worker - devices_workers));
+    vTaskDelete(NULL);
+}
+
+// Measures every bus in its own task, spreading them over the available cores.
+
+bool devices_measure_all()
+{
+    bool ok = true;
+    uint8_t workers_count = 0;
+    EventBits_t workers_bits = 0;
+
+    measurements_prune();
+    for(devices_index_t device = 0; device < devices_count; device++) {
+        if(devices[device].resource != RESOURCE_I2C && devices[device].resource != RESOURCE_ONEWIRE)
+            continue;
+        uint8_t worker = 0;
+        while(worker < workers_count && (devices_workers[worker].resource != devices[device].resource || devices_workers[worker].bus != devices[device].bus))
+            worker++;
+        if(worker == workers_count && workers_count < DEVICES_WORKERS_NUM_MAX) {
+            devices_workers[workers_count].resource = devices[device].resource;
+            devices_workers[workers_count].bus = devices[device].bus;
+            devices_workers[workers_count].ok = false;
+            workers_count++;
+        }
+    }
+    if(!workers_count)
+        return true;
+
+    if(!devices_workers_done)
+        devices_workers_done = xEventGroupCreate();
+
+    measurements_stage_begin();
+    for(uint8_t worker = 0; worker < workers_count; worker++) {
+        workers_bits |= 1 << worker;
+        if(!devices_workers_done || xTaskCreatePinnedToCore(devices_measure_bus_task, "devices_bus", DEVICES_WORKER_STACK_SIZE,
+                                         &devices_workers[worker], uxTaskPriorityGet(NULL), NULL, worker % portNUM_PROCESSORS) != pdPASS) {
+            ESP_LOGE(__func__, "Cannot start task for bus %i, measuring it inline", devices_workers[worker].bus);
+            workers_bits &= ~(1 << worker);
+            devices_measure_worker(&devices_workers[worker]);
+        }
+    }
+    if(workers_bits)
+        xEventGroupWaitBits(devices_workers_done, workers_bits, pdTRUE, pdTRUE, portMAX_DELAY);
+    ok = measurements_stage_commit();
+
+    for(uint8_t worker = 0; worker < workers_count; worker++)
+        ok = ok && devices_workers[worker].ok;
+    return ok;
+}
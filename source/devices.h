@@ -14,6 +14,13 @@
 #define DEVICES_PARAMETERS_NUM_MAX	9		// For RuuviTags
 #define DEVICES_PATH_LENGTH			40
 #define DEVICES_MASK_ALL_ENABLED 	0
+#define DEVICES_RESOLUTION_MIN		9		// DS18B20
+#define DEVICES_RESOLUTION_MAX		12
+#define DEVICES_DEADBAND_MAX		655.35	// stored in hundredths in 16 bits
+#define DEVICES_DEADBAND_PERCENT_MAX	100
+#define DEVICES_AGGREGATES_MAX		((1 << AGGREGATE_NUM_MAX) - 1)	// every aggregate_t bit set
+#define DEVICES_WORKERS_NUM_MAX		6		// One per I2C and 1-Wire bus
+#define DEVICES_WORKER_STACK_SIZE	4096
 
 typedef uint64_t device_address_t;
 typedef uint16_t device_part_t;
@@ -48,11 +55,56 @@ typedef struct {
 	device_channel_t   	  channel;
 	device_rssi_t    	  rssi;
 	device_status_t	  	  status;
+	uint8_t				  resolution;		// bits, 0 for the part default
+	uint8_t				  window;			// samples aggregated per measurement, 0 to follow the application
+	uint8_t				  aggregates;		// mask of aggregate_t functions appended when a window closes
+	uint16_t			  deadband;			// hundredths of the unit a sample must change to be reported, 0 for none
+	uint8_t				  deadband_percent;	// relative change to be reported, 0 for none
+	uint8_t				  heartbeat;		// minutes without a reported sample before one is reported anyway, 0 for no limit
 	bool      	      	  persistent;
 } device_t;
 
+typedef struct {
+	uint16_t t1;
+	int16_t  t2, t3;
+	uint16_t p1;
+	int16_t  p2, p3, p4, p5, p6, p7, p8, p9;
+} bmp280_calibration_t;
+
+typedef struct {
+	uint16_t t1, t2;
+	int8_t   t3;
+	int16_t  p1, p2;
+	int8_t   p3, p4;
+	uint16_t p5, p6;
+	int8_t   p7, p8;
+	int16_t  p9;
+	int8_t   p10, p11;
+} bmp388_calibration_t;
+
+typedef struct {
+	int16_t  c0, c1;
+	int32_t  c00, c10;
+	int16_t  c01, c11, c20, c21, c30;
+} dps310_calibration_t;
+
+typedef struct {
+	char	 variant;	// last character of the product name, '0', '4' or '5'
+} sen5x_product_t;
+
+typedef struct {		// Per-device driver data, kept across measurements and deep sleep
+	bool	 valid;
+	union {
+		bmp280_calibration_t bmp280;
+		bmp388_calibration_t bmp388;
+		dps310_calibration_t dps310;
+		sen5x_product_t		 sen5x;
+	};
+} device_state_t;
+
 typedef uint8_t devices_index_t;
 extern device_t devices[];
+extern device_state_t devices_states[];
 extern devices_index_t devices_count;
 
 void devices_init();
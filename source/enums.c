@@ -62,6 +62,7 @@ const char *backend_format_labels[] = {
 	[BACKEND_FORMAT_POSTMAN]	"postman",
 	[BACKEND_FORMAT_TEMPLATE]	"template",
 	[BACKEND_FORMAT_FRAME]		"frame",
+	[BACKEND_FORMAT_SENML_CBOR]	"senml_cbor",
 };
 
 const char *ble_mode_labels[] = {
@@ -76,6 +77,15 @@ const char *device_status_labels[] = {
 	[DEVICE_STATUS_UNSEEN]	"unseen",
 };
 
+const char *aggregate_labels[] = {
+	[AGGREGATE_NONE]	"",
+	[AGGREGATE_MIN]		"min",
+	[AGGREGATE_MAX]		"max",
+	[AGGREGATE_MEAN]	"mean",
+	[AGGREGATE_LAST]	"last",
+	[AGGREGATE_COUNT]	"count",
+};
+
 const char *metric_labels[] = {
 	[METRIC_NONE]		 			"",
 	[METRIC_Temperature] 			"Temperature",
@@ -105,6 +115,39 @@ const char *metric_labels[] = {
 	[METRIC_DCvoltage]				"DCvoltage",
 	[METRIC_ADCvalue]				"ADCvalue",
 	[METRIC_ProcessorTemperature]	"ProcessorTemperature",
+	[METRIC_SuppressedMeasurements]	"SuppressedMeasurements",
+};
+
+const int8_t metric_precisions[] = {		// default decimals of the values in text formats, -1 for the shortest exact ones
+	[METRIC_NONE]		 			-1,
+	[METRIC_Temperature] 			2,
+	[METRIC_Humidity]				1,
+	[METRIC_Pressure]				2,
+	[METRIC_CO2]					0,
+	[METRIC_PM1]					1,
+	[METRIC_PM2o5]					1,
+	[METRIC_PM4]					1,
+	[METRIC_PM10]					1,
+	[METRIC_VOC]					0,
+	[METRIC_NOx]					0,
+	[METRIC_ProbeTemperature] 		4,		// DS18B20 resolution is 0.0625 Cel
+	[METRIC_InfraredTemperature]	2,
+	[METRIC_InternalTemperature]	2,
+	[METRIC_LightIntensity]			1,
+	[METRIC_UpTime]					0,
+	[METRIC_FreeHeap]				0,
+	[METRIC_MinimumFreeHeap]		0,
+	[METRIC_AccelerationX]			3,
+	[METRIC_AccelerationY]			3,
+	[METRIC_AccelerationZ]			3,
+	[METRIC_BatteryLevel]			0,
+	[METRIC_TxPower]				0,
+	[METRIC_Movements]				0,
+	[METRIC_RSSI]					0,
+	[METRIC_DCvoltage]				3,
+	[METRIC_ADCvalue]				0,
+	[METRIC_ProcessorTemperature]	1,
+	[METRIC_SuppressedMeasurements]	0,
 };
 
 const char *unit_labels[] = {
@@ -77,6 +77,7 @@ enum backend_format {
 	BACKEND_FORMAT_POSTMAN,
 	BACKEND_FORMAT_TEMPLATE,
 	BACKEND_FORMAT_FRAME,
+	BACKEND_FORMAT_SENML_CBOR,
 	BACKEND_FORMAT_NUM_MAX
 };
 extern const char *backend_format_labels[];
@@ -99,6 +100,18 @@ enum device_status {
 };
 extern const char *device_status_labels[];
 
+enum aggregate {
+	AGGREGATE_NONE = 0,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_MEAN,
+	AGGREGATE_LAST,
+	AGGREGATE_COUNT,
+	AGGREGATE_NUM_MAX
+};
+extern const char *aggregate_labels[];
+typedef enum aggregate aggregate_t;
+
 enum part {
 	PART_NONE = 0,
 	PART_SHT3X,
@@ -157,9 +170,11 @@ enum metric {
 	METRIC_DCvoltage,
 	METRIC_ADCvalue,
 	METRIC_ProcessorTemperature,
+	METRIC_SuppressedMeasurements,
 	METRIC_NUM_MAX
 };
 extern const char *metric_labels[];
+extern const int8_t metric_precisions[];
 typedef enum metric metric_enum_t;
 
 enum unit {
@@ -0,0 +1,147 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <string.h>
+
+#include "gorilla.h"
+
+// Time series compression from "Gorilla: A Fast, Scalable, In-Memory Time Series Database".
+// Timestamps are coded as the difference between consecutive deltas, which is zero for
+// regular sampling, and values as the XOR with the previous one, which has few meaningful
+// bits for slowly changing measurements. The first sample of a series is stored verbatim.
+
+static bool gorilla_put(gorilla_bits_t *bits, uint32_t value, uint8_t count)
+{
+    if(bits->position + count > bits->size * 8)
+        return false;
+    for(int8_t i = count - 1; i >= 0; i--) {
+        uint8_t mask = 0x80 >> (bits->position % 8);
+        if(value >> i & 1)
+            bits->data[bits->position / 8] |= mask;
+        else
+            bits->data[bits->position / 8] &= ~mask;
+        bits->position++;
+    }
+    return true;
+}
+
+static bool gorilla_get(gorilla_bits_t *bits, uint32_t *value, uint8_t count)
+{
+    if(bits->position + count > bits->size * 8)
+        return false;
+    *value = 0;
+    for(uint8_t i = 0; i < count; i++) {
+        *value = *value << 1 | (bits->data[bits->position / 8] >> (7 - bits->position % 8) & 1);
+        bits->position++;
+    }
+    return true;
+}
+
+void gorilla_init(gorilla_series_t *series)
+{
+    memset(series, 0, sizeof(gorilla_series_t));
+    series->leading = GORILLA_NO_WINDOW;
+}
+
+bool gorilla_encode(gorilla_bits_t *bits, gorilla_series_t *series, uint32_t timestamp, float value)
+{
+    bool ok = true;
+    uint32_t value_bits;
+
+    memcpy(&value_bits, &value, sizeof(value_bits));
+    if(!series->started) {
+        ok = ok && gorilla_put(bits, timestamp, 32);
+        ok = ok && gorilla_put(bits, value_bits, 32);
+        series->started = true;
+    }
+    else {
+        int32_t delta = timestamp - series->timestamp;
+        int64_t delta_of_delta = (int64_t) delta - series->delta;
+
+        if(delta_of_delta == 0)
+            ok = ok && gorilla_put(bits, 0x0, 1);
+        else if(delta_of_delta >= -63 && delta_of_delta <= 64)
+            ok = ok && gorilla_put(bits, 0x2, 2) && gorilla_put(bits, delta_of_delta + 63, 7);
+        else if(delta_of_delta >= -255 && delta_of_delta <= 256)
+            ok = ok && gorilla_put(bits, 0x6, 3) && gorilla_put(bits, delta_of_delta + 255, 9);
+        else if(delta_of_delta >= -2047 && delta_of_delta <= 2048)
+            ok = ok && gorilla_put(bits, 0xE, 4) && gorilla_put(bits, delta_of_delta + 2047, 12);
+        else
+            ok = ok && gorilla_put(bits, 0xF, 4) && gorilla_put(bits, delta, 32);     // the delta itself, it always fits
+        series->delta = delta;
+
+        uint32_t xor = value_bits ^ series->value;
+        if(!xor)
+            ok = ok && gorilla_put(bits, 0x0, 1);
+        else {
+            uint8_t leading = __builtin_clz(xor);
+            uint8_t trailing = __builtin_ctz(xor);
+            if(series->leading != GORILLA_NO_WINDOW && leading >= series->leading && trailing >= series->trailing)
+                ok = ok && gorilla_put(bits, 0x2, 2) && gorilla_put(bits, xor >> series->trailing, 32 - series->leading - series->trailing);
+            else {
+                uint8_t length = 32 - leading - trailing;
+                ok = ok && gorilla_put(bits, 0x3, 2) && gorilla_put(bits, leading, 5) && gorilla_put(bits, length - 1, 5);
+                ok = ok && gorilla_put(bits, xor >> trailing, length);
+                series->leading = leading;
+                series->trailing = trailing;
+            }
+        }
+    }
+    series->timestamp = timestamp;
+    series->value = value_bits;
+    return ok;
+}
+
+bool gorilla_decode(gorilla_bits_t *bits, gorilla_series_t *series, uint32_t *timestamp, float *value)
+{
+    bool ok = true;
+    uint32_t bit = 0, field = 0;
+
+    if(!series->started) {
+        ok = ok && gorilla_get(bits, &(series->timestamp), 32);
+        ok = ok && gorilla_get(bits, &(series->value), 32);
+        series->started = ok;
+    }
+    else {
+        uint8_t prefix = 0;
+        while(ok && prefix < 4 && (ok = gorilla_get(bits, &bit, 1)) && bit)
+            prefix++;
+        switch(prefix) {
+            case 0:
+                break;
+            case 1:
+                ok = ok && gorilla_get(bits, &field, 7);
+                series->delta += (int32_t) field - 63;
+                break;
+            case 2:
+                ok = ok && gorilla_get(bits, &field, 9);
+                series->delta += (int32_t) field - 255;
+                break;
+            case 3:
+                ok = ok && gorilla_get(bits, &field, 12);
+                series->delta += (int32_t) field - 2047;
+                break;
+            default:
+                ok = ok && gorilla_get(bits, &field, 32);
+                series->delta = (int32_t) field;
+        }
+        series->timestamp += series->delta;
+
+        ok = ok && gorilla_get(bits, &bit, 1);
+        if(ok && bit) {
+            ok = ok && gorilla_get(bits, &bit, 1);
+            if(ok && bit) {
+                uint32_t leading = 0, length = 0;
+                ok = ok && gorilla_get(bits, &leading, 5) && gorilla_get(bits, &length, 5);
+                series->leading = leading;
+                series->trailing = 32 - leading - (length + 1);
+            }
+            ok = ok && series->leading != GORILLA_NO_WINDOW;
+            ok = ok && gorilla_get(bits, &field, 32 - series->leading - series->trailing);
+            series->value ^= field << series->trailing;
+        }
+    }
+    *timestamp = series->timestamp;
+    memcpy(value, &(series->value), sizeof(float));
+    return ok;
+}
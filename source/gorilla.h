@@ -0,0 +1,33 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef gorilla_h
+#define gorilla_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GORILLA_SAMPLE_SIZE_MAX		10		// bytes of the worst case sample, 36 bits of timestamp and 44 of value
+#define GORILLA_NO_WINDOW			0xFF
+
+typedef struct {
+	uint8_t		*data;
+	size_t		size;			// bytes
+	size_t		position;		// bits
+} gorilla_bits_t;
+
+typedef struct {		// state of one series, the same on the encoding and decoding sides
+	uint32_t	timestamp;
+	int32_t		delta;
+	uint32_t	value;			// bits of the float
+	uint8_t		leading;		// zero bits around the meaningful bits of the last XOR window
+	uint8_t		trailing;
+	bool		started;
+} gorilla_series_t;
+
+void gorilla_init(gorilla_series_t *series);
+bool gorilla_encode(gorilla_bits_t *bits, gorilla_series_t *series, uint32_t timestamp, float value);
+bool gorilla_decode(gorilla_bits_t *bits, gorilla_series_t *series, uint32_t *timestamp, float *value);
+
+#endif
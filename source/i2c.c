@@ -25,6 +25,44 @@
 RTC_DATA_ATTR i2c_bus_t i2c_buses[I2C_BUSES_NUM_MAX] = {{0}};
 RTC_DATA_ATTR uint8_t i2c_buses_count = 0;
 
+typedef struct {
+    uint8_t multiplexer;
+    uint8_t channel;
+    uint8_t address;
+    uint8_t part;
+} i2c_topology_entry_t;
+
+#define SCD4X_MEASUREMENT_INTERVAL  5000    // milliseconds between periodic measurements
+#define SEN5X_MEASUREMENT_INTERVAL  1000
+
+static i2c_topology_entry_t i2c_topology[DEVICES_NUM_MAX];  // devices found on the bus being detected
+static uint8_t i2c_ack_maps[I2C_PCA9548_NUM_MAX * 8][I2C_ACK_MAP_SIZE];    // sweep of each channel of the bus being detected
+static devices_index_t i2c_topology_count;
+
+// Drivers of the I2C parts, with the timings used to plan each measurement cycle.
+// Every part runs in a single precision mode, so conversion_time is the worst case for it.
+// Parts measuring periodically on their own may have to wait up to one interval for fresh data in collect.
+
+const i2c_driver_t i2c_drivers[PART_NUM_MAX] = {
+    [PART_SHT3X]    { .detect = i2c_detect_sht3x,    .trigger = i2c_trigger_sht3x,    .collect = i2c_measure_sht3x,    .conversion_time = 30,  .read_bytes = 6 },
+    [PART_SHT4X]    { .detect = i2c_detect_sht4x,    .trigger = i2c_trigger_sht4x,    .collect = i2c_measure_sht4x,    .conversion_time = 30,  .read_bytes = 6 },
+    [PART_HTU21D]   { .detect = i2c_detect_htu21d,   .trigger = i2c_trigger_htu21d,   .collect = i2c_measure_htu21d,   .conversion_time = 70,  .collect_time = 30, .read_bytes = 6 },
+    [PART_HTU31D]   { .detect = i2c_detect_htu31d,   .trigger = i2c_trigger_htu31d,   .collect = i2c_measure_htu31d,   .conversion_time = 30,  .read_bytes = 6 },
+    [PART_MCP9808]  { .detect = i2c_detect_mcp9808,                                   .collect = i2c_measure_mcp9808,  .read_bytes = 2 },
+    [PART_TMP117]   { .detect = i2c_detect_tmp117,                                    .collect = i2c_measure_tmp117,   .read_bytes = 2 },
+    [PART_BMP280]   { .detect = i2c_detect_bmp280,   .calibrate = i2c_calibrate_bmp280, .trigger = i2c_trigger_bmp280, .collect = i2c_measure_bmp280, .conversion_time = 20, .read_bytes = 6 },
+    [PART_BMP388]   { .detect = i2c_detect_bmp388,   .calibrate = i2c_calibrate_bmp388, .trigger = i2c_trigger_bmp388, .collect = i2c_measure_bmp388, .conversion_time = 20, .read_bytes = 6 },
+    [PART_LPS2X3X]  { .detect = i2c_detect_lps2x3x,  .trigger = i2c_trigger_lps2x3x,  .collect = i2c_measure_lps2x3x,  .conversion_time = 30,  .read_bytes = 5 },
+    [PART_DPS310]   { .detect = i2c_detect_dps310,   .calibrate = i2c_calibrate_dps310, .trigger = i2c_trigger_dps310, .collect = i2c_measure_dps310, .conversion_time = 20, .collect_time = 20, .read_bytes = 6 },
+    [PART_MLX90614] { .detect = i2c_detect_mlx90614,                                  .collect = i2c_measure_mlx90614, .read_bytes = 6 },
+    [PART_MCP960X]  { .detect = i2c_detect_mcp960x,                                   .collect = i2c_measure_mcp960x,  .read_bytes = 4 },
+    [PART_BH1750]   { .detect = i2c_detect_bh1750,   .trigger = i2c_trigger_bh1750,   .collect = i2c_measure_bh1750,   .conversion_time = 130, .read_bytes = 2 },
+    [PART_VEML7700] { .detect = i2c_detect_veml7700,                                  .collect = i2c_measure_veml7700, .warmup_time = 100, .read_bytes = 2 },
+    [PART_TSL2591]  { .detect = i2c_detect_tsl2591,                                   .collect = i2c_measure_tsl2591,  .read_bytes = 4 },
+    [PART_SCD4X]    { .detect = i2c_detect_scd4x,                                     .collect = i2c_measure_scd4x,    .collect_time = SCD4X_MEASUREMENT_INTERVAL + 2,  .read_bytes = 12 },
+    [PART_SEN5X]    { .detect = i2c_detect_sen5x,    .calibrate = i2c_calibrate_sen5x,  .collect = i2c_measure_sen5x,  .collect_time = SEN5X_MEASUREMENT_INTERVAL + 40, .read_bytes = 27 },
+};
+
 bool i2c_read(uint8_t port, uint8_t address, uint8_t *buffer, size_t buffer_size)
 {
     return !i2c_master_read_from_device(port, address, buffer, buffer_size, I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
@@ -35,6 +73,23 @@ bool i2c_write(uint8_t port, uint8_t address, uint8_t *buffer, size_t buffer_siz
     return !i2c_master_write_to_device(port, address, buffer, buffer_size, I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
 }
 
+// Addresses a device with a zero length write, returning true if it acknowledged.
+
+bool i2c_probe(uint8_t port, uint8_t address)
+{
+    esp_err_t err;
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+
+    if(!cmd)
+        return false;
+    err = i2c_master_start(cmd);
+    err = err ? err : i2c_master_write_byte(cmd, address << 1 | I2C_MASTER_WRITE, true);
+    err = err ? err : i2c_master_stop(cmd);
+    err = err ? err : i2c_master_cmd_begin(port, cmd, (I2C_PROBE_TIMEOUT_MS + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    i2c_cmd_link_delete(cmd);
+    return !err;
+}
+
 void i2c_init()
 {
     i2c_buses_count = 0;
@@ -123,6 +178,21 @@ static bool write_resource_schema(bp_pack_t *writer, int method)
                     ok = ok && bp_create_container(writer, BP_LIST);
                         ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
                     ok = ok && bp_finish_container(writer);
+
+                    ok = ok && bp_put_string(writer, "measure_time");
+                    ok = ok && bp_create_container(writer, BP_LIST);
+                        ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+                    ok = ok && bp_finish_container(writer);
+
+                    ok = ok && bp_put_string(writer, "predicted_time");
+                    ok = ok && bp_create_container(writer, BP_LIST);
+                        ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+                    ok = ok && bp_finish_container(writer);
+
+                    ok = ok && bp_put_string(writer, "mux_writes_saved");
+                    ok = ok && bp_create_container(writer, BP_LIST);
+                        ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+                    ok = ok && bp_finish_container(writer);
                 }
 
                 ok = ok && bp_put_string(writer, "port");
@@ -195,6 +265,9 @@ uint32_t i2c_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wri
         for(uint32_t i=0; i != i2c_buses_count && ok; i++) {
             ok = ok && bp_create_container(writer, BP_MAP);
             ok = ok && bp_put_string(writer, "active") && bp_put_boolean(writer, i2c_buses[i].active);
+            ok = ok && bp_put_string(writer, "measure_time") && bp_put_integer(writer, i2c_buses[i].measure_time);
+            ok = ok && bp_put_string(writer, "predicted_time") && bp_put_integer(writer, i2c_buses[i].predicted_time);
+            ok = ok && bp_put_string(writer, "mux_writes_saved") && bp_put_integer(writer, i2c_buses[i].mux_writes_saved);
             ok = ok && bp_put_string(writer, "port") && bp_put_integer(writer, i2c_buses[i].port);
             ok = ok && bp_put_string(writer, "sda_pin") && bp_put_integer(writer, i2c_buses[i].sda_pin);
             ok = ok && bp_put_string(writer, "scl_pin") && bp_put_integer(writer, i2c_buses[i].scl_pin);
@@ -239,6 +312,7 @@ uint32_t i2c_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *wri
 
             if(ok) {
                 ok = ok && i2c_write_to_nvs();
+                ok = ok && i2c_forget_topology();
                 if(!i2c_buses_count)
                     i2c_set_default();
                 i2c_start();
@@ -468,42 +542,219 @@ bool i2c_using_gpio(uint8_t gpio)
 }
 
 
+// Topology
+
+// Devices found on each bus are saved to NVS with a fingerprint of the bus: the multiplexers
+// present and the addresses answering on every channel. When the fingerprint still matches on
+// the next boot only the saved devices are detected again, skipping every other candidate part.
+// Otherwise the sweeps taken for the fingerprint, kept in i2c_ack_maps, drive the full detection.
+
+static uint32_t i2c_fingerprint_add(uint32_t fingerprint, const uint8_t *data, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+        fingerprint = (fingerprint ^ data[i]) * 16777619;   // FNV-1a
+    return fingerprint;
+}
+
+static uint32_t i2c_fingerprint_bus(device_bus_t bus, uint8_t multiplexers_mask)
+{
+    uint32_t fingerprint = 2166136261;
+
+    fingerprint = i2c_fingerprint_add(fingerprint, &multiplexers_mask, sizeof(multiplexers_mask));
+    if(multiplexers_mask) {
+        for(uint8_t multiplexer = 0; multiplexer < I2C_PCA9548_NUM_MAX; multiplexer++)
+            if(multiplexers_mask & (1 << multiplexer))
+                for(uint8_t channel = 0; channel < 8; channel++) {
+                    uint8_t *ack_map = i2c_ack_maps[multiplexer * 8 + channel];
+                    i2c_select_channel(bus, multiplexer + 1, channel);
+                    i2c_scan_channel(bus, ack_map);
+                    fingerprint = i2c_fingerprint_add(fingerprint, ack_map, I2C_ACK_MAP_SIZE);
+                }
+        i2c_release_channel(bus);
+    }
+    else {
+        i2c_scan_channel(bus, i2c_ack_maps[0]);
+        fingerprint = i2c_fingerprint_add(fingerprint, i2c_ack_maps[0], I2C_ACK_MAP_SIZE);
+    }
+    return fingerprint;
+}
+
+static bool i2c_write_topology(device_bus_t bus, uint32_t fingerprint)
+{
+    esp_err_t err;
+    bool ok = true;
+    nvs_handle_t handle;
+    char nvs_key[16];
+
+    err = nvs_open("topology", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        snprintf(nvs_key, sizeof(nvs_key), "%u_devices", bus % 255);
+        ok = ok && !nvs_set_blob(handle, nvs_key, i2c_topology, i2c_topology_count * sizeof(i2c_topology_entry_t));
+        snprintf(nvs_key, sizeof(nvs_key), "%u_fingerprint", bus % 255);
+        ok = ok && !nvs_set_u32(handle, nvs_key, fingerprint);
+        ok = ok && !nvs_commit(handle);
+        nvs_close(handle);
+        ESP_LOGI(__func__, "%s, bus = %i, count = %i", ok ? "done" : "failed", bus, i2c_topology_count);
+        return ok;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+static bool i2c_read_topology(device_bus_t bus, uint32_t fingerprint)
+{
+    esp_err_t err;
+    bool ok = true;
+    nvs_handle_t handle;
+    char nvs_key[16];
+    uint32_t saved_fingerprint = 0;
+    size_t length = sizeof(i2c_topology);
+
+    i2c_topology_count = 0;
+    err = nvs_open("topology", NVS_READONLY, &handle);
+    if(err == ESP_OK) {
+        snprintf(nvs_key, sizeof(nvs_key), "%u_fingerprint", bus % 255);
+        ok = ok && !nvs_get_u32(handle, nvs_key, &saved_fingerprint);
+        ok = ok && saved_fingerprint == fingerprint;
+        snprintf(nvs_key, sizeof(nvs_key), "%u_devices", bus % 255);
+        ok = ok && !nvs_get_blob(handle, nvs_key, i2c_topology, &length);
+        if(ok)
+            i2c_topology_count = length / sizeof(i2c_topology_entry_t);
+        nvs_close(handle);
+        ESP_LOGI(__func__, "%s, bus = %i, count = %i", ok ? "matched" : "not matched", bus, i2c_topology_count);
+        return ok;
+    }
+    else
+        return false;
+}
+
+// Forces a full detection on the next boot.
+
+bool i2c_forget_topology()
+{
+    esp_err_t err;
+    bool ok = true;
+    nvs_handle_t handle;
+
+    err = nvs_open("topology", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        ok = ok && !nvs_erase_all(handle);
+        ok = ok && !nvs_commit(handle);
+        nvs_close(handle);
+        return ok;
+    }
+    else
+        return false;
+}
+
+// Devices
+
+static uint8_t i2c_detect_multiplexers(device_bus_t bus)
+{
+    uint8_t channels_mask;
+    uint8_t multiplexers_mask = 0;
+
+    for(uint8_t multiplexer = 0; multiplexer < I2C_PCA9548_NUM_MAX; multiplexer++) {
+        bool ok = true;
+        channels_mask = 0xFF;
+        ok = ok && i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
+        ok = ok && i2c_read(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
+        ok = ok && channels_mask == 0xFF;
+        channels_mask = 0;
+        ok = ok && i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
+        ok = ok && i2c_read(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
+        ok = ok && channels_mask == 0;
+        multiplexers_mask |= ok ? 1 << multiplexer : 0;
+    }
+    i2c_buses[bus].selected_multiplexer = 0;  // every multiplexer was left with its channels off
+    ESP_LOGI(__func__, "multiplexers_mask for bus %i: %02x", bus, multiplexers_mask);
+    return multiplexers_mask;
+}
+
+static void i2c_append_device(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel, uint8_t address, device_part_t part)
+{
+    device_t device = {
+        .resource = RESOURCE_I2C,
+        .bus = bus,
+        .multiplexer = multiplexer,
+        .channel = channel,
+        .address = address,
+        .part = part,
+        .mask = parts[part].mask,
+        .status = DEVICE_STATUS_WORKING,
+        .persistent = false,
+        .timestamp = -1,
+    };
+    int device_index = devices_get_or_append(&device);
+    if(device_index >= 0) {
+        devices_states[device_index].valid = false;
+        i2c_calibrate_device(device_index);
+        char path[DEVICES_PATH_LENGTH];
+        devices_build_path(device_index, path, sizeof(path), '_');
+        ESP_LOGI(__func__, "Device found: %s", path);
+    }
+    else
+        ESP_LOGE(__func__, "DEVICES_NUM_MAX reached");
+
+    if(i2c_topology_count < DEVICES_NUM_MAX) {
+        i2c_topology[i2c_topology_count].multiplexer = multiplexer;
+        i2c_topology[i2c_topology_count].channel = channel;
+        i2c_topology[i2c_topology_count].address = address;
+        i2c_topology[i2c_topology_count].part = part;
+        i2c_topology_count++;
+    }
+}
+
+// Detects again only the devices saved in the topology, failing if any of them is missing.
+
+static bool i2c_restore_topology(device_bus_t bus)
+{
+    bool ok = true;
+    devices_index_t saved_count = i2c_topology_count;
+
+    i2c_topology_count = 0;
+    for(devices_index_t entry = 0; entry < saved_count && ok; entry++) {
+        i2c_topology_entry_t saved = i2c_topology[entry];
+        i2c_select_channel(bus, saved.multiplexer, saved.channel);
+        ok = saved.part < PART_NUM_MAX && i2c_detect_device(bus, saved.part, saved.address);
+        if(ok)
+            i2c_append_device(bus, saved.multiplexer, saved.channel, saved.address, saved.part);
+    }
+    i2c_release_channel(bus);
+    return ok;
+}
+
 void i2c_detect_devices()
 {
     uint8_t bus;
     uint8_t channel;
     uint8_t multiplexer;
-    uint8_t channels_mask;
     uint8_t multiplexers_mask = 0;
 
     for(bus = 0; bus < i2c_buses_count; bus++) {
         if(i2c_buses[bus].enabled) {
             bool device_found = false;
 
-            multiplexers_mask = 0;
-            for(multiplexer = 0; multiplexer < I2C_PCA9548_NUM_MAX; multiplexer++) {
-                bool ok = true;
-                channels_mask = 0xFF;
-                ok = ok && i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
-                ok = ok && i2c_read(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
-                ok = ok && channels_mask == 0xFF;
-                channels_mask = 0;
-                ok = ok && i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
-                ok = ok && i2c_read(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer, &channels_mask, 1);
-                ok = ok && channels_mask == 0;
-                multiplexers_mask |= ok ? 1 << multiplexer : 0;
-            }
-            ESP_LOGI(__func__, "multiplexers_mask for bus %i: %02x", bus, multiplexers_mask);
-
-            if(multiplexers_mask) {
-                device_found = true;
-                for(multiplexer = 0; multiplexer < I2C_PCA9548_NUM_MAX; multiplexer++)
-                    if(multiplexers_mask & (1 << multiplexer))
-                        for(channel = 0; channel < 8; channel++)
-                            i2c_detect_channel(bus, multiplexer + 1, channel);
+            multiplexers_mask = i2c_detect_multiplexers(bus);
+            uint32_t fingerprint = i2c_fingerprint_bus(bus, multiplexers_mask);
+
+            if(i2c_read_topology(bus, fingerprint) && i2c_restore_topology(bus))
+                device_found = multiplexers_mask || i2c_topology_count;
+            else {
+                i2c_topology_count = 0;
+                if(multiplexers_mask) {
+                    device_found = true;
+                    for(multiplexer = 0; multiplexer < I2C_PCA9548_NUM_MAX; multiplexer++)
+                        if(multiplexers_mask & (1 << multiplexer))
+                            for(channel = 0; channel < 8; channel++)
+                                i2c_detect_channel(bus, multiplexer + 1, channel, i2c_ack_maps[multiplexer * 8 + channel]);
+                }
+                else if(i2c_detect_channel(bus, 0, 0, i2c_ack_maps[0]))
+                    device_found = true;
+                i2c_write_topology(bus, fingerprint);
             }
-            else if(i2c_detect_channel(bus, 0, 0))
-                device_found = true;
 
             if(!device_found) {
                 i2c_stop_bus(bus);
@@ -514,164 +765,172 @@ void i2c_detect_devices()
                 i2c_buses[bus].active = true;
         }
     }
-    vTaskDelay (50 / portTICK_PERIOD_MS);  // Wait for I2C devices to stabilize after configuration
 }
 
-bool i2c_detect_channel(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel)
+// Sweeps the addresses of the selected channel, setting a bit in ack_map for each one that answers.
+
+void i2c_scan_channel(device_bus_t bus, uint8_t *ack_map)
+{
+    memset(ack_map, 0, I2C_ACK_MAP_SIZE);
+    for(uint8_t address = I2C_PROBE_ADDRESS_MIN; address <= I2C_PROBE_ADDRESS_MAX; address++)
+        if(i2c_probe(i2c_buses[bus].port, address))
+            ack_map[address / 8] |= 1 << (address % 8);
+}
+
+// Runs the part specific detection only on the addresses that acknowledged the sweep in ack_map,
+// as some of them reset the device and wait, and absent ones take the full timeout.
+
+bool i2c_detect_channel(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel, const uint8_t *ack_map)
 {
     bool device_found = false;
 
-    if(multiplexer) {
-        uint8_t channels_mask = 1 << channel;
-        i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer - 1, &channels_mask, 1);
-    }
+    i2c_select_channel(bus, multiplexer, channel);
     for(device_part_t part_index = 0; part_index < PART_NUM_MAX; part_index++) {
         if(parts[part_index].resource == RESOURCE_I2C)
             for(uint8_t address_index = 0; address_index < parts[part_index].id_span; address_index++) {
-                device_t device = {
-                    .resource = RESOURCE_I2C,
-                    .bus = bus,
-                    .multiplexer = multiplexer,
-                    .channel = channel,
-                    .address = parts[part_index].id_start + address_index,
-                    .part = part_index,
-                    .mask = parts[part_index].mask,
-                    .status = DEVICE_STATUS_WORKING,
-                    .persistent = false,
-                    .timestamp = -1,
-                };
-                if(i2c_detect_device(device.bus, device.part, device.address)) {
+                uint8_t address = parts[part_index].id_start + address_index;
+                if(!(ack_map[address / 8] & (1 << (address % 8))))
+                    continue;
+                if(i2c_detect_device(bus, part_index, address)) {
                     device_found = true;
-                    int device_index = devices_get_or_append(&device);
-                    if(device_index >= 0) {
-                        char path[DEVICES_PATH_LENGTH];
-                        devices_build_path(device_index, path, sizeof(path), '_');
-                        ESP_LOGI(__func__, "Device found: %s", path);
-                    }
-                    else
-                        ESP_LOGE(__func__, "DEVICES_NUM_MAX reached");
+                    i2c_append_device(bus, multiplexer, channel, address, part_index);
                 }
             }
     }
-    if(multiplexer) {
-        uint8_t channels_mask = 0;
-        i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer - 1, &channels_mask, 1);
-    }
+    i2c_release_channel(bus);
     return device_found;
 }
 
+bool i2c_calibrate_device(devices_index_t device)
+{
+    const i2c_driver_t *driver = &i2c_drivers[devices[device].part];
+    return !driver->calibrate || driver->calibrate(device);
+}
+
 bool i2c_detect_device(device_bus_t bus, device_part_t part, device_address_t address)
 {
-    switch(part) {
-    case PART_SHT3X:
-        return i2c_detect_sht3x(bus, address);
-    case PART_SHT4X:
-        return i2c_detect_sht4x(bus, address);
-    case PART_HTU21D:
-        return i2c_detect_htu21d(bus, address);
-    case PART_HTU31D:
-        return i2c_detect_htu31d(bus, address);
-    case PART_MCP9808:
-        return i2c_detect_mcp9808(bus, address);
-    case PART_TMP117:
-        return i2c_detect_tmp117(bus, address);
-    case PART_BMP280:
-        return i2c_detect_bmp280(bus, address);
-    case PART_BMP388:
-        return i2c_detect_bmp388(bus, address);
-    case PART_LPS2X3X:
-        return i2c_detect_lps2x3x(bus, address);
-    case PART_DPS310:
-        return i2c_detect_dps310(bus, address);
-    case PART_MLX90614:
-        return i2c_detect_mlx90614(bus, address);
-    case PART_MCP960X:
-        return i2c_detect_mcp960x(bus, address);
-    case PART_BH1750:
-        return i2c_detect_bh1750(bus, address);
-    case PART_VEML7700:
-        return i2c_detect_veml7700(bus, address);
-    case PART_TSL2591:
-        return i2c_detect_tsl2591(bus, address);
-    case PART_SCD4X:
-        return i2c_detect_scd4x(bus, address);
-    case PART_SEN5X:
-        return i2c_detect_sen5x(bus, address);
-    default:
-        return false;
-    }
+    return part < PART_NUM_MAX && i2c_drivers[part].detect && i2c_drivers[part].detect(bus, address);
 }
 
-bool i2c_measure_device(devices_index_t device)
+// Switches on a multiplexer channel, remembering the current one so that consecutive
+// devices behind the same channel don't rewrite it. Only one multiplexer is kept open
+// at a time, as the same addresses may be repeated behind different multiplexers.
+
+void i2c_select_channel(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel)
 {
-    bool ok = true;
     uint8_t channels_mask;
 
-    if(devices[device].multiplexer) {
-        channels_mask = 1 << devices[device].channel;
-        i2c_write(i2c_buses[devices[device].bus].port, I2C_PCA9548_ADDRESS + devices[device].multiplexer - 1, &channels_mask, 1);
-        /// delay?
+    if(i2c_buses[bus].selected_multiplexer && i2c_buses[bus].selected_multiplexer != multiplexer) {
+        channels_mask = 0;
+        i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + i2c_buses[bus].selected_multiplexer - 1, &channels_mask, 1);
+        i2c_buses[bus].selected_multiplexer = 0;
+        i2c_buses[bus].mux_writes++;
     }
-    switch(devices[device].part) {
-    case PART_SHT3X:
-        ok = i2c_measure_sht3x(device);
-        break;
-    case PART_SHT4X:
-        ok = i2c_measure_sht4x(device);
-        break;
-    case PART_HTU21D:
-        ok = i2c_measure_htu21d(device);
-        break;
-    case PART_HTU31D:
-        ok = i2c_measure_htu31d(device);
-        break;
-    case PART_MCP9808:
-        ok = i2c_measure_mcp9808(device);
-        break;
-    case PART_TMP117:
-        ok = i2c_measure_tmp117(device);
-        break;
-    case PART_BMP280:
-        ok = i2c_measure_bmp280(device);
-        break;
-    case PART_BMP388:
-        ok = i2c_measure_bmp388(device);
-        break;
-    case PART_LPS2X3X:
-        ok = i2c_measure_lps2x3x(device);
-        break;
-    case PART_DPS310:
-        ok = i2c_measure_dps310(device);
-        break;
-    case PART_MLX90614:
-        ok = i2c_measure_mlx90614(device);
-        break;
-    case PART_MCP960X:
-        ok = i2c_measure_mcp960x(device);
-        break;
-    case PART_BH1750:
-        ok = i2c_measure_bh1750(device);
-        break;
-    case PART_VEML7700:
-        ok = i2c_measure_veml7700(device);
-        break;
-    case PART_TSL2591:
-        ok = i2c_measure_tsl2591(device);
-        break;
-    case PART_SCD4X:
-        ok = i2c_measure_scd4x(device);
-        break;
-    case PART_SEN5X:
-        ok = i2c_measure_sen5x(device);
-        break;
-    default:
-        ok = false;
+    if(multiplexer && (i2c_buses[bus].selected_multiplexer != multiplexer || i2c_buses[bus].selected_channel != channel)) {
+        channels_mask = 1 << channel;
+        i2c_write(i2c_buses[bus].port, I2C_PCA9548_ADDRESS + multiplexer - 1, &channels_mask, 1);
+        i2c_buses[bus].selected_multiplexer = multiplexer;
+        i2c_buses[bus].selected_channel = channel;
+        i2c_buses[bus].mux_writes++;
     }
-    if(devices[device].multiplexer) {
-        channels_mask = 0;
-        i2c_write(i2c_buses[devices[device].bus].port, I2C_PCA9548_ADDRESS + devices[device].multiplexer - 1, &channels_mask, 1);
+}
+
+void i2c_release_channel(device_bus_t bus)
+{
+    i2c_select_channel(bus, 0, 0);
+}
+
+// Estimates the milliseconds a cycle over the planned devices takes: the slowest conversion,
+// as they all run in parallel, plus the waits inside collect and the bytes moved on the bus.
+
+static uint32_t i2c_predict_bus(device_bus_t bus, devices_index_t *plan, devices_index_t plan_count)
+{
+    uint32_t conversion_time = 0;
+    uint32_t collect_time = 0;
+    uint32_t transfer_bits = 0;
+    uint32_t speed = i2c_buses[bus].speed ? i2c_buses[bus].speed : I2C_BUS_SPEED_DEFAULT;
+
+    for(devices_index_t step = 0; step < plan_count; step++) {
+        const i2c_driver_t *driver = &i2c_drivers[devices[plan[step]].part];
+        uint32_t uptime = esp_timer_get_time() / 1000;
+        uint32_t ready_time = uptime < driver->warmup_time && driver->conversion_time < driver->warmup_time - uptime ?
+                              driver->warmup_time - uptime : driver->conversion_time;
+        conversion_time = ready_time > conversion_time ? ready_time : conversion_time;
+        collect_time += driver->collect_time;
+        transfer_bits += (driver->read_bytes + I2C_TRANSFER_OVERHEAD) * 9;
+        if(devices[plan[step]].multiplexer && (!step || devices[plan[step]].multiplexer != devices[plan[step - 1]].multiplexer ||
+                                                devices[plan[step]].channel != devices[plan[step - 1]].channel))
+            transfer_bits += 2 * 2 * 9;     // one channel switch for trigger and another for collect
     }
+    return conversion_time + collect_time + (transfer_bits * 1000 + speed - 1) / speed;
+}
+
+// Fills plan with the devices of a bus sorted by multiplexer and channel, so that each
+// channel is switched on once per pass. Returns the number of devices in the plan.
+
+devices_index_t i2c_plan_bus(device_bus_t bus, devices_index_t *plan)
+{
+    devices_index_t plan_count = 0;
+
+    for(devices_index_t device = 0; device < devices_count; device++) {
+        if(devices[device].resource != RESOURCE_I2C || devices[device].bus != bus)
+            continue;
+        uint16_t key = devices[device].multiplexer << 8 | devices[device].channel;
+        devices_index_t position = plan_count++;
+        while(position > 0 && (devices[plan[position - 1]].multiplexer << 8 | devices[plan[position - 1]].channel) > key) {
+            plan[position] = plan[position - 1];
+            position--;
+        }
+        plan[position] = device;
+    }
+    i2c_buses[bus].mux_writes = 0;
+    i2c_buses[bus].predicted_time = i2c_predict_bus(bus, plan, plan_count);
+    return plan_count;
+}
+
+// Closes the multiplexers at the end of a measurement cycle and updates the diagnostic,
+// counting against switching every multiplexed device on and off for trigger and collect.
+
+void i2c_finish_bus(device_bus_t bus)
+{
+    uint16_t unplanned_writes = 0;
+
+    i2c_release_channel(bus);
+    for(devices_index_t device = 0; device < devices_count; device++)
+        if(devices[device].resource == RESOURCE_I2C && devices[device].bus == bus && devices[device].multiplexer)
+            unplanned_writes += 4;
+    i2c_buses[bus].mux_writes_saved = unplanned_writes > i2c_buses[bus].mux_writes ? unplanned_writes - i2c_buses[bus].mux_writes : 0;
+}
+
+// Starts the conversion of a device without waiting for it, returning in conversion_time
+// the milliseconds to wait before i2c_collect_device() can read the result.
 
+bool i2c_trigger_device(devices_index_t device, uint32_t *conversion_time)
+{
+    const i2c_driver_t *driver = &i2c_drivers[devices[device].part];
+    uint32_t uptime = esp_timer_get_time() / 1000;
+
+    *conversion_time = driver->conversion_time;
+    if(uptime < driver->warmup_time && *conversion_time < driver->warmup_time - uptime)
+        *conversion_time = driver->warmup_time - uptime;
+    if(!driver->collect)
+        return false;
+
+    i2c_select_channel(devices[device].bus, devices[device].multiplexer, devices[device].channel);
+    return !driver->trigger || driver->trigger(device);     // free running or self timed parts have nothing to trigger
+}
+
+// Reads and appends the results of a conversion started with i2c_trigger_device().
+
+bool i2c_collect_device(devices_index_t device)
+{
+    const i2c_driver_t *driver = &i2c_drivers[devices[device].part];
+
+    if(!driver->collect)
+        return false;
+
+    i2c_select_channel(devices[device].bus, devices[device].multiplexer, devices[device].channel);
+    bool ok = driver->collect(device);
     if(ok)
         devices[device].timestamp = NOW;
 
@@ -703,6 +962,31 @@ bool sensirion_check_crc(uint8_t *buffer)
   return crc == buffer[2];
 }
 
+// Polls a Sensirion data ready command until any bit of mask is set in the answer or timeout
+// milliseconds pass, so that reads follow the actual readiness of the sensor.
+
+bool sensirion_wait_ready(devices_index_t device, uint16_t command, uint16_t mask, uint32_t execution_time, uint32_t timeout)
+{
+    uint8_t ready_cmd[] = { command >> 8, command & 0xFF };
+    uint8_t ready_data[3];
+    int64_t deadline = esp_timer_get_time() + timeout * 1000L;
+
+    while(true) {
+        if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, ready_cmd, sizeof(ready_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+            return false;
+        vTaskDelay((execution_time + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+        if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, ready_data, sizeof(ready_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+            return false;
+        if(!sensirion_check_crc(ready_data))
+            return false;
+        if((ready_data[0] << 8 | ready_data[1]) & mask)
+            return true;
+        if(esp_timer_get_time() > deadline)
+            return false;
+        vTaskDelay(I2C_READY_POLL_INTERVAL / portTICK_PERIOD_MS);
+    }
+}
+
 bool i2c_detect_sht3x(device_bus_t bus, device_address_t address)
 {
     uint8_t reset_cmd[] = { 0x30, 0xA2 };
@@ -723,13 +1007,14 @@ bool i2c_detect_sht3x(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_sht3x(devices_index_t device)
+bool i2c_trigger_sht3x(devices_index_t device)
 {
     uint8_t measure_cmd[] = { 0x24, 0x00 };
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(30 / portTICK_PERIOD_MS);
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
 
+bool i2c_measure_sht3x(devices_index_t device)
+{
     uint8_t raw_buf[6];
     if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, raw_buf, sizeof(raw_buf), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
@@ -740,7 +1025,7 @@ bool i2c_measure_sht3x(devices_index_t device)
     float humidity = (((raw_buf[3] << 8 | raw_buf[4]) * 100) / 65535.0);
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -767,13 +1052,14 @@ bool i2c_detect_sht4x(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_sht4x(devices_index_t device)
+bool i2c_trigger_sht4x(devices_index_t device)
 {
     uint8_t measure_cmd[] = { 0xFD };
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(30 / portTICK_PERIOD_MS);
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
 
+bool i2c_measure_sht4x(devices_index_t device)
+{
     uint8_t raw_buf[6];
     if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, raw_buf, sizeof(raw_buf), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
@@ -784,7 +1070,7 @@ bool i2c_measure_sht4x(devices_index_t device)
     float humidity = (((raw_buf[3] << 8 | raw_buf[4]) * 125) / 65535.0) - 6;
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -815,20 +1101,21 @@ bool i2c_detect_htu21d(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_htu21d(devices_index_t device)
+bool i2c_trigger_htu21d(devices_index_t device)
 {
     uint8_t measure_t_cmd[] = { 0xF3 };
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_t_cmd, sizeof(measure_t_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(70 / portTICK_PERIOD_MS);
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_t_cmd, sizeof(measure_t_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
 
+bool i2c_measure_htu21d(devices_index_t device)
+{
     uint8_t t_data[3];
     if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, t_data, sizeof(t_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     if (!htu_check_crc(t_data))
         return false;
 
-    uint8_t measure_h_cmd[] = { 0xF5 };
+    uint8_t measure_h_cmd[] = { 0xF5 };   // humidity can only be converted after temperature is read
     if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_h_cmd, sizeof(measure_h_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     vTaskDelay(30 / portTICK_PERIOD_MS);
@@ -843,7 +1130,7 @@ bool i2c_measure_htu21d(devices_index_t device)
     float humidity = (((h_data[0] << 8 | h_data[1]) * 125) / 65536.0) - 6;
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -857,13 +1144,14 @@ bool i2c_detect_htu31d(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_htu31d(devices_index_t device)
+bool i2c_trigger_htu31d(devices_index_t device)
 {
     uint8_t measure_cmd[] = { 0x5E };
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(30 / portTICK_PERIOD_MS);
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
 
+bool i2c_measure_htu31d(devices_index_t device)
+{
     uint8_t read_th_cmd[] = { 0x00 };
     uint8_t th_data[6];
     if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, read_th_cmd, sizeof(read_th_cmd), th_data, sizeof(th_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -875,7 +1163,7 @@ bool i2c_measure_htu31d(devices_index_t device)
     float humidity = (((th_data[3] << 8 | th_data[4]) * 100) / 65535.0);
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f %%", temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
            measurements_append_from_device(device, 1, METRIC_Humidity, timestamp, UNIT_RH, humidity);
@@ -908,7 +1196,7 @@ bool i2c_measure_mcp9808(devices_index_t device)
     else
         temperature = measure_data[0] * 16.0 + measure_data[1] / 16.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C", temperature);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
 }
@@ -933,7 +1221,7 @@ bool i2c_measure_tmp117(devices_index_t device)
 
     float temperature = 0.007812 * (int16_t)(measure_data[0] << 8 | measure_data[1]);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C", temperature);
     return measurements_append_from_device(device, 0, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
 }
@@ -949,13 +1237,14 @@ bool i2c_detect_lps2x3x(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_lps2x3x(devices_index_t device)
+bool i2c_trigger_lps2x3x(devices_index_t device)
 {
     uint8_t one_shot_cmd[] = { 0x11, 0x13 };
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, one_shot_cmd, sizeof(one_shot_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(30 / portTICK_PERIOD_MS);
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, one_shot_cmd, sizeof(one_shot_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
 
+bool i2c_measure_lps2x3x(devices_index_t device)
+{
     uint8_t pt_cmd[] = { 0x28 };
     uint8_t pt_data[5];
     if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, pt_cmd, sizeof(pt_cmd), pt_data, sizeof(pt_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -964,7 +1253,7 @@ bool i2c_measure_lps2x3x(devices_index_t device)
     float pressure = twos_complement((int32_t)((pt_data[2] << 16) | (pt_data[1] << 8) | pt_data[0]), 24) / 4096.0;
     float temperature = (int16_t)(pt_data[4] << 8 | pt_data[3]) / 100.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature,  pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -981,13 +1270,38 @@ bool i2c_detect_bmp280(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_bmp280(devices_index_t device)
+bool i2c_calibrate_bmp280(devices_index_t device)
 {
-    uint8_t ctrl_meas_cmd[] = { 0xF4, 0x25 };  // t oversampling x 1, p oversampling x 1, forced mode
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, ctrl_meas_cmd, sizeof(ctrl_meas_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+    uint8_t read_calibration_cmd[] = { 0x88 };
+    uint8_t read_calibration_data[24];
+    if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, read_calibration_cmd, sizeof(read_calibration_cmd), read_calibration_data, sizeof(read_calibration_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
-    vTaskDelay(20 / portTICK_PERIOD_MS);
 
+    bmp280_calibration_t *calibration = &devices_states[device].bmp280;
+    calibration->t1 = read_calibration_data[0] | read_calibration_data[1] << 8;
+    calibration->t2 = read_calibration_data[2] | read_calibration_data[3] << 8;
+    calibration->t3 = read_calibration_data[4] | read_calibration_data[5] << 8;
+    calibration->p1 = read_calibration_data[6] | read_calibration_data[7] << 8;
+    calibration->p2 = read_calibration_data[8] | read_calibration_data[9] << 8;
+    calibration->p3 = read_calibration_data[10] | read_calibration_data[11] << 8;
+    calibration->p4 = read_calibration_data[12] | read_calibration_data[13] << 8;
+    calibration->p5 = read_calibration_data[14] | read_calibration_data[15] << 8;
+    calibration->p6 = read_calibration_data[16] | read_calibration_data[17] << 8;
+    calibration->p7 = read_calibration_data[18] | read_calibration_data[19] << 8;
+    calibration->p8 = read_calibration_data[20] | read_calibration_data[21] << 8;
+    calibration->p9 = read_calibration_data[22] | read_calibration_data[23] << 8;
+    devices_states[device].valid = true;
+    return true;
+}
+
+bool i2c_trigger_bmp280(devices_index_t device)
+{
+    uint8_t ctrl_meas_cmd[] = { 0xF4, 0x25 };  // t oversampling x 1, p oversampling x 1, forced mode
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, ctrl_meas_cmd, sizeof(ctrl_meas_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
+
+bool i2c_measure_bmp280(devices_index_t device)
+{
     uint8_t readout_cmd[] = { 0xF7 };
     uint8_t readout_data[6];
     if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, readout_cmd, sizeof(readout_cmd), readout_data, sizeof(readout_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -995,45 +1309,32 @@ bool i2c_measure_bmp280(devices_index_t device)
     int32_t raw_pressure = readout_data[0] << 12 | readout_data[1] << 4 | readout_data[2] >> 4;
     int32_t raw_temperature = readout_data[3] << 12 | readout_data[4] << 4 | readout_data[5] >> 4;
 
-    uint8_t read_calibration_cmd[] = { 0x88 };
-    uint8_t read_calibration_data[26];
-    if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, read_calibration_cmd, sizeof(read_calibration_cmd), read_calibration_data, sizeof(read_calibration_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+    if(!devices_states[device].valid && !i2c_calibrate_bmp280(device))
         return false;
-    uint16_t T1  = read_calibration_data[0] | read_calibration_data[1] << 8;
-    int16_t T2   = read_calibration_data[2] | read_calibration_data[3] << 8;
-    int16_t T3   = read_calibration_data[4] | read_calibration_data[5] << 8;
-    uint16_t P1  = read_calibration_data[6] | read_calibration_data[7] << 8;
-    int16_t P2   = read_calibration_data[8] | read_calibration_data[9] << 8;
-    int16_t P3   = read_calibration_data[10] | read_calibration_data[11] << 8;
-    int16_t P4   = read_calibration_data[12] | read_calibration_data[13] << 8;
-    int16_t P5   = read_calibration_data[14] | read_calibration_data[15] << 8;
-    int16_t P6   = read_calibration_data[16] | read_calibration_data[17] << 8;
-    int16_t P7   = read_calibration_data[18] | read_calibration_data[19] << 8;
-    int16_t P8   = read_calibration_data[20] | read_calibration_data[21] << 8;
-    int16_t P9   = read_calibration_data[22] | read_calibration_data[23] << 8;
-
-    int32_t fine_temperature = ((((raw_temperature >> 3) - ((int32_t) T1 << 1)) * (int32_t) T2) >> 11) +
-        ((((((raw_temperature >> 4) - (int32_t) T1) * ((raw_temperature >> 4) - (int32_t) T1)) >> 12) * (int32_t) T3) >> 14);
+    bmp280_calibration_t *calibration = &devices_states[device].bmp280;
+
+    int32_t fine_temperature = ((((raw_temperature >> 3) - ((int32_t) calibration->t1 << 1)) * (int32_t) calibration->t2) >> 11) +
+        ((((((raw_temperature >> 4) - (int32_t) calibration->t1) * ((raw_temperature >> 4) - (int32_t) calibration->t1)) >> 12) * (int32_t) calibration->t3) >> 14);
     float temperature = ((fine_temperature * 5 + 128) >> 8) / 100.0;
 
     int32_t var1, var2;
     var1 = (((int32_t) fine_temperature) / 2) - (int32_t) 64000;
-    var2 = (((var1 / 4) * (var1 / 4)) / 2048) * ((int32_t) P6);
-    var2 = var2 + ((var1 * ((int32_t) P5)) * 2);
-    var2 = (var2 / 4) + (((int32_t) P4) * 65536);
-    var1 = (((P3 * (((var1 / 4) * (var1 / 4)) / 8192)) / 8) + ((((int32_t) P2) * var1) / 2)) / 262144;
-    var1 = ((((32768 + var1)) * ((int32_t) P1)) / 32768);
+    var2 = (((var1 / 4) * (var1 / 4)) / 2048) * ((int32_t) calibration->p6);
+    var2 = var2 + ((var1 * ((int32_t) calibration->p5)) * 2);
+    var2 = (var2 / 4) + (((int32_t) calibration->p4) * 65536);
+    var1 = (((calibration->p3 * (((var1 / 4) * (var1 / 4)) / 8192)) / 8) + ((((int32_t) calibration->p2) * var1) / 2)) / 262144;
+    var1 = ((((32768 + var1)) * ((int32_t) calibration->p1)) / 32768);
     uint32_t pressure_int = (uint32_t)(((int32_t)(1048576 - raw_pressure) - (var2 / 4096)) * 3125);
     if(var1 == 0)     // Avoid exception caused by division with zero
         return false;
     // Check for overflows against UINT32_MAX/2; if pres is left-shifted by 1
     pressure_int = pressure_int < 0x80000000 ? (pressure_int << 1) / ((uint32_t) var1) : (pressure_int / (uint32_t) var1) * 2;
-    var1 = (((int32_t) P9) * ((int32_t) (((pressure_int / 8) * (pressure_int / 8)) / 8192))) / 4096;
-    var2 = (((int32_t) (pressure_int / 4)) * ((int32_t) P8)) / 8192;
-    pressure_int = (uint32_t) ((int32_t) pressure_int + ((var1 + var2 + P7) / 16));
+    var1 = (((int32_t) calibration->p9) * ((int32_t) (((pressure_int / 8) * (pressure_int / 8)) / 8192))) / 4096;
+    var2 = (((int32_t) (pressure_int / 4)) * ((int32_t) calibration->p8)) / 8192;
+    pressure_int = (uint32_t) ((int32_t) pressure_int + ((var1 + var2 + calibration->p7) / 16));
     float pressure = pressure_int / 100.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature,  pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1050,13 +1351,40 @@ bool i2c_detect_bmp388(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_bmp388(devices_index_t device)
+bool i2c_calibrate_bmp388(devices_index_t device)
 {
-    uint8_t pwr_ctrl_cmd[] = { 0x1B, 0x13 };  // launch forced measurement
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, pwr_ctrl_cmd, sizeof(pwr_ctrl_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+    uint8_t calibration_cmd[] = { 0x31 };
+    uint8_t calibration_data[21];
+    if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, calibration_cmd, sizeof(calibration_cmd), calibration_data, sizeof(calibration_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
-    vTaskDelay(20 / portTICK_PERIOD_MS);
 
+    bmp388_calibration_t *calibration = &devices_states[device].bmp388;
+    calibration->t1  = (uint16_t)calibration_data[1] << 8 | calibration_data[0];
+    calibration->t2  = (uint16_t)calibration_data[3] << 8 | calibration_data[2];
+    calibration->t3  = (int8_t)(calibration_data[4]);
+    calibration->p1  = (int16_t)((uint16_t)calibration_data[6] << 8 | calibration_data[5]);
+    calibration->p2  = (int16_t)((uint16_t)calibration_data[8] << 8 | calibration_data[7]);
+    calibration->p3  = (int8_t)(calibration_data[9]);
+    calibration->p4  = (int8_t)(calibration_data[10]);
+    calibration->p5  = (uint16_t)calibration_data[12] << 8 | calibration_data[11];
+    calibration->p6  = (uint16_t)calibration_data[14] << 8 | calibration_data[13];
+    calibration->p7  = (int8_t)(calibration_data[15]);
+    calibration->p8  = (int8_t)(calibration_data[16]);
+    calibration->p9  = (int16_t)((uint16_t)calibration_data[18]<<8 | calibration_data[17]);
+    calibration->p10 = (int8_t)(calibration_data[19]);
+    calibration->p11 = (int8_t)(calibration_data[20]);
+    devices_states[device].valid = true;
+    return true;
+}
+
+bool i2c_trigger_bmp388(devices_index_t device)
+{
+    uint8_t pwr_ctrl_cmd[] = { 0x1B, 0x13 };  // launch forced measurement
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, pwr_ctrl_cmd, sizeof(pwr_ctrl_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
+
+bool i2c_measure_bmp388(devices_index_t device)
+{
     uint8_t readout_cmd[] = { 0x04 };
     uint8_t readout_data[6];
     if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, readout_cmd, sizeof(readout_cmd), readout_data, sizeof(readout_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -1064,29 +1392,14 @@ bool i2c_measure_bmp388(devices_index_t device)
     int32_t raw_pressure = readout_data[2] << 16 | readout_data[1] << 8 | readout_data[0];
     int32_t raw_temperature = readout_data[5] << 16 | readout_data[4] << 8 | readout_data[3];
 
-    uint8_t calibration_cmd[] = { 0x31 };
-    uint8_t calibration_data[21];
-    if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, calibration_cmd, sizeof(calibration_cmd), calibration_data, sizeof(calibration_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+    if(!devices_states[device].valid && !i2c_calibrate_bmp388(device))
         return false;
-    uint16_t    t1  = (uint16_t)calibration_data[1] << 8 | calibration_data[0];
-    uint16_t    t2  = (uint16_t)calibration_data[3] << 8 | calibration_data[2];
-    int8_t      t3  = (int8_t)(calibration_data[4]);
-    int16_t     p1  = (int16_t)((uint16_t)calibration_data[6] << 8 | calibration_data[5]);
-    int16_t     p2  = (int16_t)((uint16_t)calibration_data[8] << 8 | calibration_data[7]);
-    int8_t      p3  = (int8_t)(calibration_data[9]);
-    int8_t      p4  = (int8_t)(calibration_data[10]);
-    uint16_t    p5  = (uint16_t)calibration_data[12] << 8 | calibration_data[11];
-    uint16_t    p6  = (uint16_t)calibration_data[14] << 8 | calibration_data[13];
-    int8_t      p7  = (int8_t)(calibration_data[15]);
-    int8_t      p8  = (int8_t)(calibration_data[16]);
-    int16_t     p9  = (int16_t)((uint16_t)calibration_data[18]<<8 | calibration_data[17]);
-    int8_t      p10 = (int8_t)(calibration_data[19]);
-    int8_t      p11 = (int8_t)(calibration_data[20]);
-
-    uint64_t t_partial_data1 = (uint64_t)(raw_temperature - (256 * (uint64_t)(t1)));
-    uint64_t t_partial_data2 = (uint64_t)(t2 * t_partial_data1);
+    bmp388_calibration_t *calibration = &devices_states[device].bmp388;
+
+    uint64_t t_partial_data1 = (uint64_t)(raw_temperature - (256 * (uint64_t)(calibration->t1)));
+    uint64_t t_partial_data2 = (uint64_t)(calibration->t2 * t_partial_data1);
     uint64_t t_partial_data3 = (uint64_t)(t_partial_data1 * t_partial_data1);
-    int64_t t_partial_data4 = (int64_t)(((int64_t)t_partial_data3) * ((int64_t)t3));
+    int64_t t_partial_data4 = (int64_t)(((int64_t)t_partial_data3) * ((int64_t)calibration->t3));
     int64_t t_partial_data5 = ((int64_t)(((int64_t)t_partial_data2) * 262144) + (int64_t)t_partial_data4);
     int64_t t_fine = (int64_t)(((int64_t)t_partial_data5) / 4294967296);
     float temperature = (int64_t)((t_fine * 25)  / 16384) / 100.0;
@@ -1094,26 +1407,26 @@ bool i2c_measure_bmp388(devices_index_t device)
     int64_t p_partial_data1 = t_fine * t_fine;
     int64_t p_partial_data2 = p_partial_data1 / 64;
     int64_t p_partial_data3 = (p_partial_data2 * t_fine) / 256;
-    int64_t p_partial_data4 = (p8 * p_partial_data3) / 32;
-    int64_t p_partial_data5 = (p7 * p_partial_data1) * 16;
-    int64_t p_partial_data6 = (p6 * t_fine) * 4194304;
-    int64_t p_offset        = (int64_t)((int64_t)(p5) * (int64_t)140737488355328) + p_partial_data4 + p_partial_data5 + p_partial_data6;
-    p_partial_data2 = (((int64_t)p4) * p_partial_data3) / 32;
-    p_partial_data4 = (p3 * p_partial_data1) * 4;
-    p_partial_data5 = ((int64_t)(p2) - 16384) * ((int64_t)t_fine) * 2097152;
-    int64_t p_sensitivity   = (((int64_t)(p1) - 16384) * (int64_t)70368744177664) + p_partial_data2 + p_partial_data4 + p_partial_data5;
+    int64_t p_partial_data4 = (calibration->p8 * p_partial_data3) / 32;
+    int64_t p_partial_data5 = (calibration->p7 * p_partial_data1) * 16;
+    int64_t p_partial_data6 = (calibration->p6 * t_fine) * 4194304;
+    int64_t p_offset        = (int64_t)((int64_t)(calibration->p5) * (int64_t)140737488355328) + p_partial_data4 + p_partial_data5 + p_partial_data6;
+    p_partial_data2 = (((int64_t)calibration->p4) * p_partial_data3) / 32;
+    p_partial_data4 = (calibration->p3 * p_partial_data1) * 4;
+    p_partial_data5 = ((int64_t)(calibration->p2) - 16384) * ((int64_t)t_fine) * 2097152;
+    int64_t p_sensitivity   = (((int64_t)(calibration->p1) - 16384) * (int64_t)70368744177664) + p_partial_data2 + p_partial_data4 + p_partial_data5;
     p_partial_data1 = (p_sensitivity / 16777216) * raw_pressure;
-    p_partial_data2 = (int64_t)(p10) * (int64_t)(t_fine);
-    p_partial_data3 = p_partial_data2 + (65536 * (int64_t)(p9));
+    p_partial_data2 = (int64_t)(calibration->p10) * (int64_t)(t_fine);
+    p_partial_data3 = p_partial_data2 + (65536 * (int64_t)(calibration->p9));
     p_partial_data4 = (p_partial_data3 * raw_pressure) / 8192;
     p_partial_data5 = (p_partial_data4 * raw_pressure) / 512;
     p_partial_data6 = (int64_t)((uint64_t)raw_pressure * (uint64_t)raw_pressure);
-    p_partial_data2 = ((int64_t)(p11) * (int64_t)(p_partial_data6)) / 65536;
+    p_partial_data2 = ((int64_t)(calibration->p11) * (int64_t)(p_partial_data6)) / 65536;
     p_partial_data3 = (p_partial_data2 * raw_pressure) / 128;
     p_partial_data4 = (p_offset / 4) + p_partial_data1 + p_partial_data5 + p_partial_data3;
     float pressure = (((uint64_t)p_partial_data4 * 25) / (uint64_t)1099511627776) / 10000.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature, pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1137,13 +1450,39 @@ bool i2c_detect_dps310(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_dps310(devices_index_t device)
+bool i2c_calibrate_dps310(devices_index_t device)
 {
-    uint8_t temp_sample_cmd[] = { 0x08, 0x02 };  // one shot temperature sample
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, temp_sample_cmd, sizeof(temp_sample_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+    uint8_t calibration_source_cmd[] = { 0x28, 0x80 };  // use coeficients for MEMS sensor
+    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, calibration_source_cmd, sizeof(calibration_source_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
-    vTaskDelay(20 / portTICK_PERIOD_MS);
-    uint8_t press_sample_cmd[] = { 0x08, 0x01 };  // one shot pressure sample
+    uint8_t read_calibration_cmd[] = { 0x10 };
+    uint8_t coeffs[18];
+    if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, read_calibration_cmd, sizeof(read_calibration_cmd), coeffs, sizeof(coeffs), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+        return false;
+
+    dps310_calibration_t *calibration = &devices_states[device].dps310;
+    calibration->c0 = twos_complement(((uint16_t)coeffs[0] << 4) | (((uint16_t)coeffs[1] >> 4) & 0x0F), 12);
+    calibration->c1 = twos_complement((((uint16_t)coeffs[1] & 0x0F) << 8) | coeffs[2], 12);
+    calibration->c00 = twos_complement(((uint32_t)coeffs[3] << 12) | ((uint32_t)coeffs[4] << 4) | (((uint32_t)coeffs[5] >> 4) & 0x0F), 20);
+    calibration->c10 = twos_complement((((uint32_t)coeffs[5] & 0x0F) << 16) | ((uint32_t)coeffs[6] << 8) | (uint32_t)coeffs[7], 20);
+    calibration->c01 = (int16_t)coeffs[8] << 8 | coeffs[9];
+    calibration->c11 = (int16_t)coeffs[10] << 8 | coeffs[11];
+    calibration->c20 = (int16_t)coeffs[12] << 8 | coeffs[13];
+    calibration->c21 = (int16_t)coeffs[14] << 8 | coeffs[15];
+    calibration->c30 = (int16_t)coeffs[16] << 8 | coeffs[17];
+    devices_states[device].valid = true;
+    return true;
+}
+
+bool i2c_trigger_dps310(devices_index_t device)
+{
+    uint8_t temp_sample_cmd[] = { 0x08, 0x02 };  // one shot temperature sample
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, temp_sample_cmd, sizeof(temp_sample_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
+
+bool i2c_measure_dps310(devices_index_t device)
+{
+    uint8_t press_sample_cmd[] = { 0x08, 0x01 };  // one shot pressure sample, only after the temperature one is done
     if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, press_sample_cmd, sizeof(press_sample_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     vTaskDelay(20 / portTICK_PERIOD_MS);
@@ -1155,31 +1494,18 @@ bool i2c_measure_dps310(devices_index_t device)
     int32_t raw_pressure = twos_complement(read_pt_data[0] << 16 | read_pt_data[1] << 8 | read_pt_data[2], 24);
     int32_t raw_temperature = twos_complement(read_pt_data[3] << 16 | read_pt_data[4] << 8 | read_pt_data[5], 24);
 
-    uint8_t calibration_source_cmd[] = { 0x28, 0x80 };  // use coeficients for MEMS sensor
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, calibration_source_cmd, sizeof(calibration_source_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    uint8_t read_calibration_cmd[] = { 0x10 };
-    uint8_t coeffs[17];
-    if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, read_calibration_cmd, sizeof(read_calibration_cmd), coeffs, sizeof(coeffs), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+    if(!devices_states[device].valid && !i2c_calibrate_dps310(device))
         return false;
-    int16_t c0 = twos_complement(((uint16_t)coeffs[0] << 4) | (((uint16_t)coeffs[1] >> 4) & 0x0F), 12);
-    int16_t c1 = twos_complement((((uint16_t)coeffs[1] & 0x0F) << 8) | coeffs[2], 12);
-    int32_t c00 = twos_complement(((uint32_t)coeffs[3] << 12) | ((uint32_t)coeffs[4] << 4) | (((uint32_t)coeffs[5] >> 4) & 0x0F), 20);
-    int32_t c10 = twos_complement((((uint32_t)coeffs[5] & 0x0F) << 16) | ((uint32_t)coeffs[6] << 8) | (uint32_t)coeffs[7], 20);
-    int16_t c01 = (int16_t)coeffs[8] << 8 | coeffs[9];
-    int16_t c11 = (int16_t)coeffs[10] << 8 | coeffs[11];
-    int16_t c20 = (int16_t)coeffs[12] << 8 | coeffs[13];
-    int16_t c21 = (int16_t)coeffs[14] << 8 | coeffs[15];
-    int16_t c30 = (int16_t)coeffs[16] << 8 | coeffs[17];
+    dps310_calibration_t *calibration = &devices_states[device].dps310;
 
     float scaled_raw_temperature = (float)raw_temperature / 524288;
-    float temperature = scaled_raw_temperature * c1 + c0 / 2.0;
+    float temperature = scaled_raw_temperature * calibration->c1 + calibration->c0 / 2.0;
     float pressure = ((float)raw_pressure / 1572864);
-    pressure = (int32_t)c00 + pressure * ((int32_t)c10 + pressure * ((int32_t)c20 + pressure * (int32_t)c30)) +
-                 scaled_raw_temperature * ((int32_t)c01 + pressure * ((int32_t)c11 + pressure * (int32_t)c21));
+    pressure = (int32_t)calibration->c00 + pressure * ((int32_t)calibration->c10 + pressure * ((int32_t)calibration->c20 + pressure * (int32_t)calibration->c30)) +
+                 scaled_raw_temperature * ((int32_t)calibration->c01 + pressure * ((int32_t)calibration->c11 + pressure * (int32_t)calibration->c21));
     pressure /= 100.0;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C, %f hPa", temperature,  pressure);
     return measurements_append_from_device(device, 0, METRIC_Pressure, timestamp, UNIT_hPa, pressure) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature);
@@ -1229,7 +1555,7 @@ bool i2c_measure_mlx90614(devices_index_t device)
         return false;
     float object_temperature = (t_obj1_data[4] << 8 | t_obj1_data[3]) / 50.0 - 273.15;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C object, %f C ambient", object_temperature, ambient_temperature);
     return measurements_append_from_device(device, 0, METRIC_InfraredTemperature, timestamp, UNIT_Cel, object_temperature) &&
            measurements_append_from_device(device, 1, METRIC_InternalTemperature, timestamp, UNIT_Cel, ambient_temperature);
@@ -1264,7 +1590,7 @@ bool i2c_measure_mcp960x(devices_index_t device)
         return false;
     float ambient_temperature = ((int16_t) cold_junction_data[0] << 8 | cold_junction_data[1]) * 0.0625;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f C probe, %f C ambient", probe_temperature, ambient_temperature);
     return measurements_append_from_device(device, 0, METRIC_ProbeTemperature, timestamp, UNIT_Cel, probe_temperature) &&
            measurements_append_from_device(device, 1, METRIC_InternalTemperature, timestamp, UNIT_Cel, ambient_temperature);
@@ -1281,21 +1607,23 @@ bool i2c_detect_bh1750(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_bh1750(devices_index_t device)
+bool i2c_trigger_bh1750(devices_index_t device)
 {
     uint8_t power_on_cmd[] = { 0x01 };
     if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, power_on_cmd, sizeof(power_on_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     uint8_t measure_cmd[] = { 0x20 };  // one time, high resolution
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(130 / portTICK_PERIOD_MS);
+    return !i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_cmd, sizeof(measure_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
+
+bool i2c_measure_bh1750(devices_index_t device)
+{
     uint8_t measure_data[2];
     if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, measure_data, sizeof(measure_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     float lux = (measure_data[0] << 8 | measure_data[1]) / 1.2;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f lux", lux);
     return measurements_append_from_device(device, 0, METRIC_LightIntensity, timestamp, UNIT_lux, lux);
 }
@@ -1308,14 +1636,12 @@ bool i2c_detect_veml7700(device_bus_t bus, device_address_t address)
 
 bool i2c_measure_veml7700(devices_index_t device)
 {
-    if(NOW < 1000000)
-        vTaskDelay(100 / portTICK_PERIOD_MS);  // await for complete integration after power up or waking up from sleep
     uint8_t als_cmd[] = { 0x04 };
     uint8_t als_data[2];
     if(i2c_master_write_read_device(i2c_buses[devices[device].bus].port, devices[device].address, als_cmd, sizeof(als_cmd), als_data, sizeof(als_data), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
     float lux = (als_data[1] << 8 | als_data[0]) * 0.2304;
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f lux", lux);
     return measurements_append_from_device(device, 0, METRIC_LightIntensity, timestamp, UNIT_lux, lux);
 }
@@ -1352,7 +1678,7 @@ bool i2c_measure_tsl2591(devices_index_t device)
     float cpl = (100.0 * 1.0) / 408.0;     // integration time in ms * gain / lux coefficient
     float lux = (((float)channel0 - (float)channel1)) * (1.0F - ((float)channel1 / (float)channel0)) / cpl;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f lux", lux);
     return measurements_append_from_device(device, 0, METRIC_LightIntensity, timestamp, UNIT_lux, lux);
  }
@@ -1386,18 +1712,20 @@ bool i2c_detect_scd4x(device_bus_t bus, device_address_t address)
     if(i2c_master_write_to_device(i2c_buses[bus].port, address, start_periodic_measurement_cmd, sizeof(start_periodic_measurement_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
 
-    if(application.next_measurement_time < esp_timer_get_time() + 6000000L)
-        application.next_measurement_time = esp_timer_get_time() + 6000000L;
-
     return true;
 }
 
+#define SCD4X_READY_TIMEOUT     (SCD4X_MEASUREMENT_INTERVAL + 500)
+
 bool i2c_measure_scd4x(devices_index_t device)
 {
+    if(!sensirion_wait_ready(device, 0xE4B8, 0x07FF, 1, SCD4X_READY_TIMEOUT))
+        return false;
+
     uint8_t read_measurement_cmd[] = { 0xec, 0x05 };
     if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, read_measurement_cmd, sizeof(read_measurement_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
         return false;
-    vTaskDelay(20 / portTICK_PERIOD_MS);
+    vTaskDelay(1);  // 1 ms execution time, a single tick covers it
 
     uint8_t raw_buf[9];
     if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, raw_buf, sizeof(raw_buf), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -1410,7 +1738,7 @@ bool i2c_measure_scd4x(devices_index_t device)
     float humidity = ((raw_buf[6] << 8 | raw_buf[7]) * 100) / 65535.0;
     humidity = humidity > 100 ? 100 : (humidity < 0 ? 0 : humidity);
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
     ESP_LOGI(__func__, "%f CO2 ppm, %f C, %f %%", co2, temperature, humidity);
     return measurements_append_from_device(device, 0, METRIC_CO2, timestamp, UNIT_ppm, co2) &&
            measurements_append_from_device(device, 1, METRIC_Temperature, timestamp, UNIT_Cel, temperature) &&
@@ -1445,7 +1773,7 @@ bool i2c_detect_sen5x(device_bus_t bus, device_address_t address)
     return true;
 }
 
-bool i2c_measure_sen5x(devices_index_t device)
+bool i2c_calibrate_sen5x(devices_index_t device)
 {
     uint8_t product_name_cmd[] = { 0xD0, 0x14 };
     if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, product_name_cmd, sizeof(product_name_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -1458,18 +1786,20 @@ bool i2c_measure_sen5x(devices_index_t device)
     if (!sensirion_check_crc(product_name_data) || !sensirion_check_crc(product_name_data + 3) || !sensirion_check_crc(product_name_data + 6))
         return false;
 
-    uint8_t read_data_ready_flag_cmd[] = { 0x02, 0x02 };
-    if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, read_data_ready_flag_cmd, sizeof(read_data_ready_flag_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
-        return false;
-    vTaskDelay(20 / portTICK_PERIOD_MS);
+    devices_states[device].sen5x.variant = product_name_data[6];
+    devices_states[device].valid = true;
+    return true;
+}
 
-    uint8_t flag_buf[3];
-    if(i2c_master_read_from_device(i2c_buses[devices[device].bus].port, devices[device].address, flag_buf, sizeof(flag_buf), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
+#define SEN5X_READY_TIMEOUT     (SEN5X_MEASUREMENT_INTERVAL + 100)
+
+bool i2c_measure_sen5x(devices_index_t device)
+{
+    if(!devices_states[device].valid && !i2c_calibrate_sen5x(device))
         return false;
-    if (!sensirion_check_crc(flag_buf))
+
+    if(!sensirion_wait_ready(device, 0x0202, 0x00FF, 20, SEN5X_READY_TIMEOUT))
         return false;
-    if(!flag_buf[1])
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
 
     uint8_t read_measurement_cmd[] = { 0x03, 0xC4 };
     if(i2c_master_write_to_device(i2c_buses[devices[device].bus].port, devices[device].address, read_measurement_cmd, sizeof(read_measurement_cmd), I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS))
@@ -1495,9 +1825,9 @@ bool i2c_measure_sen5x(devices_index_t device)
     voc = voc < 1 || voc > 500 ? 1 : voc;
     nox = nox < 1 || nox > 500 ? 1 : nox;
 
-    time_t timestamp = NOW;
+    measurement_timestamp_t timestamp = NOW_MS;
 
-    switch(product_name_data[6]) {
+    switch(devices_states[device].sen5x.variant) {
     case '0':
         ESP_LOGI(__func__, "PM 1.0 %.0f ug/m3, PM 2.5 %.0f ug/m3, PM 4.0 %.0f ug/m3, PM 10 %.0f ug/m3",
                             pm1_0, pm2_5, pm4_0, pm10_0);
@@ -8,6 +8,12 @@
 #define I2C_BUS_SPEED_DEFAULT 	100000
 #define I2C_BUS_SPEED_MAX 		4000000
 #define I2C_MASTER_TIMEOUT_MS   1000
+#define I2C_PROBE_TIMEOUT_MS 	10
+#define I2C_PROBE_ADDRESS_MIN 	0x08
+#define I2C_PROBE_ADDRESS_MAX 	0x77
+#define I2C_ACK_MAP_SIZE 		16		// one bit per 7 bit address
+#define I2C_TRANSFER_OVERHEAD	6		// bytes of addressing and commands around each read
+#define I2C_READY_POLL_INTERVAL	50		// milliseconds between data ready checks
 #define I2C_PCA9548_ADDRESS 	0x70
 #define I2C_PCA9548_NUM_MAX 	6
 
@@ -22,13 +28,32 @@ typedef struct {
 	uint8_t 	scl_pin;
 	bool		enabled;
 	bool		active;
+	uint32_t	measure_time;	// milliseconds spent measuring the bus in the last cycle
+	uint8_t		selected_multiplexer;	// multiplexer with a channel switched on, 0 for none
+	uint8_t		selected_channel;
+	uint16_t	mux_writes;		// multiplexer writes done in the current cycle
+	uint16_t	mux_writes_saved;	// multiplexer writes avoided in the last cycle
+	uint32_t	predicted_time;	// milliseconds the last cycle was expected to take
 } i2c_bus_t;
 
+typedef struct {
+	bool		(*detect)(device_bus_t bus, device_address_t address);
+	bool		(*calibrate)(devices_index_t device);	// NULL if there is nothing to load
+	bool		(*trigger)(devices_index_t device);		// NULL for free running or self timed parts
+	bool		(*collect)(devices_index_t device);		// reads and decodes the results
+	uint16_t	conversion_time;	// worst case milliseconds between trigger and collect
+	uint16_t	warmup_time;		// milliseconds after power up before the first valid result
+	uint16_t	collect_time;		// milliseconds waited inside collect for chained conversions
+	uint8_t		read_bytes;			// bytes read per measurement
+} i2c_driver_t;
+
 extern i2c_bus_t i2c_buses[];
 extern uint8_t i2c_buses_count;
+extern const i2c_driver_t i2c_drivers[];
 
 bool i2c_read(uint8_t port, uint8_t address, uint8_t *buffer, size_t buffer_size);
 bool i2c_write(uint8_t port, uint8_t address, uint8_t *buffer, size_t buffer_size);
+bool i2c_probe(uint8_t port, uint8_t address);
 
 void i2c_init();
 bool i2c_read_from_nvs();
@@ -43,14 +68,23 @@ void i2c_set_default();
 bool i2c_schema_handler(char *resource_name, bp_pack_t *writer);
 uint32_t i2c_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
 
+bool i2c_forget_topology();
 void i2c_detect_devices();
-bool i2c_detect_channel(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel);
+void i2c_scan_channel(device_bus_t bus, uint8_t *ack_map);
+bool i2c_detect_channel(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel, const uint8_t *ack_map);
 bool i2c_detect_device(device_bus_t bus, device_part_t part, device_address_t address);
-bool i2c_measure_device(devices_index_t device);
+void i2c_select_channel(device_bus_t bus, device_multiplexer_t multiplexer, device_channel_t channel);
+void i2c_release_channel(device_bus_t bus);
+devices_index_t i2c_plan_bus(device_bus_t bus, devices_index_t *plan);
+void i2c_finish_bus(device_bus_t bus);
+bool i2c_calibrate_device(devices_index_t device);
+bool i2c_trigger_device(devices_index_t device, uint32_t *conversion_time);
+bool i2c_collect_device(devices_index_t device);
 
 int32_t twos_complement(int32_t value, uint8_t bits);
 uint8_t mlx_crc(uint8_t *buffer, int length);
 bool sensirion_check_crc(uint8_t *buffer);
+bool sensirion_wait_ready(devices_index_t device, uint16_t command, uint16_t mask, uint32_t execution_time, uint32_t timeout);
 bool htu_check_crc(uint8_t *buffer);
 
 bool i2c_detect_sht3x(device_bus_t bus, device_address_t address);
@@ -72,6 +106,21 @@ bool i2c_detect_tsl2591(device_bus_t bus, device_address_t address);
 bool i2c_detect_scd4x(device_bus_t bus, device_address_t address);
 bool i2c_detect_sen5x(device_bus_t bus, device_address_t address);
 
+bool i2c_calibrate_bmp280(devices_index_t device);
+bool i2c_calibrate_bmp388(devices_index_t device);
+bool i2c_calibrate_dps310(devices_index_t device);
+bool i2c_calibrate_sen5x(devices_index_t device);
+
+bool i2c_trigger_sht3x(devices_index_t device);
+bool i2c_trigger_sht4x(devices_index_t device);
+bool i2c_trigger_htu21d(devices_index_t device);
+bool i2c_trigger_htu31d(devices_index_t device);
+bool i2c_trigger_lps2x3x(devices_index_t device);
+bool i2c_trigger_bmp280(devices_index_t device);
+bool i2c_trigger_bmp388(devices_index_t device);
+bool i2c_trigger_dps310(devices_index_t device);
+bool i2c_trigger_bh1750(devices_index_t device);
+
 bool i2c_measure_sht3x(devices_index_t device);
 bool i2c_measure_sht4x(devices_index_t device);
 bool i2c_measure_htu21d(devices_index_t device);
@@ -2,11 +2,13 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <esp_attr.h>
 #include <esp_log.h>
 
 #include "adc.h"
 #include "application.h"
 #include "board.h"
+#include "cbor.h"
 #include "devices.h"
 #include "enums.h"
 #include "hmac.h"
@@ -20,7 +22,41 @@
 
 bool measurements_full = false;
 measurements_index_t measurements_count = 0;
-measurement_t measurements[MEASUREMENTS_NUM_MAX] = {{0}};
+static measurement_t measurements_queue[MEASUREMENTS_NUM_MAX] = {{0}};
+static measurement_t measurements_batch[MEASUREMENTS_NUM_MAX];
+measurement_t *measurements = measurements_queue;
+measurement_series_t measurements_series[MEASUREMENTS_SERIES_NUM_MAX] = {{0}};
+
+typedef struct {
+    measurement_timestamp_t timestamp;
+    measurement_value_t     value;
+    measurement_metric_t    metric;
+    measurement_unit_t      unit;
+    devices_index_t         device;
+    device_parameter_t      parameter;
+} measurement_staged_t;
+
+static bool measurements_staging = false;
+static uint32_t measurements_staged_count = 0;
+static measurement_staged_t measurements_staged[MEASUREMENTS_STAGED_NUM_MAX];
+
+RTC_DATA_ATTR static measurement_aggregator_t measurements_aggregators[MEASUREMENTS_AGGREGATORS_NUM_MAX] = {{0}};
+RTC_DATA_ATTR static measurement_deadband_t measurements_deadbands[MEASUREMENTS_DEADBANDS_NUM_MAX] = {{0}};
+RTC_DATA_ATTR uint32_t measurements_suppressed = 0;     // samples filtered out by deadbands, reset when reported
+
+uint8_t measurements_blocks_count = 0;
+measurement_block_t measurements_blocks[MEASUREMENTS_BLOCKS_NUM_MAX];
+measurement_value_t measurements_block_samples[MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX];
+static uint16_t measurements_block_samples_count = 0;
+static uint32_t measurements_sequence = 0;      // measurements appended since boot, not reset with the queue
+
+static bool measurements_batching = false;
+static struct {         // state of the queue while a batch takes its place
+    bool full;
+    measurements_index_t count;
+    uint32_t sequence;
+    uint8_t blocks_count;
+} measurements_saved;
 
 measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, resource_t resource, device_bus_t bus,
     device_multiplexer_t multiplexer, device_channel_t channel, device_part_t part, device_parameter_t parameter,
@@ -37,64 +73,83 @@ measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, re
            ((uint64_t)(unit & 0xFF) << 56);
 }
 
-bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char separator)
+// Paths are the device path, which SenML uses as base name, followed by the metric name.
+
+static bool measurements_render_device_path(pbuf_t *buf, measurement_series_t *series, char separator)
 {
-    switch(measurements[measurement].resource) {
+    bool ok = true;
+
+    ok = ok && pbuf_put_hex(buf, series->node, 16);
+    ok = ok && pbuf_putc(buf, separator) && pbuf_puts(buf, resource_labels[series->resource]);
+    switch(series->resource) {
     case RESOURCE_I2C:
     case RESOURCE_ONEWIRE:
     case RESOURCE_BLE:
-        return pbuf_printf(buf, "%016llX%c%s%c%i%c%i%c%i%c%016llX%c%s%c%i%c%s",
-            measurements[measurement].node,
-            separator,
-            resource_labels[measurements[measurement].resource],
-            separator,
-            measurements[measurement].bus,
-            separator,
-            measurements[measurement].multiplexer,
-            separator,
-            measurements[measurement].channel,
-            separator,
-            measurements[measurement].address,
-            separator,
-            parts[measurements[measurement].part].label,
-            separator,
-            measurements[measurement].parameter,
-            separator,
-            metric_labels[measurements[measurement].metric]);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_put_unsigned(buf, series->bus);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_put_unsigned(buf, series->multiplexer);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_put_unsigned(buf, series->channel);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_put_hex(buf, series->address, 16);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_puts(buf, parts[series->part].label);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_put_unsigned(buf, series->parameter);
+        break;
     case RESOURCE_ADC:
-        return pbuf_printf(buf, "%016llX%c%s%c%i%c%s",
-            measurements[measurement].node,
-            separator,
-            resource_labels[measurements[measurement].resource],
-            separator,
-            measurements[measurement].parameter,
-            separator,
-            metric_labels[measurements[measurement].metric]);
+        ok = ok && pbuf_putc(buf, separator) && pbuf_put_unsigned(buf, series->parameter);
+        break;
     default:
-        return pbuf_printf(buf, "%016llX%c%s%c%s",
-            measurements[measurement].node,
-            separator,
-            resource_labels[measurements[measurement].resource],
-            separator,
-            metric_labels[measurements[measurement].metric]);
+        break;
     }
+    return ok;
+}
+
+static bool measurements_render_metric_name(pbuf_t *buf, measurement_series_t *series, char separator)
+{
+    bool ok = pbuf_puts(buf, metric_labels[series->metric]);
+    if(ok && series->aggregate != AGGREGATE_NONE && series->aggregate < AGGREGATE_NUM_MAX)
+        ok = pbuf_putc(buf, separator) && pbuf_puts(buf, aggregate_labels[series->aggregate]);
+    return ok;
+}
+
+static bool measurements_render_path(pbuf_t *buf, measurement_series_t *series, char separator)
+{
+    return measurements_render_device_path(buf, series, separator) && pbuf_putc(buf, separator) &&
+           measurements_render_metric_name(buf, series, separator);
+}
+
+static bool measurements_same_device(measurement_series_t *a, measurement_series_t *b)
+{
+    return a->node == b->node && a->resource == b->resource && a->bus == b->bus && a->multiplexer == b->multiplexer &&
+           a->channel == b->channel && a->address == b->address && a->part == b->part && a->parameter == b->parameter;
+}
+
+bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char separator)
+{
+    return measurements_render_path(buf, &measurements_series[measurements[measurement].series], separator);
 }
 
+// Milliseconds since the epoch of a measurement, the current time if it has no timestamp or
+// a monotonic one that could not be placed in wall time yet.
+
+static int64_t measurements_time(measurements_index_t index)
+{
+    return measurements[index].timestamp > NOW_EPOCH_MIN ? measurements[index].timestamp * 1000LL + measurements[index].milliseconds : NOW_MS;
+}
 
 bool measurements_entry_to_frame(measurements_index_t index, measurement_frame_t *frame)
 {
-    frame->node    = measurements[index].node;
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+
+    frame->node    = series->node;
     frame->descriptor    = measurements_build_descriptor(
-                         measurements[index].node & 0xFF,
-                         measurements[index].resource,
-                         measurements[index].bus,
-                         measurements[index].multiplexer,
-                         measurements[index].channel,
-                         measurements[index].part,
-                         measurements[index].parameter,
-                         measurements[index].metric,
-                         measurements[index].unit);
-    frame->address = measurements[index].address;
+                         series->aggregate,
+                         series->resource,
+                         series->bus,
+                         series->multiplexer,
+                         series->channel,
+                         series->part,
+                         series->parameter,
+                         series->metric,
+                         series->unit);
+    frame->address = series->address;
     frame->timestamp    = measurements[index].timestamp;
     frame->value   = measurements[index].value;
     return true;
@@ -102,20 +157,22 @@ bool measurements_entry_to_frame(measurements_index_t index, measurement_frame_t
 
 bool measurements_entry_to_adv(measurements_index_t index, measurement_adv_t *adv)
 {
-    if(measurements[index].node != board.id)
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+
+    if(series->node != board.id)
         return false;
 
     adv->descriptor    = measurements_build_descriptor(
-                       measurements[index].node & 0xFF,
-                       measurements[index].resource,
-                       measurements[index].bus,
-                       measurements[index].multiplexer,
-                       measurements[index].channel,
-                       measurements[index].part,
-                       measurements[index].parameter,
-                       measurements[index].metric,
-                       measurements[index].unit);
-    adv->address = measurements[index].address;
+                       series->aggregate,
+                       series->resource,
+                       series->bus,
+                       series->multiplexer,
+                       series->channel,
+                       series->part,
+                       series->parameter,
+                       series->metric,
+                       series->unit);
+    adv->address = series->address;
     adv->timestamp    = measurements[index].timestamp;
     adv->value   = measurements[index].value;
     return true;
@@ -123,9 +180,56 @@ bool measurements_entry_to_adv(measurements_index_t index, measurement_adv_t *ad
 
 void measurements_init()
 {
+    measurements_blocks_clear();
+    measurements_full = false;
+    measurements_count = 0;
+    memset(measurements, 0, MEASUREMENTS_NUM_MAX * sizeof(measurement_t));
+    memset(measurements_series, 0, sizeof(measurements_series));
+}
+
+// Drops the blocks once they have been sent, or before a burst begins new ones, releasing their
+// series and the room for their samples. Not called while a batch is loaded.
+
+void measurements_blocks_clear()
+{
+    for(uint8_t i = 0; i < measurements_blocks_count; i++)
+        measurements_series[measurements_blocks[i].series].references--;
+    measurements_blocks_count = 0;
+    measurements_block_samples_count = 0;
+}
+
+// Records read back from the store are loaded into a batch of their own, so that sending them
+// leaves the queue alone. The batch shares the series dictionary with the queue, it takes references
+// to the series while it is loaded. It does not wrap: appends fail once it is full. Blocks are not
+// stored, so the first batch of an upload can carry the blocks of the queue along.
+
+void measurements_batch_begin(bool blocks)
+{
+    if(measurements_batching)
+        measurements_batch_end();
+    measurements_saved.full = measurements_full;
+    measurements_saved.count = measurements_count;
+    measurements_saved.sequence = measurements_sequence;
+    measurements_saved.blocks_count = measurements_blocks_count;
+    measurements = measurements_batch;
     measurements_full = false;
     measurements_count = 0;
-    memset(measurements, 0, sizeof(measurements));	
+    measurements_blocks_count = blocks ? measurements_blocks_count : 0;
+    measurements_batching = true;
+}
+
+void measurements_batch_end()
+{
+    if(!measurements_batching)
+        return;
+    for(measurements_index_t i = 0; i < (measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count); i++)
+        measurements_series[measurements[i].series].references--;
+    measurements = measurements_queue;
+    measurements_full = measurements_saved.full;
+    measurements_count = measurements_saved.count;
+    measurements_sequence = measurements_saved.sequence;
+    measurements_blocks_count = measurements_saved.blocks_count;
+    measurements_batching = false;
 }
 
 void measurements_measure()
@@ -169,6 +273,66 @@ static bool write_resource_schema(bp_pack_t *writer)
     return ok;
 }
 
+static bool write_query_schema(bp_pack_t *writer)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_put_integer(writer, SCHEMA_MAP);
+        ok = ok && bp_create_container(writer, BP_MAP);
+
+            ok = ok && bp_put_string(writer, "cursor");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "since");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "series");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_STRING | SCHEMA_MAXIMUM_BYTES);
+                ok = ok && bp_put_integer(writer, MEASUREMENTS_PATH_LENGTH - 1);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "limit");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER | SCHEMA_MINIMUM | SCHEMA_MAXIMUM);
+                ok = ok && bp_put_integer(writer, 1);
+                ok = ok && bp_put_integer(writer, MEASUREMENTS_NUM_MAX);
+            ok = ok && bp_finish_container(writer);
+
+        ok = ok && bp_finish_container(writer);
+    ok = ok && bp_finish_container(writer);
+    return ok;
+}
+
+static bool write_page_schema(bp_pack_t *writer)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_put_integer(writer, SCHEMA_MAP);
+        ok = ok && bp_create_container(writer, BP_MAP);
+
+            ok = ok && bp_put_string(writer, "measurements");
+            ok = ok && write_resource_schema(writer);
+
+            ok = ok && bp_put_string(writer, "cursor");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+            ok = ok && bp_finish_container(writer);
+
+            ok = ok && bp_put_string(writer, "more");
+            ok = ok && bp_create_container(writer, BP_LIST);
+                ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
+            ok = ok && bp_finish_container(writer);
+
+        ok = ok && bp_finish_container(writer);
+    ok = ok && bp_finish_container(writer);
+    return ok;
+}
+
 bool measurements_schema_handler(char *resource_name, bp_pack_t *writer)
 {
     bool ok = true;
@@ -182,15 +346,116 @@ bool measurements_schema_handler(char *resource_name, bp_pack_t *writer)
         ok = ok && write_resource_schema(writer);                  // Schema
     ok = ok && bp_finish_container(writer);
 
+    // GET with a query, answered with a page
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_create_container(writer, BP_LIST);           // Path
+            ok = ok && bp_put_string(writer, resource_name);
+        ok = ok && bp_finish_container(writer);
+        ok = ok && bp_put_integer(writer, SCHEMA_GET_REQUEST);     // Methods
+        ok = ok && write_query_schema(writer);                     // Schema
+    ok = ok && bp_finish_container(writer);
+
+    ok = ok && bp_create_container(writer, BP_LIST);
+        ok = ok && bp_create_container(writer, BP_LIST);           // Path
+            ok = ok && bp_put_string(writer, resource_name);
+        ok = ok && bp_finish_container(writer);
+        ok = ok && bp_put_integer(writer, SCHEMA_GET_RESPONSE);    // Methods
+        ok = ok && write_page_schema(writer);                      // Schema
+    ok = ok && bp_finish_container(writer);
+
+    return ok;
+}
+
+static bool measurements_pack_row(bp_pack_t *bp, measurements_index_t index, char *path)
+{
+    bool ok = true;
+    ok = ok && bp_create_container(bp, BP_LIST);
+        ok = ok && bp_put_string(bp, path);
+        ok = ok && bp_put_big_integer(bp, measurements_time(index) / 1000);
+        ok = ok && bp_put_string(bp, unit_labels[measurements_series[measurements[index].series].unit]);
+        ok = ok && bp_put_float(bp, measurements[index].value);
+    ok = ok && bp_finish_container(bp);
+    return ok;
+}
+
+// Pages go through the queue from the oldest measurement, stopping when the limit is reached or the buffer
+// has no room for another row. The cursor is the sequence of the next measurement to look at. A cursor of
+// measurements already overwritten, or from before a reboot, starts again from the oldest one.
+
+static bool measurements_pack_page(bp_pack_t *bp, uint32_t cursor, time_t since, char *series, uint32_t limit)
+{
+    bool ok = true;
+    char path[MEASUREMENTS_PATH_LENGTH];
+    pbuf_t buf = { path, sizeof(path), 0 };
+    measurements_index_t index = 0;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    uint32_t first = measurements_sequence - count;
+    int32_t n = cursor - first;
+    uint32_t rows = 0;
+
+    n = n < 0 || n > count ? 0 : n;
+    ok = ok && bp_create_container(bp, BP_MAP);
+        ok = ok && bp_put_string(bp, "measurements");
+        ok = ok && bp_create_container(bp, BP_LIST);
+        for(; n < count && rows < limit && ok; n++) {
+            if(bp_free_space(bp) * sizeof(bp_type_t) < MEASUREMENTS_PAGE_ROW_SIZE_MAX)
+                break;
+            index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
+            if(since && measurements_time(index) / 1000 < since)
+                continue;
+            buf.length = 0;
+            ok = ok && measurements_build_path(&buf, index, '_');
+            if(series[0] && !strstr(path, series))
+                continue;
+            ok = ok && measurements_pack_row(bp, index, path);
+            rows++;
+        }
+        ok = ok && bp_finish_container(bp);
+        ok = ok && bp_put_string(bp, "cursor");
+        ok = ok && bp_put_big_integer(bp, first + n);
+        ok = ok && bp_put_string(bp, "more");
+        ok = ok && bp_put_boolean(bp, n < count);
+    ok = ok && bp_finish_container(bp);
     return ok;
 }
 
+// The query is read before writing anything, as the response overwrites the request in the buffer.
+
 uint32_t measurements_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer)
 {
-    if(method == PM_GET)
-        return measurements_pack(writer) ? PM_205_Content : PM_500_Internal_Server_Error;
-    else
+    bool ok = true;
+    bool paged = false;
+    uint32_t cursor = 0;
+    uint32_t limit = MEASUREMENTS_NUM_MAX;
+    time_t since = 0;
+    char series[MEASUREMENTS_PATH_LENGTH] = "";
+
+    if(method != PM_GET)
         return PM_405_Method_Not_Allowed;
+
+    if(bp_close(reader) && bp_next(reader) && bp_is_map(reader) && bp_open(reader)) {
+        paged = true;
+        while(ok && bp_next(reader)) {
+            if(bp_match(reader, "cursor"))
+                cursor = bp_get_big_integer(reader);
+            else if(bp_match(reader, "since"))
+                since = bp_get_big_integer(reader);
+            else if(bp_match(reader, "series"))
+                ok = ok && bp_get_string(reader, series, (sizeof(series) - 1) / sizeof(bp_type_t)) != BP_INVALID_LENGTH;
+            else if(bp_match(reader, "limit"))
+                limit = bp_get_integer(reader);
+            else
+                bp_next(reader);
+        }
+        bp_close(reader);
+    }
+    if(!ok || (paged && !limit))
+        return PM_400_Bad_Request;
+
+    if(paged)
+        return measurements_pack_page(writer, cursor, since, series, limit) ? PM_205_Content : PM_500_Internal_Server_Error;
+    else
+        return measurements_pack(writer) ? PM_205_Content : PM_500_Internal_Server_Error;
 }
 
 bool measurements_pack(bp_pack_t *bp)
@@ -206,12 +471,7 @@ bool measurements_pack(bp_pack_t *bp)
         index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
         buf.length = 0;
         ok = ok && measurements_build_path(&buf, index, '_');
-        ok = ok && bp_create_container(bp, BP_LIST);
-            ok = ok && bp_put_string(bp, path);
-            ok = ok && bp_put_big_integer(bp, measurements[index].timestamp ? measurements[index].timestamp : NOW);
-            ok = ok && bp_put_string(bp, unit_labels[measurements[index].unit]);
-            ok = ok && bp_put_float(bp, measurements[index].value);
-        ok = ok && bp_finish_container(bp);
+        ok = ok && measurements_pack_row(bp, index, path);
     }
     ok = ok && bp_finish_container(bp);
     return ok;
@@ -248,8 +508,8 @@ bool measurements_entry_to_postman(measurements_index_t index, char *buffer, siz
     ok = ok && bp_create_container(&bp, BP_LIST);
         ok = ok && bp_create_container(&bp, BP_LIST);
             ok = ok && bp_put_string(&bp, path);
-            ok = ok && bp_put_big_integer(&bp, measurements[index].timestamp ? measurements[index].timestamp : NOW);
-            ok = ok && bp_put_string(&bp, unit_labels[measurements[index].unit]);
+            ok = ok && bp_put_big_integer(&bp, measurements_time(index) / 1000);
+            ok = ok && bp_put_string(&bp, unit_labels[measurements_series[measurements[index].series].unit]);
             ok = ok && bp_put_float(&bp, measurements[index].value);
         ok = ok && bp_finish_container(&bp);
     ok = ok && bp_finish_container(&bp);
@@ -279,157 +539,897 @@ bool measurements_to_postman(char *buffer, size_t *buffer_size, char *id, char *
     return ok;
 }
 
+// Values go out with the decimals configured for their metric, see application.precisions.
+
+static int8_t measurements_series_precision(measurement_series_t *series)
+{
+    return series->metric < METRIC_NUM_MAX ? application.precisions[series->metric] : PBUF_FLOAT_SHORTEST;
+}
+
+// SenML times are in seconds, with the milliseconds as decimals only when there are any.
+
+static bool measurements_put_senml_time(pbuf_t *buf, int64_t milliseconds)
+{
+    return milliseconds % 1000 ? pbuf_put_fixed(buf, milliseconds, 3) : pbuf_put_integer(buf, milliseconds / 1000);
+}
+
 bool measurements_entry_to_senml_row(measurements_index_t index, pbuf_t *buf)
 {
     bool ok = true;
-    ok = ok && pbuf_printf(buf,"{\"n\":\"urn:dev:mac:");
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+
+    ok = ok && pbuf_puts(buf, "{\"n\":\"urn:dev:mac:");
     ok = ok && measurements_build_path(buf, index, '_');
-    ok = ok && pbuf_printf(buf,"\",\"u\":\"%s\",\"v\":%f,\"t\":%lli}", unit_labels[measurements[index].unit],
-        measurements[index].value, (int64_t) (measurements[index].timestamp ? measurements[index].timestamp : NOW));
+    ok = ok && pbuf_puts(buf, "\",\"u\":\"") && pbuf_puts(buf, unit_labels[series->unit]);
+    ok = ok && pbuf_puts(buf, "\",\"v\":") && pbuf_put_float(buf, measurements[index].value, measurements_series_precision(series));
+    ok = ok && pbuf_puts(buf, ",\"t\":") && measurements_put_senml_time(buf, measurements_time(index));
+    ok = ok && pbuf_putc(buf, '}');
     return ok;
 }
 
-bool measurements_to_senml(char *buffer, size_t *buffer_size)
+// Records in a SenML pack are grouped by device. The first record of a group sets the device path as base
+// name and its time as base time, and the rest of the group only carry the metric name and the time offset.
+// Units are only given when they differ from the base unit, which changes with the first record of a group.
+
+static bool measurements_entry_to_senml_record(measurements_encoder_t *encoder, measurements_index_t index, pbuf_t *buf)
 {
     bool ok = true;
-    pbuf_t buf = { buffer, *buffer_size, 0 };
-    measurements_index_t index = 0;
-    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+    int64_t timestamp = measurements_time(index);
+    bool leader = encoder->measurement == encoder->group;
 
-    ok = ok && pbuf_putc(&buf, '[');
-    for(int n = 0; n != count && ok; n++) {
-        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
-        ok = ok && measurements_entry_to_senml_row(index, &buf);
-        if(n != count - 1)
-            ok = ok && pbuf_putc(&buf, ',');
+    ok = ok && pbuf_putc(buf, '{');
+    if(leader) {
+        ok = ok && pbuf_puts(buf, "\"bn\":\"urn:dev:mac:") && measurements_render_device_path(buf, series, '_');
+        ok = ok && pbuf_puts(buf, "_\",\"bt\":") && measurements_put_senml_time(buf, timestamp) && pbuf_putc(buf, ',');
+        if(!encoder->rows || series->unit != encoder->base_unit)
+            ok = ok && pbuf_puts(buf, "\"bu\":\"") && pbuf_puts(buf, unit_labels[series->unit]) && pbuf_puts(buf, "\",");
     }
-    ok = ok && pbuf_putc(&buf, ']');
+    ok = ok && pbuf_puts(buf, "\"n\":\"") && measurements_render_metric_name(buf, series, '_') && pbuf_putc(buf, '"');
+    if(!leader && series->unit != encoder->base_unit)
+        ok = ok && pbuf_puts(buf, ",\"u\":\"") && pbuf_puts(buf, unit_labels[series->unit]) && pbuf_putc(buf, '"');
+    ok = ok && pbuf_puts(buf, ",\"v\":") && pbuf_put_float(buf, measurements[index].value, measurements_series_precision(series));
+    if(!leader && timestamp != encoder->base_time)
+        ok = ok && pbuf_puts(buf, ",\"t\":") && measurements_put_senml_time(buf, timestamp - encoder->base_time);
+    ok = ok && pbuf_putc(buf, '}');
+    return ok;
+}
+
+// Blocks go after the rest of the records, as their base name, time and unit apply to the records that follow.
+// The first record of a block sets them and the rest only carry the offset from the first sample, in
+// milliseconds rounded from the sample number so that they do not drift with periods of fractional milliseconds.
+
+static int64_t measurements_block_offset(measurement_block_t *block, uint16_t sample)
+{
+    return ((int64_t) sample * block->period + 500) / 1000;
+}
+
+static bool measurements_block_sample_to_senml_row(measurement_block_t *block, uint16_t sample, pbuf_t *buf)
+{
+    bool ok = true;
+    measurement_series_t *series = &measurements_series[block->series];
+    int64_t base_time = block->base_time ? block->base_time : NOW_MS;
 
-    *buffer_size = ok ? buf.length : 0;
+    if(sample)
+        ok = ok && pbuf_puts(buf, "{\"t\":") && pbuf_put_fixed(buf, measurements_block_offset(block, sample), 3);
+    else {
+        ok = ok && pbuf_puts(buf, "{\"bn\":\"urn:dev:mac:");
+        ok = ok && measurements_render_path(buf, series, '_');
+        ok = ok && pbuf_puts(buf, "\",\"bu\":\"") && pbuf_puts(buf, unit_labels[series->unit]);
+        ok = ok && pbuf_puts(buf, "\",\"bt\":") && measurements_put_senml_time(buf, base_time);
+    }
+    ok = ok && pbuf_puts(buf, ",\"v\":") && pbuf_put_float(buf, measurements_block_samples[block->first + sample], measurements_series_precision(series));
+    ok = ok && pbuf_putc(buf, '}');
     return ok;
 }
 
-bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, char *template_row, char *template_path_separator)
+// The CBOR representation of SenML has the same records and groups, with integer labels and the values
+// as half or single precision floats. Records sent alone carry their full name, in a pack of their own.
+
+static bool measurements_render_base_name(pbuf_t *buf, measurement_series_t *series, bool device)
+{
+    return pbuf_puts(buf, "urn:dev:mac:") && (device ? measurements_render_device_path(buf, series, '_') && pbuf_putc(buf, '_') :
+                                                        measurements_render_path(buf, series, '_'));
+}
+
+static bool measurements_put_cbor_name(pbuf_t *buf, int8_t label, measurement_series_t *series, bool device)
+{
+    char name[MEASUREMENTS_PATH_LENGTH];
+    pbuf_t name_buf = { name, sizeof(name), 0 };
+
+    return measurements_render_base_name(&name_buf, series, device) &&
+           cbor_put_integer(buf, label) && cbor_put_text(buf, name, name_buf.length);
+}
+
+static bool measurements_put_cbor_metric_name(pbuf_t *buf, measurement_series_t *series)
+{
+    char name[MEASUREMENTS_PATH_LENGTH];
+    pbuf_t name_buf = { name, sizeof(name), 0 };
+
+    return measurements_render_metric_name(&name_buf, series, '_') &&
+           cbor_put_integer(buf, MEASUREMENTS_SENML_NAME) && cbor_put_text(buf, name, name_buf.length);
+}
+
+bool measurements_entry_to_senml_cbor_row(measurements_index_t index, pbuf_t *buf)
 {
     bool ok = true;
-    int template_row_length = strlen(template_row);
-    for(int j = 0; j < template_row_length && ok; j++) {
-        if(template_row[j] == '@' && j != template_row_length - 1) {
-            switch(template_row[j + 1]) {
-                case '@': ok = ok && pbuf_putc(buf, '@'); break;
-                case 'n': ok = ok && pbuf_printf(buf, "%016llX", board.id); break;
-                case 'p': ok = ok && measurements_build_path(buf, index, template_path_separator[0]); break;
-                case 'r': ok = ok && pbuf_printf(buf, "%s", resource_labels[measurements[index].resource]); break;
-                case 'R': ok = ok && pbuf_printf(buf, "%s", measurements[index].resource ? resource_labels[measurements[index].resource] : "none"); break;
-                case 'b': ok = ok && pbuf_printf(buf, "%u", measurements[index].bus); break;
-                case 'x': ok = ok && pbuf_printf(buf, "%u", measurements[index].multiplexer); break;
-                case 'c': ok = ok && pbuf_printf(buf, "%u", measurements[index].channel); break;
-                case 'a': ok = ok && pbuf_printf(buf, "%016llX", measurements[index].address); break;
-                case 'd': ok = ok && pbuf_printf(buf, "%s", parts[measurements[index].part].label); break;
-                case 'D': ok = ok && pbuf_printf(buf, "%s", measurements[index].part ? parts[measurements[index].part].label : "none"); break;
-                case 'e': ok = ok && pbuf_printf(buf, "%u", measurements[index].parameter); break;
-                case 'm': ok = ok && pbuf_printf(buf, "%s", metric_labels[measurements[index].metric]); break;
-                case 'M': ok = ok && pbuf_printf(buf, "%s", measurements[index].metric ? metric_labels[measurements[index].metric] : "none"); break;
-                case 'u': ok = ok && pbuf_printf(buf, "%s", unit_labels[measurements[index].unit]); break;
-                case 'U': ok = ok && pbuf_printf(buf, "%s", measurements[index].unit ? unit_labels[measurements[index].unit] : "none"); break;
-                case 'v': ok = ok && pbuf_printf(buf, "%f", measurements[index].value); break;
-                case 't': ok = ok && pbuf_printf(buf, "%lli", (int64_t) (measurements[index].timestamp ? measurements[index].timestamp : NOW)); break;
-                case '_': ok = ok && pbuf_printf(buf, "\n"); break;
-                case '<': ok = ok && pbuf_printf(buf, "\r"); break;
-                case '>': ok = ok && pbuf_printf(buf, "\t"); break;
-                default:  ok = ok && pbuf_printf(buf, "@%c", template_row[j + 1]);
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+
+    ok = ok && cbor_open_array(buf, 1) && cbor_open_map(buf, 4);
+    ok = ok && measurements_put_cbor_name(buf, MEASUREMENTS_SENML_NAME, series, false);
+    ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_UNIT) && cbor_put_string(buf, unit_labels[series->unit]);
+    ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_VALUE) && cbor_put_float(buf, measurements[index].value);
+    ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_TIME) && cbor_put_number(buf, measurements_time(index) / 1000.0);
+    return ok;
+}
+
+static bool measurements_entry_to_senml_cbor_record(measurements_encoder_t *encoder, measurements_index_t index, pbuf_t *buf)
+{
+    bool ok = true;
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+    int64_t timestamp = measurements_time(index);
+    bool leader = encoder->measurement == encoder->group;
+    bool unit = series->unit != encoder->base_unit || (leader && !encoder->rows);
+    bool offset = !leader && timestamp != encoder->base_time;
+
+    ok = ok && cbor_open_map(buf, 2 + unit + (leader ? 2 : offset));
+    if(leader) {
+        ok = ok && measurements_put_cbor_name(buf, MEASUREMENTS_SENML_BASE_NAME, series, true);
+        ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_BASE_TIME) && cbor_put_number(buf, timestamp / 1000.0);
+    }
+    if(unit) {
+        ok = ok && cbor_put_integer(buf, leader ? MEASUREMENTS_SENML_BASE_UNIT : MEASUREMENTS_SENML_UNIT);
+        ok = ok && cbor_put_string(buf, unit_labels[series->unit]);
+    }
+    ok = ok && measurements_put_cbor_metric_name(buf, series);
+    ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_VALUE) && cbor_put_float(buf, measurements[index].value);
+    if(offset)
+        ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_TIME) && cbor_put_number(buf, (timestamp - encoder->base_time) / 1000.0);
+    return ok;
+}
+
+// Block offsets are exact to the millisecond as floats, for blocks of up to MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX samples.
+
+static bool measurements_block_sample_to_senml_cbor_row(measurement_block_t *block, uint16_t sample, pbuf_t *buf)
+{
+    bool ok = true;
+    measurement_series_t *series = &measurements_series[block->series];
+    int64_t base_time = block->base_time ? block->base_time : NOW_MS;
+
+    if(sample) {
+        ok = ok && cbor_open_map(buf, 2);
+        ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_TIME) && cbor_put_float(buf, measurements_block_offset(block, sample) / 1000.0f);
+    }
+    else {
+        ok = ok && cbor_open_map(buf, 4);
+        ok = ok && measurements_put_cbor_name(buf, MEASUREMENTS_SENML_BASE_NAME, series, false);
+        ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_BASE_UNIT) && cbor_put_string(buf, unit_labels[series->unit]);
+        ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_BASE_TIME) && cbor_put_number(buf, base_time / 1000.0);
+    }
+    ok = ok && cbor_put_integer(buf, MEASUREMENTS_SENML_VALUE) && cbor_put_float(buf, measurements_block_samples[block->first + sample]);
+    return ok;
+}
+
+// Templates are compiled into a list of literal spans of the row and fields, so that rendering
+// a row does not go through the template looking for '@'.
+
+bool measurements_compile_template(measurement_template_t *template, char *header, char *row, char *row_separator,
+                                   char *path_separator, char *footer)
+{
+    measurement_template_op_t *op = NULL;
+    size_t row_length = strlen(row);
+
+    // the ops keep the offset and the length of their spans in the row, and the row separator its
+    // length, in single bytes
+    if(row_length > UINT8_MAX || strlen(row_separator) > UINT8_MAX) {
+        ESP_LOGE(__func__, "template row or row separator longer than %u", UINT8_MAX);
+        return false;
+    }
+    *template = (measurement_template_t) {
+        .header = header,
+        .row = row,
+        .row_separator = row_separator,
+        .footer = footer,
+        .path_separator = path_separator[0],
+        .header_length = strlen(header),
+        .footer_length = strlen(footer),
+        .row_separator_length = strlen(row_separator),
+    };
+    for(size_t j = 0; j < row_length; j++) {
+        if(op && op->field == MEASUREMENTS_TEMPLATE_LITERAL && op->offset + op->length == j && row[j] != '@') {
+            op->length++;       // the literal span goes on
+            continue;
+        }
+        if(template->ops_count == MEASUREMENTS_TEMPLATE_OPS_NUM_MAX)
+            return false;
+        op = &template->ops[template->ops_count++];
+        if(row[j] != '@' || j == row_length - 1)
+            *op = (measurement_template_op_t) { .field = MEASUREMENTS_TEMPLATE_LITERAL, .offset = j, .length = 1 };
+        else {
+            switch(row[j + 1]) {
+                case '@': *op = (measurement_template_op_t) { .field = MEASUREMENTS_TEMPLATE_CHARACTER, .offset = '@' }; break;
+                case '_': *op = (measurement_template_op_t) { .field = MEASUREMENTS_TEMPLATE_CHARACTER, .offset = '\n' }; break;
+                case '<': *op = (measurement_template_op_t) { .field = MEASUREMENTS_TEMPLATE_CHARACTER, .offset = '\r' }; break;
+                case '>': *op = (measurement_template_op_t) { .field = MEASUREMENTS_TEMPLATE_CHARACTER, .offset = '\t' }; break;
+                case 'n': case 'p': case 'r': case 'R': case 'b': case 'x': case 'c': case 'a': case 'd': case 'D':
+                case 'e': case 'm': case 'M': case 'u': case 'U': case 'v': case 't': case 'T':
+                    *op = (measurement_template_op_t) { .field = row[j + 1] }; break;
+                default:        // not a field, rendered as it is
+                    *op = (measurement_template_op_t) { .field = MEASUREMENTS_TEMPLATE_LITERAL, .offset = j, .length = 2 };
             }
             j += 1;
         }
+    }
+    return true;
+}
+
+// Renders a row for a sample of a series, with its timestamp in milliseconds since the epoch or 0 if unknown.
+
+static bool measurements_sample_to_template_row(measurement_series_t *series, int64_t timestamp, float value, pbuf_t *buf,
+                                                measurement_template_t *template)
+{
+    bool ok = true;
+    for(uint8_t i = 0; i < template->ops_count && ok; i++) {
+        measurement_template_op_t *op = &template->ops[i];
+        switch(op->field) {
+            case MEASUREMENTS_TEMPLATE_LITERAL:   ok = ok && pbuf_write(buf, template->row + op->offset, op->length); break;
+            case MEASUREMENTS_TEMPLATE_CHARACTER: ok = ok && pbuf_putc(buf, op->offset); break;
+            case 'n': ok = ok && pbuf_put_hex(buf, board.id, 16); break;
+            case 'p': ok = ok && measurements_render_path(buf, series, template->path_separator); break;
+            case 'r': ok = ok && pbuf_puts(buf, resource_labels[series->resource]); break;
+            case 'R': ok = ok && pbuf_puts(buf, series->resource ? resource_labels[series->resource] : "none"); break;
+            case 'b': ok = ok && pbuf_put_unsigned(buf, series->bus); break;
+            case 'x': ok = ok && pbuf_put_unsigned(buf, series->multiplexer); break;
+            case 'c': ok = ok && pbuf_put_unsigned(buf, series->channel); break;
+            case 'a': ok = ok && pbuf_put_hex(buf, series->address, 16); break;
+            case 'd': ok = ok && pbuf_puts(buf, parts[series->part].label); break;
+            case 'D': ok = ok && pbuf_puts(buf, series->part ? parts[series->part].label : "none"); break;
+            case 'e': ok = ok && pbuf_put_unsigned(buf, series->parameter); break;
+            case 'm': ok = ok && pbuf_puts(buf, metric_labels[series->metric]); break;
+            case 'M': ok = ok && pbuf_puts(buf, series->metric ? metric_labels[series->metric] : "none"); break;
+            case 'u': ok = ok && pbuf_puts(buf, unit_labels[series->unit]); break;
+            case 'U': ok = ok && pbuf_puts(buf, series->unit ? unit_labels[series->unit] : "none"); break;
+            case 'v': ok = ok && pbuf_put_float(buf, value, measurements_series_precision(series)); break;
+            case 't': ok = ok && pbuf_put_integer(buf, (timestamp ? timestamp : NOW_MS) / 1000); break;
+            case 'T': ok = ok && pbuf_put_integer(buf, timestamp ? timestamp : NOW_MS); break;
+        }
+    }
+    return ok;
+}
+
+bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, measurement_template_t *template)
+{
+    return measurements_sample_to_template_row(&measurements_series[measurements[index].series], measurements_time(index),
+                                               measurements[index].value, buf, template);
+}
+
+// Each encoder takes a new generation to mark the series it has grouped, so only one of them
+// can be encoding SenML at a time.
+
+void measurements_encoder_init(measurements_encoder_t *encoder, backend_format_t format, measurement_template_t *template)
+{
+    static uint32_t generation = 0;
+
+    if(!++generation)
+        ++generation;
+    *encoder = (measurements_encoder_t) {
+        .format = format,
+        .stage = MEASUREMENTS_ENCODER_HEADER,
+        .generation = generation,
+        .template = template,
+    };
+}
+
+static measurements_index_t measurements_ring_index(measurements_index_t position)     // counting from the oldest one
+{
+    return measurements_full ? (measurements_count + position) % MEASUREMENTS_NUM_MAX : position;
+}
+
+// Moves the encoder to the next row, skipping empty blocks. Returns false if there are no rows left.
+
+static bool measurements_encoder_pending(measurements_encoder_t *encoder)
+{
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+
+    if(encoder->format == BACKEND_FORMAT_SENML || encoder->format == BACKEND_FORMAT_SENML_CBOR) {     // next record of the device group, or the first one of the next group
+        while(encoder->group < count) {
+            measurement_series_t *leader = &measurements_series[measurements[measurements_ring_index(encoder->group)].series];
+            for(; encoder->measurement < count; encoder->measurement++)
+                if(measurements_same_device(&measurements_series[measurements[measurements_ring_index(encoder->measurement)].series], leader))
+                    return true;
+            do
+                encoder->group++;
+            while(encoder->group < count && measurements_series[measurements[measurements_ring_index(encoder->group)].series].encoded == encoder->generation);
+            encoder->measurement = encoder->group;
+        }
+    }
+    else if(encoder->measurement < count)
+        return true;
+    while(encoder->block < measurements_blocks_count && encoder->sample >= measurements_blocks[encoder->block].count) {
+        encoder->block++;
+        encoder->sample = 0;
+    }
+    return encoder->block < measurements_blocks_count;
+}
+
+static bool measurements_encoder_put_row(measurements_encoder_t *encoder, pbuf_t *buf)
+{
+    bool ok = true;
+    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    measurements_index_t index = measurements_ring_index(encoder->measurement);
+    measurement_block_t *block = &measurements_blocks[encoder->block];
+
+    switch(encoder->format) {
+        case BACKEND_FORMAT_SENML:
+            ok = ok && (!encoder->rows || pbuf_putc(buf, ','));
+            if(encoder->measurement < count)
+                ok = ok && measurements_entry_to_senml_record(encoder, index, buf);
+            else
+                ok = ok && measurements_block_sample_to_senml_row(block, encoder->sample, buf);
+            break;
+        case BACKEND_FORMAT_SENML_CBOR:
+            if(encoder->measurement < count)
+                ok = ok && measurements_entry_to_senml_cbor_record(encoder, index, buf);
+            else
+                ok = ok && measurements_block_sample_to_senml_cbor_row(block, encoder->sample, buf);
+            break;
+        case BACKEND_FORMAT_TEMPLATE:
+            ok = ok && (!encoder->rows || pbuf_write(buf, encoder->template->row_separator, encoder->template->row_separator_length));
+            if(encoder->measurement < count)
+                ok = ok && measurements_entry_to_template_row(index, buf, encoder->template);
+            else
+                ok = ok && measurements_sample_to_template_row(&measurements_series[block->series],
+                    block->base_time ? block->base_time + measurements_block_offset(block, encoder->sample) : 0, measurements_block_samples[block->first + encoder->sample],
+                    buf, encoder->template);
+            break;
+        default:
+            ok = false;
+    }
+    if(ok) {
+        if(encoder->format != BACKEND_FORMAT_TEMPLATE && encoder->measurement < count && encoder->measurement == encoder->group) {
+            encoder->base_time = measurements_time(index);
+            encoder->base_unit = measurements_series[measurements[index].series].unit;
+        }
+        if(encoder->measurement < count) {
+            measurements_series[measurements[index].series].encoded = encoder->generation;
+            encoder->measurement++;
+        }
         else
-            ok = ok && pbuf_putc(buf, template_row[j]);
+            encoder->sample++;
+        encoder->rows++;
     }
     return ok;
 }
 
-bool measurements_to_template(char *buffer, size_t *buffer_size, char *template_header, char *template_row, char *template_row_separator, char *template_path_separator, char *template_footer)
+static uint32_t measurements_rows_count()
+{
+    uint32_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    for(uint8_t i = 0; i < measurements_blocks_count; i++)
+        count += measurements_blocks[i].count;
+    return count;
+}
+
+// Encodes as many whole rows as fit in the buffer, continuing where the previous call stopped, and
+// returns the length written in buffer_size. Returns false if not even one row fits in the buffer.
+// The encoding is finished when the stage of the encoder is MEASUREMENTS_ENCODER_DONE.
+
+bool measurements_encode(measurements_encoder_t *encoder, char *buffer, size_t *buffer_size)
 {
     bool ok = true;
     pbuf_t buf = { buffer, *buffer_size, 0 };
-    measurements_index_t index = 0;
-    measurements_index_t count = measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count;
+    size_t length;
 
-    ok = ok && pbuf_printf(&buf, "%s", template_header);
-    for(int n = 0; n != count && ok; n++) {
-        index = measurements_full ? (measurements_count + n) % MEASUREMENTS_NUM_MAX : n;
-        ok = ok && measurements_entry_to_template_row(index, &buf, template_row, template_path_separator);
-        if(n != count - 1)
-            ok = ok && pbuf_printf(&buf, "%s", template_row_separator);
+    while(ok && encoder->stage != MEASUREMENTS_ENCODER_DONE) {
+        length = buf.length;
+        switch(encoder->stage) {
+            case MEASUREMENTS_ENCODER_HEADER:
+                switch(encoder->format) {
+                    case BACKEND_FORMAT_SENML:      ok = pbuf_putc(&buf, '['); break;
+                    case BACKEND_FORMAT_SENML_CBOR: ok = cbor_open_array(&buf, measurements_rows_count()); break;
+                    default:                        ok = pbuf_write(&buf, encoder->template->header, encoder->template->header_length);
+                }
+                encoder->stage = ok ? MEASUREMENTS_ENCODER_ROWS : encoder->stage;
+                break;
+            case MEASUREMENTS_ENCODER_ROWS:
+                if(measurements_encoder_pending(encoder))
+                    ok = measurements_encoder_put_row(encoder, &buf);
+                else
+                    encoder->stage = MEASUREMENTS_ENCODER_FOOTER;
+                break;
+            case MEASUREMENTS_ENCODER_FOOTER:
+                switch(encoder->format) {
+                    case BACKEND_FORMAT_SENML:      ok = pbuf_putc(&buf, ']'); break;
+                    case BACKEND_FORMAT_SENML_CBOR: break;      // the array has a definite length
+                    default:                        ok = pbuf_write(&buf, encoder->template->footer, encoder->template->footer_length);
+                }
+                encoder->stage = ok ? MEASUREMENTS_ENCODER_DONE : encoder->stage;
+                break;
+            default:
+                break;
+        }
+        if(!ok)
+            buf.length = length;    // the row goes in the next buffer
     }
-    ok = ok && pbuf_printf(&buf, "%s", template_footer);
+    *buffer_size = buf.length;
+    return buf.length || encoder->stage == MEASUREMENTS_ENCODER_DONE;
+}
+
+static bool measurements_encode_all(measurements_encoder_t *encoder, char *buffer, size_t *buffer_size)
+{
+    bool ok = measurements_encode(encoder, buffer, buffer_size) && encoder->stage == MEASUREMENTS_ENCODER_DONE;
 
-    *buffer_size = ok ? buf.length : 0;
+    *buffer_size = ok ? *buffer_size : 0;
     return ok;
 }
 
-bool measurements_append(node_address_t node,           resource_t resource,          device_bus_t bus,
-                         device_multiplexer_t multiplexer,  device_channel_t channel,     device_address_t address,
-                         device_part_t part,                device_parameter_t parameter, measurement_metric_t metric,
-                         measurement_timestamp_t timestamp, measurement_unit_t unit,      float value) // 😱
+bool measurements_to_senml(char *buffer, size_t *buffer_size)
+{
+    measurements_encoder_t encoder;
+
+    measurements_encoder_init(&encoder, BACKEND_FORMAT_SENML, NULL);
+    return measurements_encode_all(&encoder, buffer, buffer_size);
+}
+
+bool measurements_to_senml_cbor(char *buffer, size_t *buffer_size)
+{
+    measurements_encoder_t encoder;
+
+    measurements_encoder_init(&encoder, BACKEND_FORMAT_SENML_CBOR, NULL);
+    return measurements_encode_all(&encoder, buffer, buffer_size);
+}
+
+bool measurements_to_template(char *buffer, size_t *buffer_size, measurement_template_t *template)
+{
+    measurements_encoder_t encoder;
+
+    measurements_encoder_init(&encoder, BACKEND_FORMAT_TEMPLATE, template);
+    return measurements_encode_all(&encoder, buffer, buffer_size);
+}
+
+// Returns the index of the series with the given identity, taking a reference to it,
+// or adds it to the first free entry of the dictionary. Returns -1 if the dictionary is full.
+
+static int measurements_intern_series(measurement_series_t *identity)
 {
-    if((application.queue || !measurements_full) && (!application.queue || timestamp > 1680000000)
-      && resource < RESOURCE_NUM_MAX && part < PART_NUM_MAX && metric < METRIC_NUM_MAX && unit < UNIT_NUM_MAX) {
-        measurements[measurements_count].node = node;
-        measurements[measurements_count].resource = resource;
-        measurements[measurements_count].bus = bus;
-        measurements[measurements_count].multiplexer = multiplexer;
-        measurements[measurements_count].channel = channel;
-        measurements[measurements_count].address = address;
-        measurements[measurements_count].part = part;
-        measurements[measurements_count].parameter = parameter;
-        measurements[measurements_count].metric = metric;
-        measurements[measurements_count].timestamp = timestamp > 1680000000 ? timestamp : 0;
-        measurements[measurements_count].unit = unit;
+    int free_series = -1;
+
+    for(int series = 0; series < MEASUREMENTS_SERIES_NUM_MAX; series++) {
+        measurement_series_t *entry = &measurements_series[series];
+        if(!entry->references) {
+            free_series = free_series < 0 ? series : free_series;
+            continue;
+        }
+        if(entry->node == identity->node && entry->address == identity->address && entry->part == identity->part &&
+           entry->metric == identity->metric && entry->resource == identity->resource && entry->bus == identity->bus &&
+           entry->multiplexer == identity->multiplexer && entry->channel == identity->channel &&
+           entry->parameter == identity->parameter && entry->unit == identity->unit && entry->aggregate == identity->aggregate) {
+            entry->references++;
+            return series;
+        }
+    }
+    if(free_series >= 0) {
+        measurements_series[free_series] = *identity;
+        measurements_series[free_series].references = 1;
+    }
+    return free_series;
+}
+
+// Samples without the time get a monotonic timestamp, below NOW_EPOCH_MIN, placed in wall time as soon as
+// the offset between both clocks is known. The monotonic clock starts again after a reset, the records
+// stored before without the time get placed as if they were taken after it.
+
+static measurement_timestamp_t measurements_place(measurement_timestamp_t timestamp)
+{
+    timestamp = timestamp ? timestamp : NOW_MONOTONIC_MS;
+    return timestamp / 1000 > NOW_EPOCH_MIN || !now_wall_offset ? timestamp : timestamp + now_wall_offset;
+}
+
+static void measurements_place_list(measurement_t *list, measurements_index_t count)
+{
+    int64_t timestamp;
+
+    for(measurements_index_t i = 0; i < count; i++) {
+        if(list[i].timestamp && list[i].timestamp <= NOW_EPOCH_MIN) {
+            timestamp = measurements_place(list[i].timestamp * 1000LL + list[i].milliseconds);
+            list[i].timestamp = timestamp / 1000;
+            list[i].milliseconds = timestamp % 1000;
+        }
+    }
+}
+
+// Called when the clock is set, for the queue and the batch if one is loaded.
+
+void measurements_place_timestamps()
+{
+    if(!now_wall_offset)
+        return;
+    if(measurements_batching) {
+        measurements_place_list(measurements_batch, measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count);
+        measurements_place_list(measurements_queue, measurements_saved.full ? MEASUREMENTS_NUM_MAX : measurements_saved.count);
+    }
+    else
+        measurements_place_list(measurements_queue, measurements_full ? MEASUREMENTS_NUM_MAX : measurements_count);
+}
+
+static bool measurements_append_series(measurement_series_t *identity, measurement_timestamp_t timestamp, float value)
+{
+    timestamp = measurements_place(timestamp);
+    if((measurements_batching ? !measurements_full : (application.queue || !measurements_full) && (!application.queue || timestamp / 1000 > NOW_EPOCH_MIN)) &&
+       identity->resource < RESOURCE_NUM_MAX && identity->part < PART_NUM_MAX && identity->metric < METRIC_NUM_MAX &&
+       identity->unit < UNIT_NUM_MAX && identity->aggregate < AGGREGATE_NUM_MAX) {
+        if(measurements_full)       // the oldest measurement is overwritten, freeing its series if it was the last one
+            measurements_series[measurements[measurements_count].series].references--;
+        int series = measurements_intern_series(identity);
+        if(series < 0) {
+            if(measurements_full)
+                measurements_series[measurements[measurements_count].series].references++;
+            ESP_LOGE(__func__, "MEASUREMENTS_SERIES_NUM_MAX reached");
+            return false;
+        }
+        measurements[measurements_count].series = series;
+        measurements[measurements_count].timestamp = timestamp / 1000;
+        measurements[measurements_count].milliseconds = timestamp % 1000;
         measurements[measurements_count].value = value;
 
         measurements_full = measurements_full ? true : measurements_count == MEASUREMENTS_NUM_MAX - 1;
         measurements_count = (measurements_count + 1) % MEASUREMENTS_NUM_MAX;
+        measurements_sequence++;
         return true;
     }
     else
         return false;
 }
 
+static uint32_t measurements_hash(const uint64_t *fields, uint8_t count)
+{
+    uint32_t key = 2166136261;      // FNV-1a over the identity fields
+
+    for(uint8_t i = 0; i < count; i++)
+        for(uint8_t j = 0; j < sizeof(uint64_t); j++)
+            key = (key ^ (uint8_t)(fields[i] >> (j * 8))) * 16777619;
+    return key;
+}
+
+static uint32_t measurements_series_key(measurement_series_t *identity)
+{
+    uint64_t fields[] = { identity->node, identity->address, identity->part, identity->metric, identity->resource,
+                          identity->bus, identity->multiplexer, identity->channel, identity->parameter, identity->unit };
+    return measurements_hash(fields, sizeof(fields) / sizeof(fields[0]));
+}
+
+static uint32_t measurements_device_key(devices_index_t device)
+{
+    uint64_t fields[] = { board.id, devices[device].address, devices[device].part, devices[device].resource,
+                          devices[device].bus, devices[device].multiplexer, devices[device].channel };
+    return measurements_hash(fields, sizeof(fields) / sizeof(fields[0])) | 1;  // never 0, that means no device
+}
+
+// Accumulates the samples of a series over a window of the given number of samples and appends
+// one measurement per selected aggregate function when it closes. Without a window, or if all
+// the aggregators are in use, the sample is appended as it is. device_key is 0 for series not
+// coming from a device.
+
+static bool measurements_aggregate(measurement_series_t *identity, uint32_t device_key, measurement_timestamp_t timestamp,
+                                   float value, uint8_t window, uint8_t aggregates)
+{
+    bool ok = true;
+    uint32_t key;
+    measurement_aggregator_t *aggregator = NULL;
+
+    if(window < 2 || !(aggregates & ((1 << AGGREGATE_NUM_MAX) - 2)))
+        return measurements_append_series(identity, timestamp, value);
+
+    key = measurements_series_key(identity);
+    for(uint8_t i = 0; i < MEASUREMENTS_AGGREGATORS_NUM_MAX; i++) {
+        if(measurements_aggregators[i].count && measurements_aggregators[i].key == key) {
+            aggregator = &measurements_aggregators[i];
+            break;
+        }
+        if(!aggregator && !measurements_aggregators[i].count)
+            aggregator = &measurements_aggregators[i];
+    }
+    if(!aggregator) {
+        ESP_LOGE(__func__, "MEASUREMENTS_AGGREGATORS_NUM_MAX reached");
+        return measurements_append_series(identity, timestamp, value);
+    }
+
+    if(!aggregator->count) {
+        *aggregator = (measurement_aggregator_t) { .key = key, .device_key = device_key, .parameter = identity->parameter,
+                                                   .minimum = value, .maximum = value };
+    }
+    aggregator->minimum = value < aggregator->minimum ? value : aggregator->minimum;
+    aggregator->maximum = value > aggregator->maximum ? value : aggregator->maximum;
+    aggregator->sum += value;
+    aggregator->last = value;
+    aggregator->count++;
+    if(aggregator->count < window)
+        return true;
+
+    for(uint8_t function = AGGREGATE_MIN; function < AGGREGATE_NUM_MAX; function++) {
+        if(!(aggregates & 1 << function))
+            continue;
+        identity->aggregate = function;
+        switch(function) {
+            case AGGREGATE_MIN:     value = aggregator->minimum; break;
+            case AGGREGATE_MAX:     value = aggregator->maximum; break;
+            case AGGREGATE_MEAN:    value = aggregator->sum / aggregator->count; break;
+            case AGGREGATE_LAST:    value = aggregator->last; break;
+            case AGGREGATE_COUNT:   value = aggregator->count; break;
+        }
+        ok = measurements_append_series(identity, timestamp, value) && ok;
+    }
+    aggregator->count = 0;
+    return ok;
+}
+
+bool measurements_append(node_address_t node,           resource_t resource,          device_bus_t bus,
+                         device_multiplexer_t multiplexer,  device_channel_t channel,     device_address_t address,
+                         device_part_t part,                device_parameter_t parameter, measurement_metric_t metric,
+                         measurement_timestamp_t timestamp, measurement_unit_t unit,      float value) // 😱
+{
+    measurement_series_t identity = {
+        .node = node,
+        .address = address,
+        .part = part,
+        .metric = metric,
+        .resource = resource,
+        .bus = bus,
+        .multiplexer = multiplexer,
+        .channel = channel,
+        .parameter = parameter,
+        .unit = unit,
+    };
+    return measurements_aggregate(&identity, 0, timestamp, value, application.window, application.aggregates);
+}
+
+// Starts a block of samples of a series taken every period microseconds, reserving room for up to size
+// samples in the shared buffer. Returns its index, or -1 if there is no room left for it.
+
+int measurements_block_begin(node_address_t node,         resource_t resource,          device_bus_t bus,
+                             device_multiplexer_t multiplexer, device_channel_t channel,  device_address_t address,
+                             device_part_t part,               device_parameter_t parameter, measurement_metric_t metric,
+                             measurement_unit_t unit,          int64_t base_time,         uint32_t period,
+                             uint16_t size)
+{
+    measurement_series_t identity = {
+        .node = node,
+        .address = address,
+        .part = part,
+        .metric = metric,
+        .resource = resource,
+        .bus = bus,
+        .multiplexer = multiplexer,
+        .channel = channel,
+        .parameter = parameter,
+        .unit = unit,
+    };
+    int series;
+
+    if(measurements_blocks_count == MEASUREMENTS_BLOCKS_NUM_MAX || measurements_block_samples_count == MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX ||
+       resource >= RESOURCE_NUM_MAX || part >= PART_NUM_MAX || metric >= METRIC_NUM_MAX || unit >= UNIT_NUM_MAX)
+        return -1;
+    if((series = measurements_intern_series(&identity)) < 0) {
+        ESP_LOGE(__func__, "MEASUREMENTS_SERIES_NUM_MAX reached");
+        return -1;
+    }
+    measurements_blocks[measurements_blocks_count] = (measurement_block_t) {
+        .series = series,
+        .base_time = base_time,
+        .period = period,
+        .first = measurements_block_samples_count,
+        .size = size < MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX - measurements_block_samples_count ?
+                size : MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX - measurements_block_samples_count,
+    };
+    measurements_block_samples_count += measurements_blocks[measurements_blocks_count].size;
+    return measurements_blocks_count++;
+}
+
+bool measurements_block_append(int block, float value)
+{
+    if(block < 0 || block >= measurements_blocks_count || measurements_blocks[block].count == measurements_blocks[block].size)
+        return false;
+    measurements_block_samples[measurements_blocks[block].first + measurements_blocks[block].count++] = value;
+    return true;
+}
+
+// Returns whether a device sample has to be reported, that is, if it moved out of the deadband
+// around the last reported value of its series or the series has been silent for too long.
+// The heartbeat needs the time; while it is unknown only the deadband applies.
+
+static bool measurements_pass_deadband(devices_index_t device, uint32_t device_key, measurement_series_t *identity,
+                                       measurement_timestamp_t timestamp, float value)
+{
+    uint32_t key;
+    measurement_deadband_t *deadband = NULL;
+    float change;
+
+    if(!devices[device].deadband && !devices[device].deadband_percent)
+        return true;
+
+    key = measurements_series_key(identity);
+    for(uint8_t i = 0; i < MEASUREMENTS_DEADBANDS_NUM_MAX; i++) {
+        if(measurements_deadbands[i].used && measurements_deadbands[i].key == key) {
+            deadband = &measurements_deadbands[i];
+            break;
+        }
+        if(!deadband && !measurements_deadbands[i].used)
+            deadband = &measurements_deadbands[i];
+    }
+    if(!deadband) {
+        ESP_LOGE(__func__, "MEASUREMENTS_DEADBANDS_NUM_MAX reached");
+        return true;
+    }
+
+    change = value > deadband->reported ? value - deadband->reported : deadband->reported - value;
+    uint32_t seconds = timestamp / 1000;
+    bool heartbeat = devices[device].heartbeat && seconds &&
+                     (!deadband->reported_time || seconds - deadband->reported_time >= devices[device].heartbeat * 60);
+    if(deadband->used && !heartbeat &&
+       (!devices[device].deadband || change * 100 < devices[device].deadband) &&
+       (!devices[device].deadband_percent || change * 100 < devices[device].deadband_percent * (deadband->reported < 0 ? -deadband->reported : deadband->reported))) {
+        measurements_suppressed++;
+        return false;
+    }
+    *deadband = (measurement_deadband_t) { .key = key, .device_key = device_key, .parameter = identity->parameter,
+                                           .reported = value, .reported_time = seconds, .used = true };
+    return true;
+}
+
+// Devices with their own window aggregate with their own functions, the rest follow the application.
+// Devices without a window pass their samples through the deadband first.
+
+static bool measurements_append_device_sample(devices_index_t device, device_parameter_t parameter, measurement_metric_t metric,
+                                              measurement_timestamp_t timestamp, measurement_unit_t unit, float value)
+{
+    measurement_series_t identity = {
+        .node = board.id,
+        .address = devices[device].address,
+        .part = devices[device].part,
+        .metric = metric,
+        .resource = devices[device].resource,
+        .bus = devices[device].bus,
+        .multiplexer = devices[device].multiplexer,
+        .channel = devices[device].channel,
+        .parameter = parameter,
+        .unit = unit,
+    };
+    uint32_t device_key = measurements_device_key(device);
+
+    if(devices[device].window)
+        return measurements_aggregate(&identity, device_key, timestamp, value, devices[device].window, devices[device].aggregates);
+    if(!measurements_pass_deadband(device, device_key, &identity, timestamp, value))
+        return true;
+    return measurements_aggregate(&identity, device_key, timestamp, value, application.window, application.aggregates);
+}
+
+static int measurements_find_device(uint32_t device_key, device_parameter_t parameter, uint32_t *device_keys)
+{
+    for(devices_index_t device = 0; device < devices_count; device++)
+        if(device_keys[device] == device_key)
+            return !devices[device].mask || devices[device].mask & 1 << parameter ? device : -1;
+    return -1;
+}
+
+// Frees the aggregators and deadbands left by series that no longer exist, because their device was
+// removed or does not report that parameter anymore, or that stopped aggregating or filtering.
+
+void measurements_prune()
+{
+    uint32_t device_keys[DEVICES_NUM_MAX];
+    int device;
+
+    for(devices_index_t i = 0; i < devices_count; i++)
+        device_keys[i] = measurements_device_key(i);
+
+    for(uint8_t i = 0; i < MEASUREMENTS_AGGREGATORS_NUM_MAX; i++) {
+        measurement_aggregator_t *aggregator = &measurements_aggregators[i];
+        if(!aggregator->count)
+            continue;
+        if(!aggregator->device_key)
+            device = -1;
+        else if((device = measurements_find_device(aggregator->device_key, aggregator->parameter, device_keys)) < 0) {
+            aggregator->count = 0;
+            continue;
+        }
+        if((device >= 0 && devices[device].window ? devices[device].window : application.window) < 2)
+            aggregator->count = 0;
+    }
+    for(uint8_t i = 0; i < MEASUREMENTS_DEADBANDS_NUM_MAX; i++) {
+        measurement_deadband_t *deadband = &measurements_deadbands[i];
+        if(deadband->used && ((device = measurements_find_device(deadband->device_key, deadband->parameter, device_keys)) < 0 ||
+                              devices[device].window || (!devices[device].deadband && !devices[device].deadband_percent)))
+            deadband->used = false;
+    }
+}
+
 bool measurements_append_from_device(devices_index_t device, device_parameter_t parameter, measurement_metric_t metric,
                                      measurement_timestamp_t timestamp, measurement_unit_t unit, float value)
 {
     if(device < DEVICES_NUM_MAX && parameter < DEVICES_PARAMETERS_NUM_MAX
-      && (!devices[device].mask || devices[device].mask & 1 << parameter))
-        return measurements_append(board.id, devices[device].resource, devices[device].bus, devices[device].multiplexer,
-                                   devices[device].channel, devices[device].address, devices[device].part, parameter,
-                                   metric, timestamp, unit, value + devices[device].offsets[parameter]);
+      && (!devices[device].mask || devices[device].mask & 1 << parameter)) {
+        if(measurements_staging) {
+            uint32_t index = __atomic_fetch_add(&measurements_staged_count, 1, __ATOMIC_RELAXED);
+            if(index >= MEASUREMENTS_STAGED_NUM_MAX)
+                return false;
+            measurements_staged[index] = (measurement_staged_t) {
+                .timestamp = timestamp,
+                .value = value + devices[device].offsets[parameter],
+                .metric = metric,
+                .unit = unit,
+                .device = device,
+                .parameter = parameter,
+            };
+            return true;
+        }
+        return measurements_append_device_sample(device, parameter, metric, timestamp, unit, value + devices[device].offsets[parameter]);
+    }
     else
         return false;
 }
 
+// While staging, measurements from devices may come from several bus tasks at once; they are held back
+// and then appended in device order, so the queue looks the same as if devices had been measured one by one.
+
+void measurements_stage_begin()
+{
+    measurements_staged_count = 0;
+    measurements_staging = true;
+}
+
+bool measurements_stage_commit()
+{
+    bool ok = true;
+    uint32_t count = measurements_staged_count < MEASUREMENTS_STAGED_NUM_MAX ? measurements_staged_count : MEASUREMENTS_STAGED_NUM_MAX;
+
+    measurements_staging = false;
+    for(uint32_t i = 1; i < count; i++) {     // stable, keeps the parameters order of each device
+        measurement_staged_t staged = measurements_staged[i];
+        uint32_t j = i;
+        for(; j > 0 && measurements_staged[j - 1].device > staged.device; j--)
+            measurements_staged[j] = measurements_staged[j - 1];
+        measurements_staged[j] = staged;
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        devices_index_t device = measurements_staged[i].device;
+        ok = measurements_append_device_sample(device, measurements_staged[i].parameter, measurements_staged[i].metric,
+                                               measurements_staged[i].timestamp, measurements_staged[i].unit, measurements_staged[i].value) && ok;
+    }
+    if(measurements_staged_count > MEASUREMENTS_STAGED_NUM_MAX) {
+        ESP_LOGE(__func__, "MEASUREMENTS_STAGED_NUM_MAX reached, %lu measurements dropped", measurements_staged_count - MEASUREMENTS_STAGED_NUM_MAX);
+        ok = false;
+    }
+    measurements_staged_count = 0;
+    return ok;
+}
+
+// Frames and advertisements carry measurements already aggregated, if at all, so they are
+// appended as they are.
+
 bool measurements_append_with_descriptor(node_address_t node, measurement_descriptor_t descriptor, device_address_t address,
                                    measurement_timestamp_t timestamp, measurement_value_t value)
 {
-    return measurements_append(node,
-        (descriptor & 0x0000000000003F00) >> 8,    // resource:6
-        (descriptor & 0x000000000001C000) >> 14,   // bus:3
-        (descriptor & 0x00000000000E0000) >> 17,   // multiplexer:3
-        (descriptor & 0x0000000000F00000) >> 20,   // channel:4
-        address,
-        (descriptor & 0x0000000FFF000000) >> 24,   // part:12
-        (descriptor & 0x00000FF000000000) >> 36,   // parameter:8
-        (descriptor & 0x00FFF00000000000) >> 44,   // metric:12
-        timestamp,
-        (descriptor & 0xFF00000000000000) >> 56,   // unit:8
-        value);
+    measurement_series_t identity = {
+        .node = node,
+        .address = address,
+        .aggregate = (descriptor & 0xFF) < AGGREGATE_NUM_MAX ? (descriptor & 0xFF) : AGGREGATE_NONE,    // aggregate:8
+        .resource = (descriptor & 0x0000000000003F00) >> 8,     // resource:6
+        .bus = (descriptor & 0x000000000001C000) >> 14,         // bus:3
+        .multiplexer = (descriptor & 0x00000000000E0000) >> 17, // multiplexer:3
+        .channel = (descriptor & 0x0000000000F00000) >> 20,     // channel:4
+        .part = (descriptor & 0x0000000FFF000000) >> 24,        // part:12
+        .parameter = (descriptor & 0x00000FF000000000) >> 36,   // parameter:8
+        .metric = (descriptor & 0x00FFF00000000000) >> 44,      // metric:12
+        .unit = (descriptor & 0xFF00000000000000) >> 56,        // unit:8
+    };
+    return measurements_append_series(&identity, timestamp, value);
 }
 
 bool measurements_append_from_frame(measurement_frame_t *frame)
 {
-    return measurements_append_with_descriptor(frame->node, frame->descriptor, frame->address, frame->timestamp, frame->value);
+    return measurements_append_with_descriptor(frame->node, frame->descriptor, frame->address, frame->timestamp * 1000LL, frame->value);
 }
 
 bool measurements_append_from_adv(node_address_t node, measurement_adv_t *adv)
 {
-    return measurements_append_with_descriptor(node, adv->descriptor, adv->address, adv->timestamp, adv->value);
+    return measurements_append_with_descriptor(node, adv->descriptor, adv->address, adv->timestamp * 1000LL, adv->value);
 }
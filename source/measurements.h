@@ -4,11 +4,28 @@
 #ifndef measurements_h
 #define measurements_h
 
-#define MEASUREMENTS_NUM_MAX		64
+#define MEASUREMENTS_NUM_MAX		256
+#define MEASUREMENTS_SERIES_NUM_MAX	64		// distinct series in the queue and a stored batch, freed with their last measurement
 #define MEASUREMENTS_PATH_LENGTH	128
+#define MEASUREMENTS_TEMPLATE_OPS_NUM_MAX	64
+#define MEASUREMENTS_PAGE_ROW_SIZE_MAX	(MEASUREMENTS_PATH_LENGTH + 48)	// bytes of a packed measurement at most
+#define MEASUREMENTS_STAGED_NUM_MAX	MEASUREMENTS_NUM_MAX	// a cycle cannot append more than the queue holds
+#define MEASUREMENTS_AGGREGATORS_NUM_MAX	16
+#define MEASUREMENTS_DEADBANDS_NUM_MAX	32
+#define MEASUREMENTS_BLOCKS_NUM_MAX	ADC_CHANNELS_NUM_MAX
+#define MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX	256		// shared by all the blocks, to fit the backend buffer as SenML
+
+#define MEASUREMENTS_SENML_BASE_NAME	-2		// labels of the SenML fields in CBOR
+#define MEASUREMENTS_SENML_BASE_TIME	-3
+#define MEASUREMENTS_SENML_BASE_UNIT	-4
+#define MEASUREMENTS_SENML_NAME			0
+#define MEASUREMENTS_SENML_UNIT			1
+#define MEASUREMENTS_SENML_VALUE		2
+#define MEASUREMENTS_SENML_TIME			6
 
 #include <time.h>
 
+#include "adc.h"
 #include "devices.h"
 #include "bigpacks.h"
 #include "nodes.h"
@@ -18,14 +35,14 @@ typedef uint64_t measurement_descriptor_t;
 typedef uint8_t  measurement_tag_t;
 typedef uint16_t measurement_metric_t;
 typedef uint8_t  measurement_unit_t;
-typedef time_t   measurement_timestamp_t;
+typedef int64_t  measurement_timestamp_t;	// milliseconds since the epoch, monotonic below NOW_EPOCH_MIN, 0 if unknown
 typedef float    measurement_value_t;
+typedef uint16_t measurement_series_index_t;
+typedef uint16_t measurements_index_t;
 
-typedef struct {
+typedef struct {		// identity shared by every measurement of a series
 	node_address_t	    	node;
 	device_address_t  	    address;
-	measurement_timestamp_t	timestamp;
-	measurement_value_t     value;
 	device_part_t     	    part;
 	measurement_metric_t    metric;
 	resource_t			    resource;
@@ -34,34 +51,124 @@ typedef struct {
 	device_channel_t   	    channel;
 	device_parameter_t	    parameter;
 	measurement_unit_t      unit;
+	uint8_t					aggregate;		// aggregate_t, AGGREGATE_NONE for raw samples
+	uint16_t				references;		// measurements in the queue using it, 0 if the entry is free
+	uint32_t				encoded;		// generation of the last encoder that put its device group, for SenML
+} measurement_series_t;
+
+typedef struct {
+	uint32_t				timestamp;		// seconds, monotonic below NOW_EPOCH_MIN until the clock is set
+	measurement_value_t     value;
+	measurement_series_index_t series;
+	uint16_t				milliseconds;	// of the timestamp, in the room left by the alignment
 } measurement_t;
 
+typedef struct {		// running aggregates of a series over the current window, kept across deep sleep
+	uint32_t				key;			// hash of the series identity
+	uint32_t				device_key;		// hash of the device of the series, 0 if it does not come from a device
+	device_parameter_t		parameter;
+	uint16_t				count;			// samples in the window, 0 if the entry is free
+	float					minimum;
+	float					maximum;
+	float					sum;
+	float					last;
+} measurement_aggregator_t;
+
+typedef struct {		// last reported value of a series with a deadband, kept across deep sleep
+	uint32_t				key;			// hash of the series identity
+	uint32_t				device_key;		// hash of the device of the series
+	device_parameter_t		parameter;
+	float					reported;
+	uint32_t				reported_time;	// seconds of the last one reported, 0 if unknown
+	bool					used;
+} measurement_deadband_t;
+
+typedef struct {		// samples of a series taken at a fixed rate, timestamped as offsets from the first one
+	measurement_series_index_t series;
+	int64_t					base_time;		// milliseconds since the epoch of the first sample, 0 if unknown
+	uint32_t				period;			// microseconds between samples
+	uint16_t				first;			// index of the first sample in measurements_block_samples
+	uint16_t				count;
+	uint16_t				size;			// samples reserved for the block
+} measurement_block_t;
+
+typedef struct {		// literal span of the template row, or field to render
+	uint8_t					field;			// letter after the '@', MEASUREMENTS_TEMPLATE_LITERAL or MEASUREMENTS_TEMPLATE_CHARACTER
+	uint8_t					offset;			// of the span in the template row, or the character
+	uint8_t					length;			// of the span
+} measurement_template_op_t;
+
+#define MEASUREMENTS_TEMPLATE_LITERAL	0
+#define MEASUREMENTS_TEMPLATE_CHARACTER	1
+
+typedef struct {		// template of a backend compiled once, the strings are not copied and have to stay unchanged
+	char					*header;
+	char					*row;
+	char					*row_separator;
+	char					*footer;
+	char					path_separator;
+	uint16_t				header_length;
+	uint16_t				footer_length;
+	uint8_t					row_separator_length;
+	uint8_t					ops_count;
+	measurement_template_op_t ops[MEASUREMENTS_TEMPLATE_OPS_NUM_MAX];
+} measurement_template_t;
+
+typedef enum {
+	MEASUREMENTS_ENCODER_HEADER = 0,
+	MEASUREMENTS_ENCODER_ROWS,
+	MEASUREMENTS_ENCODER_FOOTER,
+	MEASUREMENTS_ENCODER_DONE
+} measurements_encoder_stage_t;
+
+typedef struct {		// position of an encoding of the measurements written a buffer at a time
+	backend_format_t		format;			// BACKEND_FORMAT_SENML, BACKEND_FORMAT_SENML_CBOR or BACKEND_FORMAT_TEMPLATE
+	measurements_encoder_stage_t stage;
+	measurements_index_t	measurement;	// next measurement, counting from the oldest one
+	measurements_index_t	group;			// first measurement of the device group being encoded, for SenML
+	uint32_t				generation;		// marks the series of the groups already encoded, never 0
+	int64_t					base_time;		// milliseconds, of the current SenML group
+	measurement_unit_t		base_unit;
+	uint8_t					block;			// next block sample after the measurements
+	uint16_t				sample;
+	uint32_t				rows;			// rows encoded, to put separators between them
+	measurement_template_t	*template;
+} measurements_encoder_t;
+
 typedef struct {		// for LoRa, 32 bytes
 	uint64_t node;
-	uint64_t descriptor;		// unit:8 metric:12 parameter:8 part:12 channel:4 multiplexer:3 bus:3 resource:6 tag:8 (MSB -> LSB)
+	uint64_t descriptor;		// unit:8 metric:12 parameter:8 part:12 channel:4 multiplexer:3 bus:3 resource:6 aggregate:8 (MSB -> LSB)
     uint64_t address;
     uint32_t timestamp;
     float    value;
 } __attribute__((packed)) measurement_frame_t;
 
 typedef struct {		// for BLE ADV, 24 bytes
-	uint64_t descriptor;		// unit:8 metric:12 parameter:8 part:12 channel:4 multiplexer:3 bus:3 resource:6 tag:8 (MSB -> LSB)
+	uint64_t descriptor;		// unit:8 metric:12 parameter:8 part:12 channel:4 multiplexer:3 bus:3 resource:6 aggregate:8 (MSB -> LSB)
     uint64_t address;
     uint32_t timestamp;
     float    value;
 } __attribute__((packed)) measurement_adv_t;
 
-
-typedef uint8_t measurements_index_t;
 extern bool measurements_full;
 extern measurements_index_t measurements_count;
-extern measurement_t measurements[];
+extern measurement_t *measurements;		// the queue, or the batch while one is loaded
+extern measurement_series_t measurements_series[];
+extern uint32_t measurements_suppressed;
+extern uint8_t measurements_blocks_count;
+extern measurement_block_t measurements_blocks[];
+extern measurement_value_t measurements_block_samples[];
 
 void measurements_init();
 void measurements_measure();
+void measurements_batch_begin(bool blocks);
+void measurements_batch_end();
 bool measurements_entry_to_senml_row(measurements_index_t index, pbuf_t *buf);
+bool measurements_entry_to_senml_cbor_row(measurements_index_t index, pbuf_t *buf);
 bool measurements_entry_to_postman(measurements_index_t index, char *buffer, size_t *buffer_size, char *id, char *key);
-bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, char *template_row, char *template_path_separator);
+bool measurements_compile_template(measurement_template_t *template, char *header, char *row, char *row_separator,
+                                   char *path_separator, char *footer);
+bool measurements_entry_to_template_row(measurements_index_t index, pbuf_t *buf, measurement_template_t *template);
 bool measurements_entry_to_frame(measurements_index_t index, measurement_frame_t *frame);
 bool measurements_entry_to_adv(measurements_index_t index, measurement_adv_t *adv);
 measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, resource_t resource, device_bus_t bus,
@@ -71,15 +178,29 @@ measurement_descriptor_t measurements_build_descriptor(measurement_tag_t tag, re
 bool measurements_build_path(pbuf_t *buf, measurements_index_t measurement, char separator);
 bool measurements_pack(bp_pack_t *bp);
 bool measurements_put_signature(bp_pack_t *bp, char *id, char *key);
+void measurements_encoder_init(measurements_encoder_t *encoder, backend_format_t format, measurement_template_t *template);
+bool measurements_encode(measurements_encoder_t *encoder, char *buffer, size_t *buffer_size);
 bool measurements_to_senml(char *buffer, size_t *buffer_size);
+bool measurements_to_senml_cbor(char *buffer, size_t *buffer_size);
 bool measurements_to_postman(char *buffer, size_t *buffer_size, char *id, char *key);
-bool measurements_to_template(char *buffer, size_t *buffer_size, char *template_header, char *template_row, char *template_row_separator, char *template_path_separator, char *template_footer);
+bool measurements_to_template(char *buffer, size_t *buffer_size, measurement_template_t *template);
 bool measurements_append(node_address_t node,           resource_t resource,   device_bus_t bus,
                          device_multiplexer_t multiplexer,  device_channel_t channel,     device_address_t address,
                          device_part_t part,                device_parameter_t parameter, measurement_metric_t metric,
                          measurement_timestamp_t timestamp, measurement_unit_t unit,      float value);
+int measurements_block_begin(node_address_t node,         resource_t resource,          device_bus_t bus,
+                             device_multiplexer_t multiplexer, device_channel_t channel,  device_address_t address,
+                             device_part_t part,               device_parameter_t parameter, measurement_metric_t metric,
+                             measurement_unit_t unit,          int64_t base_time,         uint32_t period,
+                             uint16_t size);
+bool measurements_block_append(int block, float value);
+void measurements_blocks_clear();
 bool measurements_append_from_device(devices_index_t device, device_parameter_t parameter, measurement_metric_t metric,
                                      measurement_timestamp_t timestamp, measurement_unit_t unit, float value);
+void measurements_prune();
+void measurements_place_timestamps();
+void measurements_stage_begin();
+bool measurements_stage_commit();
 bool measurements_append_with_descriptor(node_address_t node, measurement_descriptor_t descriptor, device_address_t address,
                                    measurement_timestamp_t timestamp, measurement_value_t value);
 bool measurements_append_from_frame(measurement_frame_t *frame);
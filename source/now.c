@@ -0,0 +1,34 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <esp_attr.h>
+
+#include "now.h"
+
+// The monotonic clock counts from the first boot and through deep sleeps, adding the time asked to sleep.
+// It starts at 1 s so that a monotonic timestamp is never 0, which means no time.
+
+RTC_DATA_ATTR int64_t now_monotonic_base = 1000000;    // microseconds counted before this boot
+RTC_DATA_ATTR int64_t now_wall_offset = 0;             // wall minus monotonic milliseconds at the last clock set, 0 if unknown
+
+int64_t now_monotonic_milliseconds()
+{
+    return (now_monotonic_base + esp_timer_get_time()) / 1000;
+}
+
+// Called before sleeping for duration microseconds.
+
+void now_sleep(int64_t duration)
+{
+    now_monotonic_base += esp_timer_get_time() + duration;
+}
+
+// Called when the system time is set, to place the monotonic timestamps in wall time.
+
+void now_sync_monotonic()
+{
+    int64_t wall = now_milliseconds();
+
+    if(wall)
+        now_wall_offset = wall - now_monotonic_milliseconds();
+}
@@ -4,8 +4,50 @@
 #ifndef now_h
 #define now_h
 
+#include <stdint.h>
+#include <sys/time.h>
 #include <time.h>
+#include <esp_timer.h>
 
-#define NOW (time(NULL) > 1680000000 ? time(NULL) : 0)
+#define NOW_EPOCH_MIN	1680000000		// system times before this one mean that the clock is not set
+#define NOW				now_seconds()
+#define NOW_MS			now_milliseconds()
+#define NOW_MONOTONIC_MS	now_monotonic_milliseconds()
+
+typedef struct {		// wall time at an instant of the monotonic timer, to timestamp fast samples without asking for the time
+	int64_t		wall;			// milliseconds since the epoch, 0 if the clock is not set
+	int64_t		monotonic;		// microseconds of esp_timer
+} now_clock_t;
+
+extern int64_t now_wall_offset;
+
+int64_t now_monotonic_milliseconds();
+void now_sleep(int64_t duration);
+void now_sync_monotonic();
+
+static inline time_t now_seconds()
+{
+    time_t seconds = time(NULL);
+    return seconds > NOW_EPOCH_MIN ? seconds : 0;
+}
+
+static inline int64_t now_milliseconds()
+{
+    struct timeval wall;
+
+    gettimeofday(&wall, NULL);
+    return wall.tv_sec > NOW_EPOCH_MIN ? wall.tv_sec * 1000LL + wall.tv_usec / 1000 : 0;
+}
+
+static inline void now_clock_sync(now_clock_t *clock)
+{
+    clock->monotonic = esp_timer_get_time();
+    clock->wall = now_milliseconds();
+}
+
+static inline int64_t now_clock_milliseconds(now_clock_t *clock)
+{
+    return clock->wall ? clock->wall + (esp_timer_get_time() - clock->monotonic) / 1000 : 0;
+}
 
 #endif
@@ -109,6 +109,11 @@ static bool write_resource_schema(bp_pack_t *writer, int method)
                     ok = ok && bp_create_container(writer, BP_LIST);
                         ok = ok && bp_put_integer(writer, SCHEMA_BOOLEAN);
                     ok = ok && bp_finish_container(writer);
+
+                    ok = ok && bp_put_string(writer, "measure_time");
+                    ok = ok && bp_create_container(writer, BP_LIST);
+                        ok = ok && bp_put_integer(writer, SCHEMA_INTEGER);
+                    ok = ok && bp_finish_container(writer);
                 }
 
                 ok = ok && bp_put_string(writer, "data_pin");
@@ -167,6 +172,8 @@ uint32_t onewire_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t
             ok = ok && bp_create_container(writer, BP_MAP);
             ok = ok && bp_put_string(writer, "active");
             ok = ok && bp_put_boolean(writer, onewire_buses[i].active);
+            ok = ok && bp_put_string(writer, "measure_time");
+            ok = ok && bp_put_integer(writer, onewire_buses[i].measure_time);
             ok = ok && bp_put_string(writer, "data_pin");
             ok = ok && bp_put_integer(writer, onewire_buses[i].data_pin);
             ok = ok && bp_put_string(writer, "power_pin");
@@ -432,13 +439,53 @@ void onewire_detect_devices()
                 onewire_buses[bus].active = false;
                 ESP_LOGI(__func__, "disabling bus %i, no devices found.", bus);
             }
-            else
+            else {
                 onewire_buses[bus].active = true;
+                for(devices_index_t device = 0; device < devices_count; device++)
+                    if(devices[device].resource == RESOURCE_ONEWIRE && devices[device].bus == bus)
+                        onewire_configure_device(device);
+            }
         }
     }
 }
 
-bool onewire_measure_device(devices_index_t device)
+#define ONEWIRE_CMD_CONVERT_TEMP        0x44
+#define ONEWIRE_CMD_READ_SCRATCHPAD     0xBE
+#define DS18B20_CONVERSION_TIME(bits)   ((750 >> (12 - (bits))) + 10)
+#define TMP1826_CONVERSION_TIME         20
+
+// Starts a temperature conversion on every device of the bus at once, returning in conversion_time
+// the milliseconds to wait for the slowest device before onewire_collect_device() reads each of them.
+
+bool onewire_trigger_bus(device_bus_t bus, uint32_t *conversion_time)
+{
+    uint8_t buffer[] = { ONEWIRE_CMD_SKIP_ROM, ONEWIRE_CMD_CONVERT_TEMP };
+
+    *conversion_time = 0;
+    for(devices_index_t device = 0; device < devices_count; device++) {
+        if(devices[device].resource == RESOURCE_ONEWIRE && devices[device].bus == bus) {
+            uint8_t resolution = devices[device].resolution ? devices[device].resolution : DEVICES_RESOLUTION_MAX;
+            if(devices[device].part == PART_DS18B20 && *conversion_time < DS18B20_CONVERSION_TIME(resolution))
+                *conversion_time = DS18B20_CONVERSION_TIME(resolution);
+            else if(devices[device].part == PART_TMP1826 && *conversion_time < TMP1826_CONVERSION_TIME)
+                *conversion_time = TMP1826_CONVERSION_TIME;
+        }
+    }
+
+    if(onewire_buses[bus].handle == NULL)
+        return false;
+    if(onewire_bus_reset(onewire_buses[bus].handle) != ESP_OK) {
+        ESP_LOGE(__func__, "bus %i reset failed", bus);
+        return false;
+    }
+    if(onewire_bus_write_bytes(onewire_buses[bus].handle, buffer, sizeof(buffer)) != ESP_OK) {
+        ESP_LOGE(__func__, "broadcast CONVERT_TEMP command in bus %i failed", bus);
+        return false;
+    }
+    return true;
+}
+
+bool onewire_collect_device(devices_index_t device)
 {
     bool ok = true;
 
@@ -476,32 +523,20 @@ esp_err_t onewire_send_command(onewire_bus_handle_t bus, uint64_t address, uint8
     return onewire_bus_write_bytes(bus, buffer, sizeof(buffer));
 }
 
-#define DS18B20_CMD_CONVERT_TEMP      0x44
-#define DS18B20_CMD_READ_SCRATCHPAD   0xBE
+#define DS18B20_CMD_WRITE_SCRATCHPAD  0x4E
+#define DS18B20_CMD_COPY_SCRATCHPAD   0x48
 
-bool onewire_measure_ds18b20(devices_index_t device)
+static bool onewire_read_scratchpad(devices_index_t device, uint8_t *scratchpad, size_t scratchpad_size)
 {
-    uint8_t scratchpad[9];
-
-    if(onewire_bus_reset(onewire_buses[devices[device].bus].handle) != ESP_OK) {
-        ESP_LOGE(__func__, "bus %i reset failed", devices[device].bus);
-        return false;
-    }
-    if(onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, DS18B20_CMD_CONVERT_TEMP) != ESP_OK) {
-        ESP_LOGE(__func__, "send DS18B20_CMD_CONVERT_TEMP command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
-        return false;
-    }
-    vTaskDelay (760 / portTICK_PERIOD_MS);  // for 12-bits resolution
-
     if(onewire_bus_reset(onewire_buses[devices[device].bus].handle) != ESP_OK) {
         ESP_LOGE(__func__, "bus %i reset failed", devices[device].bus);
         return false;
     }
-    if(onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, DS18B20_CMD_READ_SCRATCHPAD) != ESP_OK) {
-        ESP_LOGE(__func__, "send DS18B20_CMD_READ_SCRATCHPAD command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
+    if(onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, ONEWIRE_CMD_READ_SCRATCHPAD) != ESP_OK) {
+        ESP_LOGE(__func__, "send ONEWIRE_CMD_READ_SCRATCHPAD command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
         return false;
     }
-    if(onewire_bus_read_bytes(onewire_buses[devices[device].bus].handle, scratchpad, sizeof(scratchpad)) != ESP_OK) {
+    if(onewire_bus_read_bytes(onewire_buses[devices[device].bus].handle, scratchpad, scratchpad_size) != ESP_OK) {
         ESP_LOGE(__func__, "read scratchpad from address %016llX in bus %i failed", devices[device].address, devices[device].bus);
         return false;
     }
@@ -509,51 +544,82 @@ bool onewire_measure_ds18b20(devices_index_t device)
         ESP_LOGE(__func__, "scratchpad CRC error for address %016llX in bus %i", devices[device].address, devices[device].bus);
         return false;
     }
-
-    float temperature = (((int16_t)scratchpad[1] << 8) | scratchpad[0])  / 16.0f;
-
-    ESP_LOGI(__func__, "%f C", temperature);
-    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW, UNIT_Cel, temperature);
+    return true;
 }
 
+// Sets the resolution in the configuration register and copies it to the EEPROM, so it survives the
+// bus being powered down during deep sleep. The EEPROM is only written when the resolution changes.
 
-#define TMP1826_CMD_CONVERT_TEMP      0x44
-#define TMP1826_CMD_READ_SCRATCHPAD   0xBE
-
-bool onewire_measure_tmp1826(devices_index_t device)
+static bool onewire_configure_ds18b20(devices_index_t device)
 {
-    uint8_t scratchpad[18];
+    uint8_t scratchpad[9];
+    uint8_t resolution = devices[device].resolution ? devices[device].resolution : DEVICES_RESOLUTION_MAX;
+    uint8_t configuration = (resolution - DEVICES_RESOLUTION_MIN) << 5 | 0x1F;
 
-    if(onewire_bus_reset(onewire_buses[devices[device].bus].handle) != ESP_OK) {
-        ESP_LOGE(__func__, "bus %i reset failed", devices[device].bus);
+    if(!onewire_read_scratchpad(device, scratchpad, sizeof(scratchpad)))
         return false;
-    }
-    if(onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, TMP1826_CMD_CONVERT_TEMP) != ESP_OK) {
-        ESP_LOGE(__func__, "send TMP1826_CMD_CONVERT_TEMP command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
+    if(scratchpad[4] == configuration)
+        return true;
+
+    if(onewire_bus_reset(onewire_buses[devices[device].bus].handle) != ESP_OK ||
+       onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, DS18B20_CMD_WRITE_SCRATCHPAD) != ESP_OK) {
+        ESP_LOGE(__func__, "send DS18B20_CMD_WRITE_SCRATCHPAD command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
         return false;
     }
-    vTaskDelay (20 / portTICK_PERIOD_MS);
+    uint8_t registers[] = { scratchpad[2], scratchpad[3], configuration };  // keep TH and TL alarm registers
+    if(onewire_bus_write_bytes(onewire_buses[devices[device].bus].handle, registers, sizeof(registers)) != ESP_OK)
+        return false;
 
-    if(onewire_bus_reset(onewire_buses[devices[device].bus].handle) != ESP_OK) {
-        ESP_LOGE(__func__, "bus %i reset failed", devices[device].bus);
+    if(onewire_bus_reset(onewire_buses[devices[device].bus].handle) != ESP_OK ||
+       onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, DS18B20_CMD_COPY_SCRATCHPAD) != ESP_OK) {
+        ESP_LOGE(__func__, "send DS18B20_CMD_COPY_SCRATCHPAD command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
         return false;
     }
-    if(onewire_send_command(onewire_buses[devices[device].bus].handle, devices[device].address, TMP1826_CMD_READ_SCRATCHPAD) != ESP_OK) {
-        ESP_LOGE(__func__, "send TMP1826_CMD_READ_SCRATCHPAD command to address %016llX in bus %i failed", devices[device].address, devices[device].bus);
+    vTaskDelay (20 / portTICK_PERIOD_MS);  // EEPROM write time
+    ESP_LOGI(__func__, "address %016llX in bus %i set to %i bits", devices[device].address, devices[device].bus, resolution);
+    return true;
+}
+
+bool onewire_configure_device(devices_index_t device)
+{
+    if(onewire_buses[devices[device].bus].handle == NULL)
         return false;
+
+    switch(devices[device].part) {
+    case PART_DS18B20:
+        return onewire_configure_ds18b20(device);
+    default:
+        return true;
     }
-    if(onewire_bus_read_bytes(onewire_buses[devices[device].bus].handle, scratchpad, sizeof(scratchpad)) != ESP_OK) {
-        ESP_LOGE(__func__, "read scratchpad from address %016llX in bus %i failed", devices[device].address, devices[device].bus);
+}
+
+bool onewire_measure_ds18b20(devices_index_t device)
+{
+    uint8_t scratchpad[9];
+
+    if(!onewire_read_scratchpad(device, scratchpad, sizeof(scratchpad)))
         return false;
-    }
-    if(onewire_crc8(0, scratchpad, 8) != scratchpad[8]) {
-        ESP_LOGE(__func__, "scratchpad CRC error for address %016llX in bus %i", devices[device].address, devices[device].bus);
+
+    uint8_t resolution = ((scratchpad[4] >> 5) & 0x03) + DEVICES_RESOLUTION_MIN;
+    scratchpad[0] &= ~((1 << (DEVICES_RESOLUTION_MAX - resolution)) - 1);   // undefined bits below the resolution
+
+    float temperature = (((int16_t)scratchpad[1] << 8) | scratchpad[0])  / 16.0f;
+
+    ESP_LOGI(__func__, "%f C", temperature);
+    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW_MS, UNIT_Cel, temperature);
+}
+
+
+bool onewire_measure_tmp1826(devices_index_t device)
+{
+    uint8_t scratchpad[18];
+
+    if(!onewire_read_scratchpad(device, scratchpad, sizeof(scratchpad)))
         return false;
-    }
 
     float temperature = (((int16_t)scratchpad[1] << 8) | scratchpad[0])  / 16.0f;
 
     ESP_LOGI(__func__, "%f C", temperature);
-    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW, UNIT_Cel, temperature);
+    return measurements_append_from_device(device, 0, METRIC_Temperature, NOW_MS, UNIT_Cel, temperature);
 }
 
@@ -17,6 +17,7 @@ typedef struct {
 	uint8_t 	power_pin;
 	void		*handle;
 	bool		active;
+	uint32_t	measure_time;	// milliseconds spent measuring the bus in the last cycle
 } onewire_bus_t;
 
 extern onewire_bus_t onewire_buses[];
@@ -35,7 +36,9 @@ void onewire_set_default();
 bool onewire_schema_handler(char *resource_name, bp_pack_t *writer);
 uint32_t onewire_resource_handler(uint32_t method, bp_pack_t *reader, bp_pack_t *writer);
 void onewire_detect_devices();
-bool onewire_measure_device(devices_index_t device);
+bool onewire_configure_device(devices_index_t device);
+bool onewire_trigger_bus(device_bus_t bus, uint32_t *conversion_time);
+bool onewire_collect_device(devices_index_t device);
 bool onewire_measure_ds18b20(devices_index_t device);
 bool onewire_measure_tmp1826(devices_index_t device);
 
@@ -2,7 +2,9 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <math.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "pbuf.h"
 
@@ -33,3 +35,171 @@ bool pbuf_putc(pbuf_t *buffer, char c)
     buffer->data[buffer->length] = 0;
     return true;
 }
+
+bool pbuf_write(pbuf_t *buffer, const char *data, size_t length)
+{
+    if(buffer->length + length >= buffer->size)
+        return false;
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = 0;
+    return true;
+}
+
+bool pbuf_puts(pbuf_t *buffer, const char *string)
+{
+    return pbuf_write(buffer, string, strlen(string));
+}
+
+// Number writers for the text encoders, so that rows do not go through vsnprintf and its float support.
+
+static const double pbuf_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double pbuf_power_of_ten(int exponent)     // exact up to 1e22, which covers the fixed decimals
+{
+    double power = 1;
+    uint32_t magnitude = exponent < 0 ? -exponent : exponent;
+    for(; magnitude > 22; magnitude -= 22)
+        power *= pbuf_powers_of_ten[22];
+    power *= pbuf_powers_of_ten[magnitude];
+    return exponent < 0 ? 1 / power : power;
+}
+
+static size_t pbuf_format_unsigned(char *digits, uint64_t value)    // right aligned at the end of a 20 chars buffer
+{
+    size_t count = 0;
+    do {
+        digits[19 - count++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    return count;
+}
+
+bool pbuf_put_unsigned(pbuf_t *buffer, uint64_t value)
+{
+    char digits[20];
+    size_t count = pbuf_format_unsigned(digits, value);
+    return pbuf_write(buffer, digits + 20 - count, count);
+}
+
+bool pbuf_put_integer(pbuf_t *buffer, int64_t value)
+{
+    if(value < 0)
+        return pbuf_putc(buffer, '-') && pbuf_put_unsigned(buffer, -(uint64_t) value);
+    return pbuf_put_unsigned(buffer, value);
+}
+
+bool pbuf_put_hex(pbuf_t *buffer, uint64_t value, uint8_t digits)     // upper case, zero padded to the number of digits
+{
+    char hex[16];
+    if(digits > sizeof(hex))
+        return false;
+    for(uint8_t i = digits; i > 0; i--) {
+        hex[i - 1] = "0123456789ABCDEF"[value & 0xF];
+        value >>= 4;
+    }
+    return pbuf_write(buffer, hex, digits);
+}
+
+bool pbuf_put_fixed(pbuf_t *buffer, int64_t value, uint8_t decimals)     // value in units of 10^-decimals
+{
+    char digits[20];
+    bool ok = true;
+    uint64_t magnitude = value < 0 ? -(uint64_t) value : value;
+    size_t count = pbuf_format_unsigned(digits, magnitude);
+
+    if(value < 0)
+        ok = ok && pbuf_putc(buffer, '-');
+    if(count <= decimals)
+        ok = ok && pbuf_putc(buffer, '0');
+    else
+        ok = ok && pbuf_write(buffer, digits + 20 - count, count - decimals);
+    if(decimals) {
+        ok = ok && pbuf_putc(buffer, '.');
+        for(size_t i = count; i < decimals; i++)
+            ok = ok && pbuf_putc(buffer, '0');
+        ok = ok && pbuf_write(buffer, digits + 20 - (count < decimals ? count : decimals), count < decimals ? count : decimals);
+    }
+    return ok;
+}
+
+// With decimals < 0, the value goes out with the fewest significant digits that convert back to the same
+// float, trying from 1 to 9 which always do. Plain notation is used unless the exponent is out of -5..15.
+// NaN and infinities have no JSON number, they go out as null.
+
+bool pbuf_put_float(pbuf_t *buffer, float value, int8_t decimals)
+{
+    bool ok = true;
+
+    if(!isfinite(value))
+        return pbuf_puts(buffer, "null");
+
+    if(decimals > PBUF_FLOAT_DECIMALS_MAX)
+        decimals = PBUF_FLOAT_DECIMALS_MAX;
+    if(decimals >= 0 && fabsf(value) < 1e9f)
+        return pbuf_put_fixed(buffer, llround(value * pbuf_power_of_ten(decimals)), decimals);
+
+    if(value == 0)
+        return pbuf_putc(buffer, '0');
+
+    double magnitude = fabs(value);
+    int binary_exponent, exponent;
+    frexp(magnitude, &binary_exponent);
+    exponent = (binary_exponent - 1) * 30103 / 100000 - ((binary_exponent - 1) < 0);     // floor of log10, off by one at most
+    if(magnitude >= pbuf_power_of_ten(exponent + 1))
+        exponent++;
+    else if(magnitude < pbuf_power_of_ten(exponent))
+        exponent--;
+
+    uint32_t mantissa = 0;
+    uint8_t count;
+    int scale = exponent;
+    for(count = 1; count <= 9; count++) {
+        scale = exponent;
+        mantissa = llround(magnitude * pbuf_power_of_ten(count - 1 - scale));
+        if(mantissa == (uint32_t) pbuf_power_of_ten(count)) {      // rounded up to one more digit
+            mantissa /= 10;
+            scale++;
+        }
+        if((float) (mantissa * pbuf_power_of_ten(scale - count + 1)) == (float) magnitude)
+            break;
+    }
+    if(count > 9)
+        count = 9;
+    exponent = scale;
+    for(; count > 1 && mantissa % 10 == 0; count--)
+        mantissa /= 10;
+
+    char digits[20];
+    pbuf_format_unsigned(digits, mantissa);
+    char *first = digits + 20 - count;
+
+    if(value < 0)
+        ok = ok && pbuf_putc(buffer, '-');
+    if(exponent < -5 || exponent > 15) {
+        ok = ok && pbuf_putc(buffer, first[0]);
+        if(count > 1)
+            ok = ok && pbuf_putc(buffer, '.') && pbuf_write(buffer, first + 1, count - 1);
+        ok = ok && pbuf_putc(buffer, 'e') && pbuf_put_integer(buffer, exponent);
+    }
+    else if(exponent < 0) {
+        ok = ok && pbuf_write(buffer, "0.", 2);
+        for(int i = exponent + 1; i < 0; i++)
+            ok = ok && pbuf_putc(buffer, '0');
+        ok = ok && pbuf_write(buffer, first, count);
+    }
+    else if(exponent + 1 >= count) {
+        ok = ok && pbuf_write(buffer, first, count);
+        for(int i = count; i <= exponent; i++)
+            ok = ok && pbuf_putc(buffer, '0');
+    }
+    else {
+        ok = ok && pbuf_write(buffer, first, exponent + 1);
+        ok = ok && pbuf_putc(buffer, '.') && pbuf_write(buffer, first + exponent + 1, count - exponent - 1);
+    }
+    return ok;
+}
@@ -5,6 +5,11 @@
 #define pbuf_h
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PBUF_FLOAT_SHORTEST		-1		// decimals of pbuf_put_float for the fewest digits that read back as the same float
+#define PBUF_FLOAT_DECIMALS_MAX	9
 
 typedef struct {
   char *data;
@@ -14,5 +19,12 @@ typedef struct {
 
 bool pbuf_printf(pbuf_t *buffer, const char *format, ...);
 bool pbuf_putc(pbuf_t *buffer, char c);
+bool pbuf_write(pbuf_t *buffer, const char *data, size_t length);
+bool pbuf_puts(pbuf_t *buffer, const char *string);
+bool pbuf_put_unsigned(pbuf_t *buffer, uint64_t value);
+bool pbuf_put_integer(pbuf_t *buffer, int64_t value);
+bool pbuf_put_hex(pbuf_t *buffer, uint64_t value, uint8_t digits);
+bool pbuf_put_fixed(pbuf_t *buffer, int64_t value, uint8_t decimals);
+bool pbuf_put_float(pbuf_t *buffer, float value, int8_t decimals);
 
 #endif
\ No newline at end of file
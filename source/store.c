@@ -0,0 +1,342 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <string.h>
+
+#include <esp_log.h>
+
+#include "store.h"
+
+// Append-only log of measurements over a ring of flash sectors. Each sector starts with a
+// header carrying its own sequence and the sequence of its first record, so the head can be
+// found after a reset by scanning the headers. Sectors are written in turn, erasing the oldest
+// one when the log wraps, which spreads the wear over the partition.
+//
+// Inside a sector, each series is defined once and its samples are Gorilla compressed against
+// the previous sample of the same series, so a regular measurement takes two or three bytes
+// instead of a 32 byte frame. Sectors decode on their own, the compression restarts in each.
+//
+// The flash and the cursors are reached through store_flash_t only, store_partition.c provides them
+// on the device and test/test_store.c over a file.
+
+store_t store = { 0 };
+
+static const store_flash_t *store_flash = NULL;
+static uint32_t store_sectors_count = 0;
+static uint32_t store_head_sector = 0;
+static uint32_t store_head_sequence = 0;
+static store_position_t store_writer;
+static store_position_t store_reader;
+static uint8_t store_sector_buffer[STORE_SECTOR_SIZE];
+
+static bool store_read_header(uint32_t sector, store_sector_header_t *header)
+{
+    return store_flash->read(sector * STORE_SECTOR_SIZE, header, sizeof(store_sector_header_t)) && header->magic == STORE_MAGIC;
+}
+
+static void store_rewind(store_position_t *position, uint32_t sector, store_sequence_t first_record)
+{
+    position->sector = sector;
+    position->offset = sizeof(store_sector_header_t);
+    position->sequence = first_record;
+    position->series_count = 0;
+}
+
+static bool store_start_sector(uint32_t sector, uint32_t sequence, store_sequence_t first_record)
+{
+    store_sector_header_t header = {
+        .magic = STORE_MAGIC,
+        .sequence = sequence,
+        .first_record = first_record,
+        .reserved = 0xFFFFFFFF,
+    };
+    return store_flash->erase(sector * STORE_SECTOR_SIZE, STORE_SECTOR_SIZE) &&
+           store_flash->write(sector * STORE_SECTOR_SIZE, &header, sizeof(header));
+}
+
+// Reads a whole sector into the buffer and places the position before its first entry.
+
+static bool store_load_sector(store_position_t *position, uint32_t sector)
+{
+    store_sector_header_t *header = (store_sector_header_t *) store_sector_buffer;
+
+    if(!store_flash->read(sector * STORE_SECTOR_SIZE, store_sector_buffer, STORE_SECTOR_SIZE) || header->magic != STORE_MAGIC)
+        return false;
+    store_rewind(position, sector, header->first_record);
+    return true;
+}
+
+// Decodes the entry at the position from the sector buffer. Returns 1 for a sample, 0 for a
+// series definition and -1 at the end of the entries or if they are not valid.
+
+static int8_t store_decode_entry(store_position_t *position, measurement_frame_t *frame)
+{
+    uint8_t *entry = store_sector_buffer + position->offset;
+
+    if(position->offset >= STORE_SECTOR_SIZE || entry[0] == STORE_ENTRY_FREE)
+        return -1;
+    if(entry[0] == STORE_ENTRY_SERIES) {
+        if(position->offset + STORE_SERIES_ENTRY_SIZE > STORE_SECTOR_SIZE || position->series_count == STORE_SECTOR_SERIES_NUM_MAX)
+            return -1;
+        store_series_t *series = &(position->series[position->series_count++]);
+        memcpy(&(series->node), entry + 1, sizeof(uint64_t));
+        memcpy(&(series->descriptor), entry + 1 + sizeof(uint64_t), sizeof(uint64_t));
+        memcpy(&(series->address), entry + 1 + 2 * sizeof(uint64_t), sizeof(uint64_t));
+        gorilla_init(&(series->state));
+        position->offset += STORE_SERIES_ENTRY_SIZE;
+        return 0;
+    }
+    if(entry[0] >= position->series_count)
+        return -1;
+
+    store_series_t *series = &(position->series[entry[0]]);
+    gorilla_bits_t bits = { entry + 1, STORE_SECTOR_SIZE - position->offset - 1, 0 };
+    uint32_t timestamp;
+    float value;
+    if(!gorilla_decode(&bits, &(series->state), &timestamp, &value))
+        return -1;
+    frame->timestamp = timestamp;
+    frame->value = value;
+    frame->node = series->node;
+    frame->descriptor = series->descriptor;
+    frame->address = series->address;
+    position->offset += 1 + (bits.position + 7) / 8;
+    position->sequence++;
+    return 1;
+}
+
+// Moves the writer to the next sector, erasing it. If the log was full, that sector held the
+// oldest records and the tail moves to the sector after it.
+
+static bool store_next_sector()
+{
+    store_sector_header_t header;
+    uint32_t sector = (store_head_sector + 1) % store_sectors_count;
+
+    if(!store_start_sector(sector, store_head_sequence + 1, store.head))
+        return false;
+    store_head_sector = sector;
+    store_head_sequence++;
+    store_rewind(&store_writer, sector, store.head);
+
+    sector = (sector + 1) % store_sectors_count;
+    if(store_read_header(sector, &header) && header.sequence == store_head_sequence - (store_sectors_count - 1)) {
+        store.tail = header.first_record;
+        for(uint8_t i = 0; i < BACKENDS_NUM_MAX; i++)
+            if(store.backends & 1 << i && (int32_t)(store.cursors[i] - store.tail) < 0)
+                ESP_LOGW(__func__, "records not delivered to backend %u overwritten", i);
+    }
+    return true;
+}
+
+// Finds the head sector as the one with the highest sequence and decodes it to restore the
+// compression state, then walks back over the consecutive sectors to find the tail.
+
+bool store_init(const store_flash_t *flash)
+{
+    store_sector_header_t header;
+    store_sector_header_t head_header = { 0 };
+    measurement_frame_t frame;
+    bool found = false;
+
+    memset(&store, 0, sizeof(store));
+    if(!flash)
+        return false;
+    store_flash = flash;
+    store_sectors_count = flash->size / STORE_SECTOR_SIZE;
+    store_sectors_count = store_sectors_count > STORE_SECTORS_NUM_MAX ? STORE_SECTORS_NUM_MAX : store_sectors_count;
+    if(store_sectors_count < 2)
+        return false;
+
+    for(uint32_t sector = 0; sector < store_sectors_count; sector++) {
+        if(store_read_header(sector, &header) && (!found || (int32_t)(header.sequence - head_header.sequence) > 0)) {
+            head_header = header;
+            store_head_sector = sector;
+            found = true;
+        }
+    }
+    if(!found) {
+        store_head_sector = 0;
+        head_header.sequence = 1;
+        head_header.first_record = 0;
+        if(!store_start_sector(store_head_sector, head_header.sequence, head_header.first_record))
+            return false;
+    }
+    store_head_sequence = head_header.sequence;
+
+    if(!store_load_sector(&store_writer, store_head_sector))
+        return false;
+    while(store_decode_entry(&store_writer, &frame) >= 0);
+    if(store_writer.offset < STORE_SECTOR_SIZE && store_sector_buffer[store_writer.offset] != STORE_ENTRY_FREE)
+        store_writer.offset = STORE_SECTOR_SIZE;     // not valid entries, keep them and start a new sector on the next append
+    store.head = store_writer.sequence;
+
+    store.tail = head_header.first_record;
+    for(uint32_t back = 1; back < store_sectors_count; back++) {
+        uint32_t sector = (store_head_sector + store_sectors_count - back) % store_sectors_count;
+        if(!store_read_header(sector, &header) || header.sequence != head_header.sequence - back)
+            break;
+        store.tail = header.first_record;
+    }
+
+    for(uint8_t i = 0; i < BACKENDS_NUM_MAX; i++)
+        store.cursors[i] = store.tail;
+    store_flash->read_cursors(store.cursors, BACKENDS_NUM_MAX);
+    store.ready = true;
+    ESP_LOGI(__func__, "head = %lu, tail = %lu, sectors = %lu", store.head, store.tail, store_sectors_count);
+    return true;
+}
+
+bool store_append(measurement_frame_t *frame)
+{
+    uint8_t entry[STORE_ENTRY_SIZE_MAX];
+    size_t length;
+    uint8_t index;
+    gorilla_series_t state;
+
+    if(!store.ready)
+        return false;
+
+    for(uint8_t attempt = 0; attempt < 2; attempt++) {
+        if(attempt && !store_next_sector())
+            return false;
+
+        memset(entry, 0, sizeof(entry));
+        length = 0;
+        for(index = 0; index < store_writer.series_count; index++)
+            if(store_writer.series[index].node == frame->node && store_writer.series[index].descriptor == frame->descriptor &&
+               store_writer.series[index].address == frame->address)
+                break;
+        if(index == store_writer.series_count) {
+            if(index == STORE_SECTOR_SERIES_NUM_MAX)
+                continue;
+            entry[length] = STORE_ENTRY_SERIES;
+            memcpy(entry + length + 1, &(frame->node), sizeof(uint64_t));
+            memcpy(entry + length + 1 + sizeof(uint64_t), &(frame->descriptor), sizeof(uint64_t));
+            memcpy(entry + length + 1 + 2 * sizeof(uint64_t), &(frame->address), sizeof(uint64_t));
+            length += STORE_SERIES_ENTRY_SIZE;
+            gorilla_init(&state);
+        }
+        else
+            state = store_writer.series[index].state;
+
+        gorilla_bits_t bits = { entry + length + 1, GORILLA_SAMPLE_SIZE_MAX, 0 };
+        entry[length] = index;
+        if(!gorilla_encode(&bits, &state, frame->timestamp, frame->value))
+            return false;
+        length += 1 + (bits.position + 7) / 8;
+
+        if(store_writer.offset + length > STORE_SECTOR_SIZE)
+            continue;
+        if(!store_flash->write(store_writer.sector * STORE_SECTOR_SIZE + store_writer.offset, entry, length))
+            return false;
+        if(index == store_writer.series_count) {
+            store_writer.series[index].node = frame->node;
+            store_writer.series[index].descriptor = frame->descriptor;
+            store_writer.series[index].address = frame->address;
+            store_writer.series_count++;
+        }
+        store_writer.series[index].state = state;
+        store_writer.offset += length;
+        store_writer.sequence++;
+        store.head++;
+        return true;
+    }
+    return false;
+}
+
+// Places the reader before a record, decoding its sector from the start.
+
+bool store_seek(store_sequence_t sequence)
+{
+    store_sector_header_t header;
+    measurement_frame_t frame;
+
+    if(!store.ready || (int32_t)(sequence - store.tail) < 0 || (int32_t)(sequence - store.head) >= 0)
+        return false;
+
+    for(uint32_t back = 0; back < store_sectors_count; back++) {
+        uint32_t sector = (store_head_sector + store_sectors_count - back) % store_sectors_count;
+        if(!store_read_header(sector, &header))
+            return false;
+        if((int32_t)(sequence - header.first_record) >= 0) {
+            if(!store_load_sector(&store_reader, sector))
+                return false;
+            while(store_reader.sequence != sequence)
+                if(store_decode_entry(&store_reader, &frame) < 0)
+                    return false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes the record after the reader, moving on to the next sector at the end of one.
+
+bool store_read_next(measurement_frame_t *frame)
+{
+    int8_t result;
+    store_sequence_t sequence;
+
+    while(true) {
+        result = store_decode_entry(&store_reader, frame);
+        if(result > 0)
+            return true;
+        if(result < 0) {
+            if(store_reader.sector == store_head_sector)
+                return false;
+            sequence = store_reader.sequence;
+            if(!store_load_sector(&store_reader, (store_reader.sector + 1) % store_sectors_count) || store_reader.sequence != sequence)
+                return false;
+        }
+    }
+}
+
+bool store_read(store_sequence_t sequence, measurement_frame_t *frame)
+{
+    return store_seek(sequence) && store_read_next(frame);
+}
+
+uint32_t store_pending(uint8_t backend)
+{
+    if(!store.ready)
+        return 0;
+    if((int32_t)(store.cursors[backend] - store.tail) < 0)
+        store.cursors[backend] = store.tail;     // records not delivered in time were overwritten
+    if((int32_t)(store.cursors[backend] - store.head) > 0)
+        store.cursors[backend] = store.head;
+    return store.head - store.cursors[backend];
+}
+
+// Percentage of the log taken by the records not yet delivered to the slowest backend, counted
+// in sectors as they hold a varying number of records. The sector erased on wrap is not usable.
+
+uint8_t store_usage()
+{
+    store_sector_header_t header;
+    uint32_t sectors = 0;
+
+    if(!store.ready)
+        return 0;
+    for(uint8_t i = 0; i < BACKENDS_NUM_MAX; i++) {
+        if(!(store.backends & 1 << i) || !store_pending(i))
+            continue;
+        for(uint32_t back = 0; back < store_sectors_count; back++) {
+            uint32_t sector = (store_head_sector + store_sectors_count - back) % store_sectors_count;
+            if(!store_read_header(sector, &header) || (int32_t)(store.cursors[i] - header.first_record) >= 0) {
+                sectors = back + 1 > sectors ? back + 1 : sectors;
+                break;
+            }
+        }
+    }
+    sectors = sectors < store_sectors_count - 1 ? sectors : store_sectors_count - 1;
+    return sectors * 100 / (store_sectors_count - 1);
+}
+
+// Moves the cursor of a backend past the records it confirmed.
+
+bool store_advance(uint8_t backend, uint32_t count)
+{
+    store.cursors[backend] += count;
+    return store_flash->write_cursors(store.cursors, BACKENDS_NUM_MAX);
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef store_h
+#define store_h
+
+#define STORE_PARTITION_LABEL		"queue"
+#define STORE_SECTOR_SIZE			4096
+#define STORE_SECTORS_NUM_MAX		256
+#define STORE_SECTOR_SERIES_NUM_MAX	64			// series defined in a sector before moving to the next one
+#define STORE_MAGIC					0x53574731	// "SWG1"
+#define STORE_ENTRY_FREE			0xFF		// erased flash, the end of the entries in a sector
+#define STORE_ENTRY_SERIES			0xFE		// series definition, other values are series indexes
+#define STORE_SERIES_ENTRY_SIZE		(1 + 3 * sizeof(uint64_t))
+#define STORE_ENTRY_SIZE_MAX		(STORE_SERIES_ENTRY_SIZE + 1 + GORILLA_SAMPLE_SIZE_MAX)
+#define STORE_BATCH_NUM_MAX			MEASUREMENTS_NUM_MAX	// records per upload when streamed, as many as a batch holds
+#define STORE_PACKED_BATCH_NUM_MAX	48			// records per upload encoded whole, to fit the backend buffer as SenML
+#define STORE_BATCHES_NUM_MAX		16			// batches per backend and upload
+
+#include "backends.h"
+#include "gorilla.h"
+#include "measurements.h"
+
+typedef uint32_t store_sequence_t;
+
+typedef struct {
+	uint32_t			magic;
+	uint32_t			sequence;		// of the sector, increasing by one each time the log moves to the next one
+	store_sequence_t	first_record;	// sequence of the first record in the sector
+	uint32_t			reserved;
+} store_sector_header_t;
+
+typedef struct {		// series defined in a sector, with the compression state of its samples
+	uint64_t			node;
+	uint64_t			descriptor;
+	uint64_t			address;
+	gorilla_series_t	state;
+} store_series_t;
+
+typedef struct {		// position in a sector while appending or decoding its entries
+	uint32_t			sector;
+	uint32_t			offset;
+	store_sequence_t	sequence;		// of the next sample
+	uint8_t				series_count;
+	store_series_t		series[STORE_SECTOR_SERIES_NUM_MAX];
+} store_position_t;
+
+typedef struct {		// flash and cursors access, so that the log can run over a file on a host
+	bool		(*read)(uint32_t offset, void *data, size_t size);
+	bool		(*write)(uint32_t offset, const void *data, size_t size);
+	bool		(*erase)(uint32_t offset, size_t size);
+	bool		(*read_cursors)(store_sequence_t *cursors, uint8_t count);	// leaves the ones not saved as they are
+	bool		(*write_cursors)(const store_sequence_t *cursors, uint8_t count);
+	uint32_t	size;
+} store_flash_t;
+
+typedef struct {
+	store_sequence_t	head;			// sequence of the next record to append
+	store_sequence_t	tail;			// sequence of the oldest record kept
+	store_sequence_t	cursors[BACKENDS_NUM_MAX];	// next record to deliver to each backend
+	uint8_t				backends;		// mask of the backends in use, whose cursors hold records back
+	bool				ready;
+} store_t;
+
+extern store_t store;
+
+bool store_init(const store_flash_t *flash);
+bool store_append(measurement_frame_t *frame);
+bool store_seek(store_sequence_t sequence);
+bool store_read_next(measurement_frame_t *frame);
+bool store_read(store_sequence_t sequence, measurement_frame_t *frame);
+uint32_t store_pending(uint8_t backend);
+uint8_t store_usage();
+bool store_advance(uint8_t backend, uint32_t count);
+
+const store_flash_t *store_partition_flash();
+
+#endif
@@ -0,0 +1,98 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <nvs_flash.h>
+
+#include "store.h"
+
+// The store on the device: the log goes in the "queue" data partition and the cursors in the
+// "store" NVS namespace, one key per backend.
+
+static const esp_partition_t *store_partition = NULL;
+
+static bool store_partition_read(uint32_t offset, void *data, size_t size)
+{
+    return !esp_partition_read(store_partition, offset, data, size);
+}
+
+static bool store_partition_write(uint32_t offset, const void *data, size_t size)
+{
+    return !esp_partition_write(store_partition, offset, data, size);
+}
+
+static bool store_partition_erase(uint32_t offset, size_t size)
+{
+    return !esp_partition_erase_range(store_partition, offset, size);
+}
+
+static bool store_partition_read_cursors(store_sequence_t *cursors, uint8_t count)
+{
+    esp_err_t err;
+    nvs_handle_t handle;
+    char nvs_key[16];
+
+    err = nvs_open("store", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        for(uint8_t i = 0; i < count; i++) {
+            snprintf(nvs_key, sizeof(nvs_key), "%u_cursor", i % 255);
+            nvs_get_u32(handle, nvs_key, &(cursors[i]));
+        }
+        nvs_close(handle);
+        return true;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+static bool store_partition_write_cursors(const store_sequence_t *cursors, uint8_t count)
+{
+    esp_err_t err;
+    bool ok = true;
+    nvs_handle_t handle;
+    char nvs_key[16];
+
+    err = nvs_open("store", NVS_READWRITE, &handle);
+    if(err == ESP_OK) {
+        for(uint8_t i = 0; i < count && ok; i++) {
+            snprintf(nvs_key, sizeof(nvs_key), "%u_cursor", i % 255);
+            ok = ok && !nvs_set_u32(handle, nvs_key, cursors[i]);
+        }
+        ok = ok && !nvs_commit(handle);
+        nvs_close(handle);
+        ESP_LOGI(__func__, "%s", ok ? "done" : "failed");
+        return ok;
+    }
+    else {
+        ESP_LOGI(__func__, "nvs_open failed");
+        return false;
+    }
+}
+
+static store_flash_t store_partition_flash_access = {
+    .read = store_partition_read,
+    .write = store_partition_write,
+    .erase = store_partition_erase,
+    .read_cursors = store_partition_read_cursors,
+    .write_cursors = store_partition_write_cursors,
+};
+
+// Returns the access to the partition for store_init, or NULL if the partition table has none.
+
+const store_flash_t *store_partition_flash()
+{
+    if(!store_partition) {
+        store_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, STORE_PARTITION_LABEL);
+        if(!store_partition) {
+            ESP_LOGE(__func__, "partition not found");
+            return NULL;
+        }
+        store_partition_flash_access.size = store_partition->size;
+    }
+    return &store_partition_flash_access;
+}
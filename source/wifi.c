@@ -48,10 +48,6 @@ void wifi_init()
         if((wifi.mac & 0xFFFF) == 0)
             wifi.mac = (wifi.mac & 0xFFFFFF0000000000) | 0x000000FFFF000000 | ((wifi.mac & 0x000000FFFFFF0000) >> 16);
     }
-    if(wifi.ssid[0]) {
-        err = err ? err : esp_wifi_start();
-        err = err ? err : (wifi_connect() ? ESP_OK : ESP_FAIL);
-    }
     ESP_LOGI(__func__, "%s", err ? "failed" : "done");
 }
 
@@ -315,5 +311,5 @@ void wifi_measure()
 {
     int rssi;
     if(wifi.diagnostics && wifi.status >= WIFI_STATUS_CONNECTED && esp_wifi_sta_get_rssi(&rssi) == ESP_OK)
-        measurements_append(board.id, RESOURCE_WIFI, 0, 0, 0, 0, 0, 0, METRIC_RSSI, NOW, UNIT_dBm, rssi);
+        measurements_append(board.id, RESOURCE_WIFI, 0, 0, 0, 0, 0, 0, METRIC_RSSI, NOW_MS, UNIT_dBm, rssi);
 }
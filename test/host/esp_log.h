@@ -0,0 +1,17 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Stand-in for the ESP-IDF logging macros when the modules are built on a host. Errors and warnings
+// are printed with their arguments, information and debug messages are dropped.
+
+#ifndef esp_log_h
+#define esp_log_h
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, format, ...)	fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)	fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)	do {} while(0)
+#define ESP_LOGD(tag, format, ...)	do {} while(0)
+
+#endif
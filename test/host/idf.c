@@ -0,0 +1,216 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// ESP-IDF and FreeRTOS on a host: time only moves when the code waits or moves bytes on the I2C bus,
+// tasks start together when their creator waits for them, and the non volatile storage is always empty.
+
+#include <string.h>
+
+#include "idf.h"
+
+int64_t idf_time = 0;
+uint32_t idf_i2c_speed = 100000;
+idf_i2c_device_t idf_i2c_devices[IDF_I2C_DEVICES_NUM_MAX];
+uint8_t idf_i2c_devices_count = 0;
+bool idf_tasks_reverse = false;
+bool idf_tasks_fail = false;
+
+static int8_t idf_i2c_channel[I2C_NUM_MAX] = { -1, -1 };
+static uint8_t idf_i2c_command_address;
+static EventBits_t idf_event_bits;
+
+static struct {
+    TaskFunction_t  function;
+    void            *arg;
+} idf_tasks[IDF_TASKS_NUM_MAX];
+static uint8_t idf_tasks_count = 0;
+
+int64_t esp_timer_get_time()
+{
+    return idf_time;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle) { return ESP_ERR_NOT_FOUND; }
+void nvs_close(nvs_handle_t handle) {}
+esp_err_t nvs_commit(nvs_handle_t handle) { return ESP_FAIL; }
+esp_err_t nvs_erase_all(nvs_handle_t handle) { return ESP_FAIL; }
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *value) { return ESP_ERR_NOT_FOUND; }
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *value) { return ESP_ERR_NOT_FOUND; }
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value) { return ESP_ERR_NOT_FOUND; }
+esp_err_t nvs_get_u64(nvs_handle_t handle, const char *key, uint64_t *value) { return ESP_ERR_NOT_FOUND; }
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length) { return ESP_ERR_NOT_FOUND; }
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value) { return ESP_FAIL; }
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value) { return ESP_FAIL; }
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value) { return ESP_FAIL; }
+esp_err_t nvs_set_u64(nvs_handle_t handle, const char *key, uint64_t value) { return ESP_FAIL; }
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) { return ESP_FAIL; }
+
+void vTaskDelay(TickType_t ticks)
+{
+    idf_time += (int64_t) ticks * portTICK_PERIOD_MS * 1000;
+}
+
+void vTaskDelete(TaskHandle_t task) {}     // the task function returns to idf_run_tasks() instead
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    return 1;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_size, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *task, BaseType_t core)
+{
+    if(idf_tasks_fail || idf_tasks_count >= IDF_TASKS_NUM_MAX)
+        return pdFAIL;
+    idf_tasks[idf_tasks_count].function = function;
+    idf_tasks[idf_tasks_count].arg = arg;
+    idf_tasks_count++;
+    return pdPASS;
+}
+
+// Runs the tasks created so far as if each had a core of its own: all of them from the same time, one
+// after another in creation order or the reverse, leaving the clock at the end of the slowest one.
+
+static void idf_run_tasks()
+{
+    int64_t start_time = idf_time;
+    int64_t end_time = idf_time;
+
+    for(uint8_t i = 0; i < idf_tasks_count; i++) {
+        uint8_t task = idf_tasks_reverse ? idf_tasks_count - 1 - i : i;
+        idf_time = start_time;
+        idf_tasks[task].function(idf_tasks[task].arg);
+        if(end_time < idf_time)
+            end_time = idf_time;
+    }
+    idf_tasks_count = 0;
+    idf_time = end_time;
+}
+
+EventGroupHandle_t xEventGroupCreate()
+{
+    return &idf_event_bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    return *(EventBits_t *) group |= bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+    idf_run_tasks();
+    EventBits_t set = *(EventBits_t *) group;
+
+    if(clear)
+        *(EventBits_t *) group &= ~bits;
+    return set;
+}
+
+// The simulated I2C bus //
+
+idf_i2c_device_t *idf_i2c_add(i2c_port_t port, uint8_t address, int8_t channel, uint32_t conversion_time, const uint8_t *data, size_t size)
+{
+    if(idf_i2c_devices_count >= IDF_I2C_DEVICES_NUM_MAX || size > sizeof(idf_i2c_devices[0].data))
+        return NULL;
+    idf_i2c_device_t *device = &idf_i2c_devices[idf_i2c_devices_count++];
+    *device = (idf_i2c_device_t) { .port = port, .address = address, .channel = channel, .conversion_time = conversion_time, .write_time = -1 };
+    memcpy(device->data, data, size);
+    return device;
+}
+
+void idf_i2c_reset()
+{
+    idf_i2c_devices_count = 0;
+    memset(idf_i2c_channel, -1, sizeof(idf_i2c_channel));
+}
+
+// Charges the time of a transfer: the address and the data bytes, 9 bits each with the acknowledge.
+
+static void idf_i2c_transfer(size_t size)
+{
+    idf_time += ((int64_t) (size + 1) * 9 * 1000000 + idf_i2c_speed - 1) / idf_i2c_speed;
+}
+
+static idf_i2c_device_t *idf_i2c_find(i2c_port_t port, uint8_t address)
+{
+    for(uint8_t i = 0; i < idf_i2c_devices_count; i++)
+        if(idf_i2c_devices[i].port == port && idf_i2c_devices[i].address == address &&
+           (idf_i2c_devices[i].channel < 0 || idf_i2c_devices[i].channel == idf_i2c_channel[port]))
+            return &idf_i2c_devices[i];
+    return NULL;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t port, int mode, size_t rx_size, size_t tx_size, int flags) { return ESP_OK; }
+esp_err_t i2c_driver_delete(i2c_port_t port) { return ESP_OK; }
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config)
+{
+    idf_i2c_speed = config->master.clk_speed;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_write_to_device(i2c_port_t port, uint8_t address, const uint8_t *data, size_t size, TickType_t ticks)
+{
+    idf_i2c_transfer(size);
+    if(address == 0x70 && size == 1) {         // the multiplexer, one bit per channel
+        idf_i2c_channel[port] = data[0] ? __builtin_ctz(data[0]) : -1;
+        return ESP_OK;
+    }
+    idf_i2c_device_t *device = idf_i2c_find(port, address);
+    if(!device)
+        return ESP_FAIL;
+    device->write_time = idf_time;
+    device->writes++;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_read_from_device(i2c_port_t port, uint8_t address, uint8_t *data, size_t size, TickType_t ticks)
+{
+    idf_i2c_transfer(size);
+    idf_i2c_device_t *device = idf_i2c_find(port, address);
+    if(!device || size > sizeof(device->data))
+        return ESP_FAIL;
+    if(device->write_time >= 0 && idf_time < device->write_time + device->conversion_time * 1000L) {
+        device->early_reads++;
+        return ESP_FAIL;
+    }
+    memcpy(data, device->data, size);
+    device->read_time = idf_time;
+    device->reads++;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_write_read_device(i2c_port_t port, uint8_t address, const uint8_t *write_data, size_t write_size,
+                                       uint8_t *read_data, size_t read_size, TickType_t ticks)
+{
+    idf_i2c_transfer(write_size + read_size + 1);
+    idf_i2c_device_t *device = idf_i2c_find(port, address);
+    if(!device || read_size > sizeof(device->data))
+        return ESP_FAIL;
+    memcpy(read_data, device->data, read_size);        // a register read, ready at any time
+    device->read_time = idf_time;
+    device->reads++;
+    return ESP_OK;
+}
+
+i2c_cmd_handle_t i2c_cmd_link_create()
+{
+    return &idf_i2c_command_address;
+}
+
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd) {}
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd) { return ESP_OK; }
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd) { return ESP_OK; }
+
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, bool ack)
+{
+    *(uint8_t *) cmd = data >> 1;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_cmd_begin(i2c_port_t port, i2c_cmd_handle_t cmd, TickType_t ticks)
+{
+    idf_i2c_transfer(0);
+    return idf_i2c_find(port, *(uint8_t *) cmd) ? ESP_OK : ESP_FAIL;
+}
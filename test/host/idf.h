@@ -0,0 +1,154 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Stand-in for the parts of ESP-IDF and FreeRTOS used by the measuring modules when they are built
+// on a host, included by the headers of the same names. Implemented by idf.c over a simulated clock.
+
+#ifndef idf_h
+#define idf_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+typedef int esp_err_t;
+
+#define ESP_OK					0
+#define ESP_FAIL				-1
+#define ESP_ERR_NO_MEM			0x101
+#define ESP_ERR_INVALID_ARG		0x102
+#define ESP_ERR_INVALID_STATE	0x103
+#define ESP_ERR_NOT_FOUND		0x105
+#define ESP_ERR_TIMEOUT			0x107
+
+int64_t esp_timer_get_time();
+
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle);
+void nvs_close(nvs_handle_t handle);
+esp_err_t nvs_commit(nvs_handle_t handle);
+esp_err_t nvs_erase_all(nvs_handle_t handle);
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *value);
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *value);
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value);
+esp_err_t nvs_get_u64(nvs_handle_t handle, const char *key, uint64_t *value);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length);
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value);
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value);
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value);
+esp_err_t nvs_set_u64(nvs_handle_t handle, const char *key, uint64_t value);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length);
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void *TaskHandle_t;
+typedef void *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define portTICK_PERIOD_MS		10			// the 100 Hz tick of the firmware configuration
+#define portMAX_DELAY			0xFFFFFFFF
+#define portNUM_PROCESSORS		1
+#define pdFALSE					0
+#define pdTRUE					1
+#define pdFAIL					0
+#define pdPASS					1
+
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_size, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *task, BaseType_t core);
+EventGroupHandle_t xEventGroupCreate();
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks);
+
+typedef int i2c_port_t;
+typedef void *i2c_cmd_handle_t;
+
+#define I2C_NUM_MAX				2
+#define I2C_MODE_MASTER			1
+#define I2C_MASTER_WRITE		0
+#define I2C_MASTER_READ			1
+
+typedef struct {
+	int			mode;
+	int			sda_io_num;
+	int			scl_io_num;
+	int			sda_pullup_en;
+	int			scl_pullup_en;
+	struct {
+		uint32_t	clk_speed;
+	} master;
+} i2c_config_t;
+
+esp_err_t i2c_driver_install(i2c_port_t port, int mode, size_t rx_size, size_t tx_size, int flags);
+esp_err_t i2c_driver_delete(i2c_port_t port);
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config);
+esp_err_t i2c_master_write_to_device(i2c_port_t port, uint8_t address, const uint8_t *data, size_t size, TickType_t ticks);
+esp_err_t i2c_master_read_from_device(i2c_port_t port, uint8_t address, uint8_t *data, size_t size, TickType_t ticks);
+esp_err_t i2c_master_write_read_device(i2c_port_t port, uint8_t address, const uint8_t *write_data, size_t write_size,
+                                       uint8_t *read_data, size_t read_size, TickType_t ticks);
+i2c_cmd_handle_t i2c_cmd_link_create();
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, bool ack);
+esp_err_t i2c_master_cmd_begin(i2c_port_t port, i2c_cmd_handle_t cmd, TickType_t ticks);
+
+#define GPIO_NUM_MAX			49
+#define GPIO_PULLUP_ENABLE		1
+
+#define CHIP_ESP32				1
+#define CHIP_ESP32S3			9
+#define CHIP_ESP32C3			5
+#define CHIP_ESP32C6			13
+
+typedef void *onewire_bus_handle_t;
+typedef struct esp_netif_obj esp_netif_t;
+typedef const char *esp_event_base_t;
+
+// The simulated clock, tasks and bus. Tasks created with xTaskCreatePinnedToCore() run when an event
+// group is waited on, in reverse order if idf_tasks_reverse is set, so that a test can check that
+// their results do not depend on which one finishes first. None can be created if idf_tasks_fail is
+// set. Devices answer at their address on a port,
+// behind a channel of the multiplexer at 0x70 or with none selected if channel is negative. A read
+// before the conversion started by the last write has had conversion_time is not acknowledged, as
+// Sensirion parts do.
+
+#define IDF_TASKS_NUM_MAX		8
+#define IDF_I2C_DEVICES_NUM_MAX	16
+
+typedef struct {
+	i2c_port_t	port;
+	uint8_t		address;
+	int8_t		channel;			// multiplexer channel, -1 if on the bus itself
+	uint32_t	conversion_time;	// milliseconds from a write to valid data
+	uint8_t		data[8];			// answer to reads
+	int64_t		write_time;			// microseconds of the last write, -1 if never written
+	int64_t		read_time;			// microseconds of the last acknowledged read
+	uint16_t	writes;
+	uint16_t	reads;
+	uint16_t	early_reads;		// reads refused before the conversion was done
+} idf_i2c_device_t;
+
+extern int64_t idf_time;			// microseconds of the simulated clock
+extern bool idf_tasks_reverse;
+extern bool idf_tasks_fail;
+extern uint32_t idf_i2c_speed;		// bits per second, to charge the time of each transfer
+extern idf_i2c_device_t idf_i2c_devices[];
+extern uint8_t idf_i2c_devices_count;
+
+idf_i2c_device_t *idf_i2c_add(i2c_port_t port, uint8_t address, int8_t channel, uint32_t conversion_time, const uint8_t *data, size_t size);
+void idf_i2c_reset();
+
+#endif
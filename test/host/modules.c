@@ -0,0 +1,29 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Stand-ins for the firmware modules that the host tests do not link: the board and the application
+// as zeroed configurations, and no 1-Wire buses nor ADC channels to measure.
+
+#include "adc.h"
+#include "application.h"
+#include "board.h"
+#include "onewire.h"
+
+application_t application;
+board_t board;
+onewire_bus_t onewire_buses[ONEWIRE_BUSES_NUM_MAX];
+uint8_t onewire_buses_count = 0;
+
+bool adc_measure() { return true; }
+void application_measure() {}
+void board_measure() {}
+void board_set_I2C_power(bool state) {}
+
+void onewire_init() {}
+bool onewire_using_gpio(uint8_t gpio) { return false; }
+esp_err_t onewire_start() { return ESP_OK; }
+esp_err_t onewire_stop() { return ESP_OK; }
+void onewire_detect_devices() {}
+bool onewire_configure_device(devices_index_t device) { return false; }
+bool onewire_trigger_bus(device_bus_t bus, uint32_t *conversion_time) { return false; }
+bool onewire_collect_device(devices_index_t device) { return false; }
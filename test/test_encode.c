@@ -0,0 +1,165 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Encodes a full batch of 64 measurements of 32 devices in every backend format and times it, then
+// times compiled templates against the interpreter that looked for '@' in the row for every measurement,
+// checking that both encode the same.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "idf.h"
+
+#include "application.h"
+#include "board.h"
+#include "enums.h"
+#include "measurements.h"
+
+#define CHECK(condition)    do { if(!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while(0)
+
+#define BATCH_NUM       64
+#define BUFFER_SIZE     16384
+#define ROUNDS          2000
+
+static char encoded[BUFFER_SIZE];
+static char interpreted[BUFFER_SIZE];
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Two parameters of 32 devices spread over two buses and the channels of a multiplexer, measured at once.
+
+static void fill_batch()
+{
+    static const device_part_t parts_used[] = { PART_SHT3X, PART_SHT4X, PART_HTU21D, PART_HTU31D };
+
+    measurements_init();
+    for(uint32_t n = 0; n < BATCH_NUM; n++) {
+        uint32_t device = n / 2;
+        CHECK(measurements_append(0x0000AABBCCDDEEFF, RESOURCE_I2C, device % 2, device / 2 % 3, device / 6 % 8, 0x40 + device % 8,
+                                  parts_used[device % 4], n % 2, n % 2 ? METRIC_Humidity : METRIC_Temperature,
+                                  1700000000000LL + device * 25, n % 2 ? UNIT_RH : UNIT_Cel, 20 + n * 0.25f));
+    }
+    CHECK(measurements_count == BATCH_NUM);
+}
+
+static double encode(backend_format_t format, measurement_template_t *template, char *buffer, size_t *size)
+{
+    measurements_encoder_t encoder;
+    double start = seconds();
+
+    for(uint32_t round = 0; round < ROUNDS; round++) {
+        *size = BUFFER_SIZE;
+        measurements_encoder_init(&encoder, format, template);
+        CHECK(measurements_encode(&encoder, buffer, size) && encoder.stage == MEASUREMENTS_ENCODER_DONE);
+    }
+    return (seconds() - start) / ROUNDS * 1e6;
+}
+
+static void benchmark(const char *name, backend_format_t format, measurement_template_t *template)
+{
+    size_t size;
+    double time = encode(format, template, encoded, &size);
+
+    printf("%-10s %5lu bytes: %6.1f us\n", name, (unsigned long) size, time);
+}
+
+// The rendering of template rows before they were compiled, with the fields written as they are now.
+
+static bool interpret_row(measurements_index_t index, pbuf_t *buf, char *template_row, char *template_path_separator)
+{
+    bool ok = true;
+    measurement_series_t *series = &measurements_series[measurements[index].series];
+    int64_t timestamp = measurements[index].timestamp * 1000LL + measurements[index].milliseconds;
+    int template_row_length = strlen(template_row);
+
+    for(int j = 0; j < template_row_length && ok; j++) {
+        if(template_row[j] == '@' && j != template_row_length - 1) {
+            switch(template_row[j + 1]) {
+                case '@': ok = ok && pbuf_putc(buf, '@'); break;
+                case 'n': ok = ok && pbuf_put_hex(buf, board.id, 16); break;
+                case 'p': ok = ok && measurements_build_path(buf, index, template_path_separator[0]); break;
+                case 'r': ok = ok && pbuf_puts(buf, resource_labels[series->resource]); break;
+                case 'b': ok = ok && pbuf_put_unsigned(buf, series->bus); break;
+                case 'x': ok = ok && pbuf_put_unsigned(buf, series->multiplexer); break;
+                case 'c': ok = ok && pbuf_put_unsigned(buf, series->channel); break;
+                case 'a': ok = ok && pbuf_put_hex(buf, series->address, 16); break;
+                case 'd': ok = ok && pbuf_puts(buf, parts[series->part].label); break;
+                case 'e': ok = ok && pbuf_put_unsigned(buf, series->parameter); break;
+                case 'm': ok = ok && pbuf_puts(buf, metric_labels[series->metric]); break;
+                case 'u': ok = ok && pbuf_puts(buf, unit_labels[series->unit]); break;
+                case 'v': ok = ok && pbuf_put_float(buf, measurements[index].value, application.precisions[series->metric]); break;
+                case 't': ok = ok && pbuf_put_integer(buf, timestamp / 1000); break;
+                case 'T': ok = ok && pbuf_put_integer(buf, timestamp); break;
+                case '_': ok = ok && pbuf_putc(buf, '\n'); break;
+                default:  ok = ok && pbuf_printf(buf, "@%c", template_row[j + 1]);
+            }
+            j += 1;
+        }
+        else
+            ok = ok && pbuf_putc(buf, template_row[j]);
+    }
+    return ok;
+}
+
+static double interpret(char *header, char *row, char *row_separator, char *path_separator, char *footer, char *buffer, size_t *size)
+{
+    double start = seconds();
+
+    for(uint32_t round = 0; round < ROUNDS; round++) {
+        pbuf_t buf = { buffer, BUFFER_SIZE, 0 };
+        bool ok = pbuf_printf(&buf, "%s", header);
+        for(measurements_index_t index = 0; index < measurements_count && ok; index++)
+            ok = (!index || pbuf_printf(&buf, "%s", row_separator)) && interpret_row(index, &buf, row, path_separator);
+        CHECK(ok && pbuf_printf(&buf, "%s", footer));
+        *size = buf.length;
+    }
+    return (seconds() - start) / ROUNDS * 1e6;
+}
+
+static void benchmark_template(const char *name, char *header, char *row, char *row_separator, char *path_separator, char *footer)
+{
+    measurement_template_t template;
+    size_t compiled_size, interpreted_size;
+    double compiled_time, interpreted_time;
+
+    CHECK(measurements_compile_template(&template, header, row, row_separator, path_separator, footer));
+    interpreted_time = interpret(header, row, row_separator, path_separator, footer, interpreted, &interpreted_size);
+    compiled_time = encode(BACKEND_FORMAT_TEMPLATE, &template, encoded, &compiled_size);
+    CHECK(compiled_size == interpreted_size && !memcmp(encoded, interpreted, compiled_size));
+    printf("%-10s %5lu bytes: interpreted %6.1f us, compiled %6.1f us, %4.2fx\n", name, (unsigned long) compiled_size,
+           interpreted_time, compiled_time, interpreted_time / compiled_time);
+}
+
+int main()
+{
+    measurement_template_t template;
+
+    for(measurement_metric_t metric = 0; metric < METRIC_NUM_MAX; metric++)
+        application.precisions[metric] = 2;
+    fill_batch();
+    benchmark("senml", BACKEND_FORMAT_SENML, NULL);
+    benchmark("senml cbor", BACKEND_FORMAT_SENML_CBOR, NULL);
+    CHECK(measurements_compile_template(&template, "", "@p @v @T", "\n", "/", ""));
+    benchmark("template", BACKEND_FORMAT_TEMPLATE, &template);
+
+    benchmark_template("path", "", "@p @v @T", "\n", "/", "");
+    benchmark_template("influxdb", "", "@m,node=@n,part=@d,address=@a,bus=@b,channel=@c value=@v @T", "\n", "_", "");
+    benchmark_template("json", "[", "{\"name\":\"@p\",\"unit\":\"@u\",\"value\":@v,\"time\":@t}", ",", "/", "]");
+
+    char row[UINT8_MAX + 2];                     // offsets in the row would not fit their byte
+    memset(row, 'x', sizeof(row) - 1);
+    row[sizeof(row) - 1] = '\0';
+    CHECK(!measurements_compile_template(&template, "", row, "\n", "/", ""));
+    row[UINT8_MAX] = '\0';
+    CHECK(measurements_compile_template(&template, "", row, "\n", "/", ""));
+    printf("encode: ok\n");
+    return 0;
+}
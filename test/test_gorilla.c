@@ -0,0 +1,138 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Round trip of the Gorilla codec over series of different shapes, checking that every timestamp
+// and every float bit comes back, then the size against 32 byte frames and the codec throughput.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gorilla.h"
+
+#define CHECK(condition)    do { if(!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while(0)
+
+#define SAMPLES_NUM_MAX     100000
+#define FRAME_SIZE          32          // bytes of a measurement_frame_t
+
+static uint32_t timestamps[SAMPLES_NUM_MAX];
+static float values[SAMPLES_NUM_MAX];
+static uint8_t data[SAMPLES_NUM_MAX * GORILLA_SAMPLE_SIZE_MAX];
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static size_t encode(uint32_t count)
+{
+    gorilla_bits_t bits = { data, sizeof(data), 0 };
+    gorilla_series_t series;
+
+    gorilla_init(&series);
+    for(uint32_t n = 0; n < count; n++)
+        CHECK(gorilla_encode(&bits, &series, timestamps[n], values[n]));
+    return (bits.position + 7) / 8;
+}
+
+static void decode_and_compare(uint32_t count, size_t size)
+{
+    gorilla_bits_t bits = { data, size, 0 };
+    gorilla_series_t series;
+    uint32_t timestamp;
+    float value;
+
+    gorilla_init(&series);
+    for(uint32_t n = 0; n < count; n++) {
+        CHECK(gorilla_decode(&bits, &series, &timestamp, &value));
+        CHECK(timestamp == timestamps[n]);
+        CHECK(!memcmp(&value, &values[n], sizeof(float)));
+    }
+}
+
+static void round_trip(const char *name, uint32_t count)
+{
+    size_t size = encode(count);
+
+    decode_and_compare(count, size);
+    printf("%-12s %6lu samples in %7lu bytes, %5.2f bytes each, %4.1fx smaller than frames\n", name, (unsigned long) count,
+           (unsigned long) size, (double) size / count, (double) count * FRAME_SIZE / size);
+}
+
+static void test_shapes()
+{
+    uint32_t count = 10000;
+    float specials[] = { 0.0f, -0.0f, INFINITY, -INFINITY, NAN, 1e-45f, 3.4e38f, -1.5f };
+
+    srand(1);
+    for(uint32_t n = 0; n < count; n++) {       // every minute, a temperature with 0.01 steps
+        timestamps[n] = 1700000000 + n * 60;
+        values[n] = roundf((21 + 3 * sinf(n / 100.0f)) * 100) / 100;
+    }
+    round_trip("regular", count);
+
+    for(uint32_t n = 0; n < count; n++) {       // a few seconds of jitter and a day long gap halfway
+        timestamps[n] = 1700000000 + n * 60 + rand() % 5 + (n > count / 2 ? 86400 : 0);
+        values[n] = n % 7 ? values[n - n % 7] : rand() % 1000;
+    }
+    round_trip("jittered", count);
+
+    for(uint32_t n = 0; n < count; n++) {       // any bits, and timestamps going backwards
+        timestamps[n] = n % 3 ? rand() : 0xFFFFFFFF - rand();
+        uint32_t value_bits = (uint32_t) rand() << 16 ^ rand();
+        memcpy(&values[n], &value_bits, sizeof(float));
+        if(n % 10 == 0)
+            values[n] = specials[n / 10 % (sizeof(specials) / sizeof(specials[0]))];
+    }
+    round_trip("random", count);
+
+    timestamps[0] = 0;
+    values[0] = NAN;
+    round_trip("single", 1);
+}
+
+static void test_truncated()
+{
+    gorilla_bits_t bits = { data, 5, 0 };
+    gorilla_series_t series;
+
+    gorilla_init(&series);
+    CHECK(!gorilla_encode(&bits, &series, 1700000000, 1.0f));  // the first sample takes 8 bytes
+}
+
+static void benchmark()
+{
+    uint32_t count = SAMPLES_NUM_MAX;
+    uint32_t rounds = 20;
+    size_t size = 0;
+    double start, encoding, decoding;
+
+    for(uint32_t n = 0; n < count; n++) {
+        timestamps[n] = 1700000000 + n * 60;
+        values[n] = roundf((21 + 3 * sinf(n / 100.0f)) * 100) / 100;
+    }
+    start = seconds();
+    for(uint32_t round = 0; round < rounds; round++)
+        size = encode(count);
+    encoding = (seconds() - start) / rounds;
+    start = seconds();
+    for(uint32_t round = 0; round < rounds; round++)
+        decode_and_compare(count, size);
+    decoding = (seconds() - start) / rounds;
+    printf("throughput: encode %.1f M samples/s, decode and compare %.1f M samples/s\n",
+           count / encoding / 1e6, count / decoding / 1e6);
+}
+
+int main()
+{
+    test_shapes();
+    test_truncated();
+    benchmark();
+    printf("gorilla: ok\n");
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Measures two buses of parts, some behind a multiplexer, on the simulated I2C bus of host/idf.c:
+// every read has to come after its conversion, and a cycle has to take about the slowest one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "idf.h"
+
+#include "devices.h"
+#include "i2c.h"
+#include "measurements.h"
+
+#define CHECK(condition)    do { if(!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while(0)
+
+typedef struct {
+    device_part_t   part;
+    device_bus_t    bus;
+    uint8_t         address;
+    uint8_t         multiplexer;
+    uint8_t         channel;
+    uint32_t        conversion_time;    // milliseconds the simulated part takes, below the driver worst case
+    uint8_t         parameters;
+} part_setup_t;
+
+static const part_setup_t setups[] = {
+    { PART_SHT3X,  0, 0x45, 0, 0, 16,  2 },
+    { PART_BH1750, 0, 0x23, 0, 0, 120, 1 },
+    { PART_SHT4X,  0, 0x44, 1, 0, 9,   2 },
+    { PART_SHT4X,  0, 0x44, 1, 1, 9,   2 },
+    { PART_SHT3X,  1, 0x44, 0, 0, 16,  2 },
+};
+
+#define SETUPS_NUM  (sizeof(setups) / sizeof(setups[0]))
+
+static uint8_t sensirion_crc(uint8_t *data)
+{
+    uint8_t crc = 0xFF;
+
+    for(int i = 0; i < 2; i++) {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++)
+            crc = crc & 0x80 ? crc << 1 ^ 0x31 : crc << 1;
+    }
+    return crc;
+}
+
+static void setup(const part_setup_t *parts_setup, uint8_t count)
+{
+    uint8_t sensirion[6] = { 0x66, 0x66, 0, 0x80, 0x00, 0 };    // 25 C and 50 %
+    uint8_t bh1750[2] = { 0x01, 0x2C };                          // 250 lux
+
+    sensirion[2] = sensirion_crc(sensirion);
+    sensirion[5] = sensirion_crc(sensirion + 3);
+    idf_i2c_reset();
+    memset(devices, 0, sizeof(device_t) * DEVICES_NUM_MAX);
+    devices_count = count;
+    for(uint8_t i = 0; i < count; i++) {
+        const part_setup_t *part = &parts_setup[i];
+        devices[i] = (device_t) { .resource = RESOURCE_I2C, .part = part->part, .bus = part->bus, .address = part->address,
+                                  .multiplexer = part->multiplexer, .channel = part->channel };
+        CHECK(idf_i2c_add(part->bus, part->address, part->multiplexer ? part->channel : -1, part->conversion_time,
+                          part->part == PART_BH1750 ? bh1750 : sensirion, part->part == PART_BH1750 ? sizeof(bh1750) : sizeof(sensirion)));
+    }
+    measurements_count = 0;
+}
+
+// Runs a cycle of the devices set up and returns the milliseconds it took on the simulated clock.
+
+static uint32_t measure_cycle(bool expected)
+{
+    idf_time += 1000000;
+    int64_t start_time = idf_time;
+    CHECK(devices_measure_all() == expected);
+    return (idf_time - start_time) / 1000;
+}
+
+static void test_cycle()
+{
+    uint32_t sequential_time[I2C_BUSES_NUM_MAX] = { 0 };
+    uint32_t slowest_time[I2C_BUSES_NUM_MAX] = { 0 };
+    uint32_t driver_time[I2C_BUSES_NUM_MAX] = { 0 };
+    uint8_t parameters = 0;
+
+    for(uint8_t i = 0; i < SETUPS_NUM; i++) {     // each part on its own, as if measured one after another
+        setup(&setups[i], 1);
+        measure_cycle(true);
+        uint32_t time = i2c_buses[setups[i].bus].measure_time;
+        sequential_time[setups[i].bus] += time;
+        if(slowest_time[setups[i].bus] < time)
+            slowest_time[setups[i].bus] = time;
+        driver_time[setups[i].bus] += i2c_drivers[setups[i].part].conversion_time;
+        parameters += setups[i].parameters;
+    }
+
+    setup(setups, SETUPS_NUM);
+    int64_t start_time = idf_time + 1000000;
+    uint32_t cycle_time = measure_cycle(true);
+    CHECK(measurements_count == parameters);
+    for(uint8_t i = 0; i < SETUPS_NUM; i++) {
+        idf_i2c_device_t *sim = &idf_i2c_devices[i];
+        CHECK(devices[i].status == DEVICE_STATUS_WORKING);
+        CHECK(sim->reads == 1 && sim->early_reads == 0);
+        CHECK(sim->write_time - start_time < 5000);  // every bus starts right away, not after the others
+        printf("bus %u %-6s 0x%02X mux %u/%u: triggered at %5.1f ms, read at %5.1f ms, %3lu ms conversion\n", setups[i].bus,
+               parts[setups[i].part].label, setups[i].address, setups[i].multiplexer, setups[i].channel, (sim->write_time - start_time) / 1000.0,
+               (sim->read_time - start_time) / 1000.0, (unsigned long) sim->conversion_time);
+    }
+    for(device_bus_t bus = 0; bus < 2; bus++) {
+        printf("bus %u: cycle %3lu ms, predicted %3lu ms, slowest part alone %3lu ms, one by one %3lu ms, %u multiplexer writes, %u saved\n",
+               bus, (unsigned long) i2c_buses[bus].measure_time, (unsigned long) i2c_buses[bus].predicted_time, (unsigned long) slowest_time[bus],
+               (unsigned long) sequential_time[bus], i2c_buses[bus].mux_writes, i2c_buses[bus].mux_writes_saved);
+        CHECK(i2c_buses[bus].measure_time <= i2c_buses[bus].predicted_time + portTICK_PERIOD_MS);
+        CHECK(i2c_buses[bus].measure_time <= slowest_time[bus] + 2 * portTICK_PERIOD_MS);
+        CHECK(i2c_buses[bus].measure_time <= sequential_time[bus]);
+        CHECK(i2c_buses[bus].measure_time <= cycle_time);
+    }
+    CHECK(i2c_buses[0].measure_time < driver_time[0]);         // the conversions overlap
+    CHECK(cycle_time <= i2c_buses[0].measure_time + portTICK_PERIOD_MS);  // and so do the buses
+    CHECK(i2c_buses[0].mux_writes_saved > 0);
+}
+
+// The queue gets the measurements in the order of the devices, whichever bus finishes first.
+
+static void render_queue(char *buffer, size_t size)
+{
+    pbuf_t buf = { buffer, size, 0 };
+
+    for(measurements_index_t index = 0; index < measurements_count; index++)
+        CHECK(measurements_build_path(&buf, index, '/') && pbuf_printf(&buf, " %.2f\n", measurements[index].value));
+}
+
+static void test_order()
+{
+    char forward[2048], reverse[2048];
+
+    setup(setups, SETUPS_NUM);
+    measure_cycle(true);
+    render_queue(forward, sizeof(forward));
+    setup(setups, SETUPS_NUM);
+    idf_tasks_reverse = true;
+    measure_cycle(true);
+    idf_tasks_reverse = false;
+    render_queue(reverse, sizeof(reverse));
+    CHECK(!strcmp(forward, reverse));
+}
+
+// Without tasks every bus is measured inline, one after another, and still gets its time recorded.
+
+static void test_inline()
+{
+    setup(setups, SETUPS_NUM);
+    for(device_bus_t bus = 0; bus < 2; bus++)
+        i2c_buses[bus].measure_time = 0;
+    idf_tasks_fail = true;
+    uint32_t cycle_time = measure_cycle(true);
+    idf_tasks_fail = false;
+    for(uint8_t i = 0; i < SETUPS_NUM; i++)
+        CHECK(devices[i].status == DEVICE_STATUS_WORKING);
+    CHECK(i2c_buses[0].measure_time > 0 && i2c_buses[1].measure_time > 0);
+    CHECK(cycle_time >= i2c_buses[0].measure_time + i2c_buses[1].measure_time);
+}
+
+static void test_missing()
+{
+    setup(setups, SETUPS_NUM);
+    idf_i2c_devices_count--;                    // the last part does not answer
+    measure_cycle(false);
+    CHECK(devices[SETUPS_NUM - 1].status == DEVICE_STATUS_ERROR);
+    for(uint8_t i = 0; i < SETUPS_NUM - 1; i++)
+        CHECK(devices[i].status == DEVICE_STATUS_WORKING);
+}
+
+int main()
+{
+    i2c_buses_count = 2;
+    for(uint8_t bus = 0; bus < i2c_buses_count; bus++)
+        i2c_buses[bus] = (i2c_bus_t) { .port = bus, .speed = 100000, .enabled = true, .active = true };
+    test_cycle();
+    test_order();
+    test_inline();
+    test_missing();
+    printf("i2c: ok\n");
+    return 0;
+}
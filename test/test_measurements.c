@@ -0,0 +1,108 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Appends to the queue more distinct series over time than the dictionary holds at once: an entry has
+// to be free again when the last measurement of its series is overwritten. The same goes for the
+// series of the blocks of ADC bursts, and for the room of their samples, once they are cleared.
+// Then reports the samples of a device with both an absolute and a relative deadband.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "idf.h"
+
+#include "application.h"
+#include "devices.h"
+#include "measurements.h"
+
+#define CHECK(condition)    do { if(!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while(0)
+
+#define SERIES_LIVE     (MEASUREMENTS_SERIES_NUM_MAX / 2)
+
+static bool append(uint32_t series, uint32_t n)
+{
+    return measurements_append(0, RESOURCE_I2C, 0, 0, 0, series, PART_SHT3X, 0, METRIC_Temperature,
+                               1700000000000LL + n * 1000, UNIT_Cel, 20 + n * 0.25f);
+}
+
+static uint32_t series_used()
+{
+    uint32_t used = 0;
+
+    for(uint32_t series = 0; series < MEASUREMENTS_SERIES_NUM_MAX; series++)
+        used += measurements_series[series].references != 0;
+    return used;
+}
+
+static void test_full()
+{
+    measurements_init();
+    for(uint32_t series = 0; series < MEASUREMENTS_SERIES_NUM_MAX; series++)
+        CHECK(append(series, series));
+    CHECK(!append(MEASUREMENTS_SERIES_NUM_MAX, MEASUREMENTS_SERIES_NUM_MAX));
+    CHECK(measurements_count == MEASUREMENTS_SERIES_NUM_MAX && series_used() == MEASUREMENTS_SERIES_NUM_MAX);
+}
+
+// Each generation of series fills the whole queue, overwriting the one before.
+
+static void test_reuse()
+{
+    measurements_init();
+    for(uint32_t generation = 0; generation < 4; generation++) {
+        for(uint32_t n = 0; n < MEASUREMENTS_NUM_MAX; n++)
+            CHECK(append(generation * SERIES_LIVE + n % SERIES_LIVE, generation * MEASUREMENTS_NUM_MAX + n));
+        CHECK(measurements_full && series_used() == SERIES_LIVE);
+        for(uint32_t n = 0; n < MEASUREMENTS_NUM_MAX; n++)
+            CHECK(measurements_series[measurements[n].series].address / SERIES_LIVE == generation);
+    }
+}
+
+// A burst for every cycle, as many cycles as the blocks of one of them would otherwise use up.
+
+static void test_blocks()
+{
+    measurements_init();
+    for(uint32_t burst = 0; burst < MEASUREMENTS_BLOCK_SAMPLES_NUM_MAX; burst++) {
+        measurements_blocks_clear();
+        for(uint32_t channel = 0; channel < MEASUREMENTS_BLOCKS_NUM_MAX; channel++) {
+            int block = measurements_block_begin(0, RESOURCE_ADC, 0, 0, 0, 0, 0, channel, METRIC_ADCvalue, UNIT_NONE,
+                                                 1700000000000LL + burst * 1000, 1000, 2);
+            CHECK(block == channel && measurements_blocks[block].first == channel * 2);
+            CHECK(measurements_block_append(block, burst) && measurements_block_append(block, channel));
+        }
+        CHECK(series_used() == MEASUREMENTS_BLOCKS_NUM_MAX);
+    }
+    measurements_blocks_clear();
+    CHECK(!measurements_blocks_count && !series_used());
+}
+
+// A sample is reported when it leaves either band: with 1.00 and 2 % around 20, a change of 0.5 leaves
+// the relative band only, one of 0.2 stays within both.
+
+static void test_deadband()
+{
+    static const float samples[] = { 20, 20.2, 20.5, 20.6 };
+    static const bool reported[] = { true, false, true, false };
+
+    measurements_init();
+    memset(devices, 0, sizeof(device_t) * DEVICES_NUM_MAX);
+    devices[0] = (device_t) { .resource = RESOURCE_I2C, .part = PART_SHT3X, .address = 0x44, .deadband = 100, .deadband_percent = 2 };
+    devices_count = 1;
+    for(uint32_t n = 0; n < sizeof(samples) / sizeof(samples[0]); n++) {
+        measurements_index_t count = measurements_count;
+        CHECK(measurements_append_from_device(0, 0, METRIC_Temperature, 1700000000000LL + n * 1000, UNIT_Cel, samples[n]));
+        CHECK(measurements_count - count == reported[n]);
+    }
+}
+
+int main()
+{
+    application.queue = true;
+    test_full();
+    test_reuse();
+    test_blocks();
+    test_deadband();
+    printf("measurements: ok\n");
+    return 0;
+}
@@ -0,0 +1,224 @@
+// Copyright (c) 2024 José Francisco Castro <me@fran.cc>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Runs the flash store over a temporary file standing for the partition: appends across sectors,
+// reads back, reopens to recover the head and the cursors, and wraps over undelivered records, also
+// past the cursor of one backend while another one keeps up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+
+#define CHECK(condition)    do { if(!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); exit(1); } } while(0)
+
+static FILE *file;
+static store_sequence_t saved_cursors[BACKENDS_NUM_MAX];
+static bool cursors_saved = false;
+
+static bool file_read(uint32_t offset, void *data, size_t size)
+{
+    return !fseek(file, offset, SEEK_SET) && fread(data, 1, size, file) == size;
+}
+
+static bool file_write(uint32_t offset, const void *data, size_t size)
+{
+    uint8_t flash[STORE_SECTOR_SIZE];
+
+    if(size > sizeof(flash) || !file_read(offset, flash, size))
+        return false;
+    for(size_t i = 0; i < size; i++)
+        flash[i] &= ((const uint8_t *) data)[i];     // programming only clears bits, as on flash
+    return !fseek(file, offset, SEEK_SET) && fwrite(flash, 1, size, file) == size;
+}
+
+static bool file_erase(uint32_t offset, size_t size)
+{
+    uint8_t erased[STORE_SECTOR_SIZE];
+
+    memset(erased, 0xFF, sizeof(erased));
+    for(size_t done = 0; done < size; done += sizeof(erased))
+        if(fseek(file, offset + done, SEEK_SET) || fwrite(erased, 1, sizeof(erased), file) != sizeof(erased))
+            return false;
+    return true;
+}
+
+static bool file_read_cursors(store_sequence_t *cursors, uint8_t count)
+{
+    if(cursors_saved)
+        memcpy(cursors, saved_cursors, count * sizeof(store_sequence_t));
+    return true;
+}
+
+static bool file_write_cursors(const store_sequence_t *cursors, uint8_t count)
+{
+    memcpy(saved_cursors, cursors, count * sizeof(store_sequence_t));
+    cursors_saved = true;
+    return true;
+}
+
+static store_flash_t file_flash = {
+    .read = file_read,
+    .write = file_write,
+    .erase = file_erase,
+    .read_cursors = file_read_cursors,
+    .write_cursors = file_write_cursors,
+};
+
+static void open_flash(uint32_t sectors)
+{
+    file = tmpfile();
+    CHECK(file);
+    file_flash.size = sectors * STORE_SECTOR_SIZE;
+    CHECK(file_erase(0, file_flash.size));
+    cursors_saved = false;
+}
+
+// Sample n of a node with a few series measured every minute, with slowly changing values.
+
+static measurement_frame_t sample(uint32_t n)
+{
+    return (measurement_frame_t) {
+        .node = 0x0000AABBCCDDEEFF,
+        .descriptor = 0x0100100000000000 | (uint64_t) (n % 5) << 36,
+        .address = n % 5,
+        .timestamp = 1700000000 + n / 5 * 60,
+        .value = 20 + (n % 5) + (n / 5 % 16) * 0.125f,
+    };
+}
+
+static bool same(measurement_frame_t *a, measurement_frame_t *b)
+{
+    return a->node == b->node && a->descriptor == b->descriptor && a->address == b->address &&
+           a->timestamp == b->timestamp && a->value == b->value;
+}
+
+static void test_append_and_read()
+{
+    measurement_frame_t frame, expected;
+    store_sector_header_t header;
+    uint32_t count = 5000;
+
+    open_flash(16);
+    CHECK(store_init(&file_flash));
+    CHECK(store.head == 0 && store.tail == 0);
+    for(uint32_t n = 0; n < count; n++) {
+        frame = sample(n);
+        CHECK(store_append(&frame));
+    }
+    CHECK(store.head == count && store.tail == 0);
+    CHECK(store_seek(0));
+    for(uint32_t n = 0; n < count; n++) {
+        expected = sample(n);
+        CHECK(store_read_next(&frame) && same(&frame, &expected));
+    }
+    CHECK(!store_read_next(&frame));
+    CHECK(store_read(1234, &frame) && (expected = sample(1234), same(&frame, &expected)));
+    CHECK(file_read(STORE_SECTOR_SIZE, &header, sizeof(header)));
+    printf("append and read: %lu records in the first sector, %.1f bytes each\n", (unsigned long) header.first_record,
+           (double) (STORE_SECTOR_SIZE - sizeof(header)) / header.first_record);
+    fclose(file);
+}
+
+static void test_reopen()
+{
+    measurement_frame_t frame, expected;
+
+    open_flash(8);
+    CHECK(store_init(&file_flash));
+    store.backends = 1;
+    for(uint32_t n = 0; n < 1000; n++) {
+        frame = sample(n);
+        CHECK(store_append(&frame));
+    }
+    CHECK(store_pending(0) == 1000);
+    CHECK(store_advance(0, 400));
+
+    CHECK(store_init(&file_flash));                 // as after a reset
+    store.backends = 1;
+    CHECK(store.head == 1000 && store.tail == 0);
+    CHECK(store.cursors[0] == 400 && store_pending(0) == 600);
+    for(uint32_t n = 1000; n < 1500; n++) {         // carries on with the compression state of the head sector
+        frame = sample(n);
+        CHECK(store_append(&frame));
+    }
+    CHECK(store_seek(store.cursors[0]));
+    for(uint32_t n = 400; n < 1500; n++) {
+        expected = sample(n);
+        CHECK(store_read_next(&frame) && same(&frame, &expected));
+    }
+    printf("reopen: head %lu, cursor %lu\n", (unsigned long) store.head, (unsigned long) store.cursors[0]);
+    fclose(file);
+}
+
+static void test_wrap()
+{
+    measurement_frame_t frame, expected;
+    uint32_t count = 20000;
+
+    open_flash(4);
+    CHECK(store_init(&file_flash));
+    store.backends = 1;
+    for(uint32_t n = 0; n < count; n++) {
+        frame = sample(n);
+        CHECK(store_append(&frame));
+    }
+    CHECK(store.head == count && store.tail > 0);
+    CHECK(store_pending(0) == count - store.tail);  // the undelivered records overwritten are skipped
+    CHECK(store.cursors[0] == store.tail);
+    CHECK(store_usage() == 100);
+    CHECK(!store_seek(store.tail - 1));
+    CHECK(store_seek(store.tail));
+    for(uint32_t n = store.tail; n < count; n++) {
+        expected = sample(n);
+        CHECK(store_read_next(&frame) && same(&frame, &expected));
+    }
+    CHECK(store_advance(0, store_pending(0)) && store_usage() == 0);
+
+    CHECK(store_init(&file_flash));
+    CHECK(store.head == count);
+    printf("wrap: head %lu, tail %lu\n", (unsigned long) store.head, (unsigned long) store.tail);
+    fclose(file);
+}
+
+// Backend 0 gets every record as it is stored, backend 1 stops after some and the log wraps past it.
+
+static void test_wrap_cursor()
+{
+    measurement_frame_t frame, expected;
+    uint32_t count = 20000;
+    uint32_t delivered = 1000;
+
+    open_flash(4);
+    CHECK(store_init(&file_flash));
+    store.backends = 3;
+    for(uint32_t n = 0; n < count; n++) {
+        frame = sample(n);
+        CHECK(store_append(&frame));
+        CHECK(store_advance(0, 1));
+        if(n < delivered)
+            CHECK(store_advance(1, 1));
+    }
+    CHECK(store.tail > delivered);
+    CHECK(store.cursors[1] == delivered && store.cursors[1] < store.tail);
+    CHECK(store_pending(1) == store.head - store.tail);
+    CHECK(store.cursors[1] == store.tail);
+    CHECK(store_pending(0) == 0 && store.cursors[0] == count);
+    CHECK(store_seek(store.cursors[1]) && store_read_next(&frame));
+    expected = sample(store.tail);
+    CHECK(same(&frame, &expected));
+    printf("wrap cursor: backend 1 from %lu to %lu, tail %lu\n", (unsigned long) delivered,
+           (unsigned long) store.cursors[1], (unsigned long) store.tail);
+    fclose(file);
+}
+
+int main()
+{
+    test_append_and_read();
+    test_reopen();
+    test_wrap();
+    test_wrap_cursor();
+    printf("store: ok\n");
+    return 0;
+}
@@ -50,6 +50,12 @@ Actions:
     delete <resource> [file]  Deletes the specified resource. If a JSON file
                               is provided, its content is used as query.
 
+    tail [series] [period]    Prints the measurements as they are taken,
+                              asking every period seconds (10 by default)
+                              for the ones after the last printed. Only the
+                              measurements with paths containing the series
+                              string are printed, if given.
+
 """ % sys.argv[0]
 
 if len(sys.argv) < 2:
@@ -61,7 +67,21 @@ pm.debug = False
 time.sleep(1.5)     # workaround for Arduino bootloader bug that eats the first bytes after opening the port
 
 try:
-    if len(sys.argv) > 3:
+    if len(sys.argv) > 2 and sys.argv[2] == "tail":
+        action = "tail"
+        resource = ["measurements"]
+        query = { "series": sys.argv[3] } if len(sys.argv) > 3 else {}
+        period = float(sys.argv[4]) if len(sys.argv) > 4 else 10
+        while True:
+            response = pm.get(resource, query)
+            if response[0] != PM_205_Content:
+                raise PostmanError(PM_RESPONSE_TEXT.get(response[0], hex(response[0])))
+            for path, timestamp, unit, value in response[1]["measurements"]:
+                print("%s %s %s %s" % (time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(timestamp)), path, value, unit))
+            query["cursor"] = response[1]["cursor"]
+            if not response[1]["more"]:
+                time.sleep(period)
+    elif len(sys.argv) > 3:
         action = sys.argv[2]
         resource = sys.argv[3]
         filename = sys.argv[4] if len(sys.argv) > 4 else None
@@ -100,3 +120,5 @@ try:
         print(json.dumps(response[1], sort_keys=True, indent=4, cls=BytesEncoder))
 except PostmanError as err:
     print("Cannot %s the '%s' resource: %s" % (action, resource, err))
+except KeyboardInterrupt:
+    pass